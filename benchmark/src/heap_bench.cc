@@ -0,0 +1,408 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+/*
+ * Measures IndIntruHeap at branching factors 2 to 16: push, pop,
+ * adjust, promote, demote and remove, on heaps of 16 to 64k elements
+ * the size of a ClientRec, each allocated on its own as the queue
+ * allocates them. Tags grow as virtual time does, as dmclock's do:
+ * demote is the top being dispatched and tagged later, promote an
+ * element being pulled forward, adjust one being retagged either way.
+ *
+ * After the run each heap role -- the reservation heap, the
+ * proportion heaps and the limit heaps -- is charged its mix of
+ * operations per dispatch (see roles below) at every K, and the
+ * cheapest K is suggested as a HeapBranching (src/dmclock_server.h).
+ *
+ *   make dmclock-benchmarks && ./benchmark/dmc_heap_bench
+ *   ./benchmark/dmc_heap_bench --benchmark_filter=/n:4096
+ */
+
+
+#include <unistd.h>
+
+#include <map>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <iostream>
+
+#include <benchmark/benchmark.h>
+
+#include "dmclock_server.h"
+#include "indirect_intrusive_heap.h"
+
+
+namespace c = crimson;
+namespace dmc = crimson::dmclock;
+
+namespace {
+
+    struct Request {
+    };
+
+    using ClientRec = dmc::PriorityQueueBase<int, Request, false, 2>::ClientRec;
+
+    // a tag and heap index padded out to a ClientRec
+    struct Element {
+        double tag;
+        c::IndIntruHeapData heap_data{};
+        char payload[sizeof(ClientRec) > sizeof(double) + sizeof(c::IndIntruHeapData) ?
+                     sizeof(ClientRec) - sizeof(double) - sizeof(c::IndIntruHeapData) : 1];
+    };
+
+    using ElementRef = std::shared_ptr<Element>;
+
+    struct ElementCompare {
+        bool operator()(const Element &e1, const Element &e2) const {
+            return e1.tag < e2.tag;
+        }
+    };
+
+    template<uint K>
+    using Heap = c::IndIntruHeap<ElementRef, Element, &Element::heap_data, ElementCompare, K>;
+
+
+    enum Op {
+        op_push, op_pop, op_adjust, op_promote, op_demote, op_remove, op_count
+    };
+
+    const char *op_names[] = {"push", "pop", "adjust", "promote", "demote", "remove"};
+
+    // operations timed together, between the untimed steps that restore
+    // the heap's size; at most half the heap
+    const int batch = 256;
+
+    int batch_for(int64_t n) {
+        return std::min(int64_t(batch), n / 2);
+    }
+
+
+    // The heap of one benchmark and the virtual time its tags follow.
+    // A new tag lies up to one heap's worth of dispatches ahead of now.
+    template<uint K>
+    class HeapState {
+        std::mt19937_64 rng;
+        double now = 0.0;
+
+    public:
+
+        Heap<K> heap;
+        std::vector<ElementRef> elements;
+        const size_t n;
+
+        explicit HeapState(size_t _n) :
+                rng(_n * 31 + K),
+                n(_n) {
+            for (size_t i = 0; i < n; ++i) {
+                elements.emplace_back(std::make_shared<Element>());
+                elements.back()->tag = next_tag();
+                heap.push(elements.back());
+            }
+        }
+
+        double next_tag() {
+            now += 1.0;
+            return now + std::uniform_real_distribution<double>(0.0, double(n))(rng);
+        }
+
+        const ElementRef &any() {
+            return elements[std::uniform_int_distribution<size_t>(0, n - 1)(rng)];
+        }
+
+        double pull_forward(double tag) {
+            return tag - std::uniform_real_distribution<double>(0.0, double(n) / 2)(rng);
+        }
+    };
+
+
+    double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+
+    template<uint K>
+    void BM_heap(benchmark::State &state, Op op) {
+        HeapState<K> s(state.range(0));
+        const int count = batch_for(s.n);
+        ElementRef held[batch];
+
+        for (auto _ : state) {
+            switch (op) {
+                case op_push: {
+                    // take batch out, untimed, then time putting them back
+                    for (int i = 0; i < count; ++i) {
+                        held[i] = s.heap.top_ind();
+                        s.heap.pop();
+                        held[i]->tag = s.next_tag();
+                    }
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        s.heap.push(std::move(held[i]));
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    break;
+                }
+                case op_pop: {
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        held[i] = s.heap.top_ind();
+                        s.heap.pop();
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    for (int i = 0; i < count; ++i) {
+                        held[i]->tag = s.next_tag();
+                        s.heap.push(std::move(held[i]));
+                    }
+                    break;
+                }
+                case op_adjust: {
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        Element &e = *s.any();
+                        e.tag = s.next_tag();
+                        s.heap.adjust(e);
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    break;
+                }
+                case op_promote: {
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        Element &e = *s.any();
+                        e.tag = s.pull_forward(e.tag);
+                        s.heap.promote(e);
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    break;
+                }
+                case op_demote: {
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        Element &top = s.heap.top();
+                        top.tag = s.next_tag();
+                        s.heap.demote(top);
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    break;
+                }
+                case op_remove: {
+                    // found by a search from the bottom, as
+                    // delete_from_heap does
+                    for (int i = 0; i < count; ++i) {
+                        held[i] = s.any();
+                    }
+                    bool removed[batch];
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < count; ++i) {
+                        // an element picked twice is already out
+                        auto it = s.heap.rfind(held[i]);
+                        removed[i] = it != s.heap.end();
+                        if (removed[i]) {
+                            s.heap.remove(it);
+                        }
+                    }
+                    state.SetIterationTime(seconds_since(start));
+                    for (int i = 0; i < count; ++i) {
+                        if (removed[i]) {
+                            held[i]->tag = s.next_tag();
+                            s.heap.push(held[i]);
+                        }
+                        held[i].reset();
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * count);
+    }
+
+
+    // Operations per dispatched request on each role's heaps, from what
+    // the queue does to them: a dispatch demotes the top of the
+    // dispatching heap and retags the client in its limit heap; a limit
+    // tag coming due demotes the limit heap's top and promotes the
+    // client in its proportion heap; a proportion dispatch of an R
+    // client pulls its reservation tag forward; an add retags the
+    // client everywhere. A client is pushed when it arrives and removed
+    // when erased, once over thousands of its requests; the heaps are
+    // never popped.
+    struct Role {
+        const char *name;
+        std::vector<const char *> members;  // of HeapBranching
+        double ops[op_count];
+    };
+
+    const Role roles[] = {
+            {"reservation", {"resv"},
+                    {0.0001, 0.0, 1.0, 0.5, 1.0, 0.0001}},
+            {"proportion", {"deltar", "burst", "best"},
+                    {0.0001, 0.0, 1.0, 1.0, 1.0, 0.0001}},
+            {"limit", {"r_limit", "limit", "best_limit"},
+                    {0.0001, 0.0, 2.0, 0.0, 1.0, 0.0001}},
+    };
+
+    const std::vector<int64_t> heap_sizes = {16, 256, 4096, 65536};
+    const uint min_k = 2;
+    const uint max_k = 16;
+
+
+    // Passes every run on to the console and keeps its time per
+    // operation by K, operation and heap size.
+    class RecommendingReporter : public benchmark::ConsoleReporter {
+    public:
+
+        using ConsoleReporter::ConsoleReporter;
+
+        // ns per operation, by K, then size, then operation
+        std::map<uint, std::map<int64_t, std::array<double, op_count>>> costs;
+
+        // run names are "K:<k>/<op>/n:<size>"
+        void ReportRuns(const std::vector<Run> &runs) override {
+            for (const auto &run : runs) {
+                unsigned k;
+                char op[16];
+                long long n;
+                if (run.run_type != Run::RT_Iteration || run.error_occurred ||
+                    3 != sscanf(run.benchmark_name().c_str(), "K:%u/%15[a-z]/n:%lld",
+                                &k, op, &n)) {
+                    continue;
+                }
+                for (int o = 0; o < op_count; ++o) {
+                    if (std::string(op_names[o]) == op) {
+                        auto &by_size = costs[k];
+                        if (by_size.end() == by_size.find(n)) {
+                            by_size[n].fill(-1.0);  // not measured
+                        }
+                        by_size[n][o] = run.GetAdjustedRealTime() / batch_for(n);
+                    }
+                }
+            }
+            ConsoleReporter::ReportRuns(runs);
+        }
+
+        // the cheapest K for each role at each heap size measured for
+        // every operation the role uses
+        void recommend(std::ostream &out) const {
+            for (int64_t n : heap_sizes) {
+                out << "\nheap size " << n << ":\n";
+                for (const auto &role : roles) {
+                    double best_cost;
+                    const uint best_k = cheapest(role, n, best_cost);
+                    out << "  " << role.name << ": ";
+                    if (0 == best_k) {
+                        out << "not measured\n";
+                    } else {
+                        out << "K=" << best_k << " (" << best_cost << " ns per dispatch)\n";
+                    }
+                }
+            }
+
+            // the largest size measured is the one worth tuning for
+            for (auto n = heap_sizes.rbegin(); n != heap_sizes.rend(); ++n) {
+                std::vector<uint> ks;
+                double cost;
+                for (const auto &role : roles) {
+                    ks.push_back(cheapest(role, *n, cost));
+                }
+                if (std::find(ks.begin(), ks.end(), 0u) != ks.end()) {
+                    continue;
+                }
+                out << "\nfor " << *n << " clients:\n\n" <<
+                    "    struct Branching : crimson::dmclock::HeapBranching<2> {\n";
+                for (size_t r = 0; r < ks.size(); ++r) {
+                    for (const char *member : roles[r].members) {
+                        out << "        static constexpr uint " << member <<
+                            " = " << ks[r] << ";\n";
+                    }
+                }
+                out << "    };\n";
+                break;
+            }
+        }
+
+    private:
+
+        // 0 when some operation the role uses was not measured at any K
+        uint cheapest(const Role &role, int64_t n, double &best_cost) const {
+            uint best_k = 0;
+            best_cost = 0.0;
+            for (const auto &by_k : costs) {
+                auto cell = by_k.second.find(n);
+                if (by_k.second.end() == cell) {
+                    continue;
+                }
+                double cost = 0.0;
+                bool complete = true;
+                for (int o = 0; o < op_count; ++o) {
+                    if (role.ops[o] > 0.0) {
+                        complete = complete && cell->second[o] >= 0.0;
+                        cost += role.ops[o] * cell->second[o];
+                    }
+                }
+                if (complete && (0 == best_k || cost < best_cost)) {
+                    best_k = by_k.first;
+                    best_cost = cost;
+                }
+            }
+            return best_k;
+        }
+    };
+
+
+    template<uint K>
+    void register_k() {
+        for (int o = 0; o < op_count; ++o) {
+            const std::string name = "K:" + std::to_string(K) + "/" + op_names[o];
+            benchmark::RegisterBenchmark(name.c_str(), BM_heap<K>, Op(o))
+                    ->ArgNames({"n"})
+                    ->ArgsProduct({heap_sizes})
+                    ->UseManualTime()
+                    ->Unit(benchmark::kNanosecond);
+        }
+    }
+
+    template<uint K>
+    void register_from() {
+        register_k<K>();
+        register_from<K + 1>();
+    }
+
+    template<>
+    void register_from<max_k + 1>() {
+    }
+
+} // namespace
+
+
+int main(int argc, char **argv) {
+    register_from<min_k>();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    RecommendingReporter reporter(isatty(STDOUT_FILENO) ?
+                                  benchmark::ConsoleReporter::OO_Color :
+                                  benchmark::ConsoleReporter::OO_None);
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    reporter.recommend(std::cout);
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,111 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+/*
+ * Measures what the OpQueue adapter costs on top of the pull queue it
+ * wraps. Each iteration adds one request and takes one out again, with
+ * state.range(0) clients keeping a few requests queued each.
+ *
+ *   make dmclock-benchmarks && ./benchmark/dmc_op_queue_bench
+ */
+
+
+#include <memory>
+
+#include <benchmark/benchmark.h>
+
+#include "dmclock_op_queue.h"
+
+
+namespace dmc = crimson::dmclock;
+
+namespace {
+
+    struct Request {
+    };
+
+    using ClientId = int;
+
+    const int queued_per_client = 4;
+
+    const dmc::ClientInfo info(0.0, 1.0, 0.0, dmc::ClientType::A);
+
+    const dmc::ClientInfo *client_info_f(ClientId) {
+        return &info;
+    }
+
+
+    void BM_pull_request(benchmark::State &state) {
+        using Queue = dmc::PullPriorityQueue<ClientId, Request>;
+        const int clients = state.range(0);
+        Queue queue(client_info_f, 1e9, 30, false);
+        const dmc::ReqParams req_params(1, 1);
+        for (int c = 0; c < clients; ++c) {
+            for (int i = 0; i < queued_per_client; ++i) {
+                queue.add_request(Request{}, c, req_params);
+            }
+        }
+
+        int client = 0;
+        for (auto _ : state) {
+            queue.add_request(Request{}, client, req_params);
+            Queue::PullReq pr = queue.pull_request();
+            benchmark::DoNotOptimize(pr);
+            client = (client + 1) % clients;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    void BM_op_queue_dequeue(benchmark::State &state) {
+        using Queue = dmc::OpQueue<ClientId, Request>;
+        const int clients = state.range(0);
+        Queue queue(client_info_f, 1e9, 30, false);
+        const dmc::ReqParams req_params(1, 1);
+        for (int c = 0; c < clients; ++c) {
+            for (int i = 0; i < queued_per_client; ++i) {
+                queue.enqueue(c, req_params, Request{});
+            }
+        }
+
+        int client = 0;
+        for (auto _ : state) {
+            queue.enqueue(client, req_params, Request{});
+            Queue::OpReq req = queue.dequeue();
+            benchmark::DoNotOptimize(req);
+            client = (client + 1) % clients;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    // the strict lane alone, for comparison with the dmclock lane
+    void BM_op_queue_strict(benchmark::State &state) {
+        using Queue = dmc::OpQueue<ClientId, Request>;
+        Queue queue(client_info_f, 1e9, 30, false);
+
+        for (auto _ : state) {
+            queue.enqueue_strict(0, 1, Request{});
+            Queue::OpReq req = queue.dequeue();
+            benchmark::DoNotOptimize(req);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+} // namespace
+
+
+BENCHMARK(BM_pull_request)->Arg(1)->Arg(16)->Arg(256);
+BENCHMARK(BM_op_queue_dequeue)->Arg(1)->Arg(16)->Arg(256);
+BENCHMARK(BM_op_queue_strict);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,134 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+/*
+ * Measures what the runtime-switched timers cost a pull queue: off,
+ * on with the default sampling, and on timing every call. Each
+ * iteration adds one request and pulls one, with 16 clients keeping a
+ * few requests queued each. BM_add_pull_perf reports the hardware
+ * counters of each add and each pull.
+ *
+ *   make dmclock-benchmarks && ./benchmark/dmc_profile_bench
+ */
+
+
+#include <benchmark/benchmark.h>
+
+#include "dmclock_server.h"
+#include "perf_counters.h"
+
+
+namespace dmc = crimson::dmclock;
+
+namespace {
+
+    struct Request {
+    };
+
+    using ClientId = int;
+    using Queue = dmc::PullPriorityQueue<ClientId, Request>;
+
+    const int clients = 16;
+    const int queued_per_client = 4;
+
+    const dmc::ClientInfo info(0.0, 1.0, 0.0, dmc::ClientType::A);
+
+    const dmc::ClientInfo *client_info_f(ClientId) {
+        return &info;
+    }
+
+
+    // state.range(0): 0 is off, otherwise the timers are on with a
+    // sample shift of state.range(0) - 1
+    void BM_add_pull(benchmark::State &state) {
+        Queue queue(client_info_f, 1e9, 30, false);
+        if (state.range(0) > 0) {
+            queue.enable_profiling(true, unsigned(state.range(0) - 1));
+        }
+        const dmc::ReqParams req_params(1, 1);
+        for (int c = 0; c < clients; ++c) {
+            for (int i = 0; i < queued_per_client; ++i) {
+                queue.add_request(Request{}, c, req_params);
+            }
+        }
+
+        int client = 0;
+        for (auto _ : state) {
+            queue.add_request(Request{}, client, req_params);
+            Queue::PullReq pr = queue.pull_request();
+            benchmark::DoNotOptimize(pr);
+            client = (client + 1) % clients;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    // hardware counters per add and per pull, reported as counters of
+    // the benchmark; skipped where perf_event_open is unavailable
+    void BM_add_pull_perf(benchmark::State &state) {
+        crimson::PerfProfile add_perf;
+        crimson::PerfProfile pull_perf;
+        if (!add_perf.set_enabled(true) || !pull_perf.set_enabled(true)) {
+            state.SkipWithError("hardware counters unavailable");
+            return;
+        }
+        Queue queue(client_info_f, 1e9, 30, false);
+        const dmc::ReqParams req_params(1, 1);
+        for (int c = 0; c < clients; ++c) {
+            for (int i = 0; i < queued_per_client; ++i) {
+                queue.add_request(Request{}, c, req_params);
+            }
+        }
+
+        int client = 0;
+        for (auto _ : state) {
+            {
+                auto perf = add_perf.measure();
+                queue.add_request(Request{}, client, req_params);
+            }
+            auto perf = pull_perf.measure();
+            Queue::PullReq pr = queue.pull_request();
+            benchmark::DoNotOptimize(pr);
+            client = (client + 1) % clients;
+        }
+        for (unsigned e = 0; e < crimson::perf_event_count; ++e) {
+            const crimson::PerfEvent event = crimson::PerfEvent(e);
+            state.counters[std::string("add_") + crimson::perf_event_name(event)] =
+                    add_perf.get_mean(event);
+            state.counters[std::string("pull_") + crimson::perf_event_name(event)] =
+                    pull_perf.get_mean(event);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    // the timer alone: one sampled scope per iteration
+    void BM_measure(benchmark::State &state) {
+        crimson::RuntimeProfile profile;
+        if (state.range(0) > 0) {
+            profile.set_enabled(true, unsigned(state.range(0) - 1));
+        }
+        for (auto _ : state) {
+            auto timing = profile.measure();
+            benchmark::ClobberMemory();
+        }
+    }
+
+} // namespace
+
+
+// off, every 64th call (the default), every call
+BENCHMARK(BM_add_pull)->Arg(0)->Arg(7)->Arg(1);
+BENCHMARK(BM_measure)->Arg(0)->Arg(7)->Arg(1);
+BENCHMARK(BM_add_pull_perf);
+
+BENCHMARK_MAIN();
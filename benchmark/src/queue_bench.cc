@@ -0,0 +1,390 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+/*
+ * Measures the scheduler itself: adding and dispatching a request on
+ * the pull and push queues, for 1 to 100k clients, each client-type
+ * mix and heap branching factors 2, 3, 4 and 8; then the cost of
+ * reactivating an idle client, of a window rollover and of do_clean.
+ * Built twice, with tags calculated when a request reaches the front
+ * of its client's queue (the default) and with DO_NOT_DELAY_TAG_CALC;
+ * the JSON context says which ("tag_calc").
+ *
+ * Besides the mean time per operation, add and dispatch sample one
+ * call in 64 and report the p50, p99 and max of those in nanoseconds.
+ *
+ *   make dmclock-bench    # both builds, results in queue_bench*.json
+ *   ./benchmark/dmc_queue_bench --benchmark_filter='BM_add<Pull<2>>'
+ */
+
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "dmclock_server.h"
+
+
+namespace dmc = crimson::dmclock;
+
+namespace {
+
+    struct Request {
+    };
+
+    using ClientId = int;
+
+    // state.range(1) of the add and dispatch benchmarks; mix_all gives
+    // the clients the four types in turn
+    enum Mix {
+        mix_r, mix_b, mix_a, mix_o, mix_all
+    };
+
+    const char *mix_names[] = {"R", "B", "A", "O", "RBAO"};
+
+    const dmc::ClientInfo infos[] = {
+            dmc::ClientInfo(100.0, 1.0, 0.0, dmc::ClientType::R),
+            dmc::ClientInfo(0.0, 1.0, 1000.0, dmc::ClientType::B),
+            dmc::ClientInfo(0.0, 1.0, 0.0, dmc::ClientType::A),
+            dmc::ClientInfo(0.0, 1.0, 0.0, dmc::ClientType::O),
+    };
+
+    std::function<const dmc::ClientInfo *(const ClientId &)> client_info_f(Mix mix) {
+        return [mix](const ClientId &client) {
+            return &infos[mix_all == mix ? client % 4 : mix];
+        };
+    }
+
+    const dmc::ReqParams req_params(1, 1);
+
+    // operations between refills or drains, which are not timed
+    const int batch = 1024;
+
+
+    // Times one call in every 64 and puts the percentiles of those
+    // into the counters, so they reach the JSON output.
+    class LatencySampler {
+        static const uint64_t sample_mask = 63;
+
+        std::vector<double> samples;
+        uint64_t calls = 0;
+
+    public:
+
+        template<typename Op>
+        void run(Op &&op) {
+            if (calls++ & sample_mask) {
+                op();
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            op();
+            samples.push_back(std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start).count());
+        }
+
+        void report(benchmark::State &state) {
+            if (samples.empty()) {
+                return;
+            }
+            std::sort(samples.begin(), samples.end());
+            state.counters["p50_ns"] = samples[samples.size() / 2];
+            state.counters["p99_ns"] = samples[samples.size() * 99 / 100];
+            state.counters["max_ns"] = samples.back();
+        }
+    };
+
+
+    // A queue with what the benchmarks need of it: add a request for a
+    // client, dispatch one. Requests are added round robin over the
+    // clients.
+    template<uint B>
+    class Pull {
+        using Queue = dmc::PullPriorityQueue<ClientId, Request, false, B>;
+
+        Queue queue;
+        int clients;
+        int next_client = 0;
+
+    public:
+
+        Pull(Mix mix, int _clients) :
+                queue(client_info_f(mix), 1e9, 30, true),
+                clients(_clients) {
+            // empty
+        }
+
+        void add() {
+            queue.add_request(Request{}, next_client, req_params);
+            next_client = (next_client + 1) % clients;
+        }
+
+        bool dispatch() {
+            typename Queue::PullReq pr = queue.pull_request();
+            return pr.is_retn();
+        }
+    };
+
+
+    // dispatch is a completion that lets exactly one request through
+    template<uint B>
+    class Push {
+        using Queue = dmc::PushPriorityQueue<ClientId, Request, false, B>;
+
+        bool accepting = false;
+        uint64_t handled = 0;
+        Queue queue;
+        int clients;
+        int next_client = 0;
+
+    public:
+
+        Push(Mix mix, int _clients) :
+                queue(client_info_f(mix),
+                      [this]() { return accepting; },
+                      [this](const ClientId &, typename Queue::RequestRef, dmc::PhaseType) {
+                          ++handled;
+                          accepting = false;
+                      },
+                      1e9, 30, true),
+                clients(_clients) {
+            // empty
+        }
+
+        void add() {
+            queue.add_request(Request{}, next_client, req_params);
+            next_client = (next_client + 1) % clients;
+        }
+
+        bool dispatch() {
+            const uint64_t before = handled;
+            accepting = true;
+            queue.request_completed();
+            accepting = false;
+            return handled != before;
+        }
+    };
+
+
+    // at least two requests per client, and enough for a batch
+    template<typename Harness>
+    void fill(Harness &harness, int clients) {
+        const int requests = std::max(2 * clients, 2 * batch);
+        for (int i = 0; i < requests; ++i) {
+            harness.add();
+        }
+    }
+
+
+    // state.range(0) clients, state.range(1) the Mix
+    template<typename Harness>
+    void BM_add(benchmark::State &state) {
+        const int clients = state.range(0);
+        const Mix mix = Mix(state.range(1));
+        Harness harness(mix, clients);
+        fill(harness, clients);
+
+        LatencySampler sampler;
+        int pending = 0;
+        for (auto _ : state) {
+            sampler.run([&harness]() { harness.add(); });
+            if (++pending == batch) {
+                state.PauseTiming();
+                for (; pending > 0 && harness.dispatch(); --pending) {
+                }
+                pending = 0;
+                state.ResumeTiming();
+            }
+        }
+        state.SetItemsProcessed(state.iterations());
+        state.SetLabel(mix_names[mix]);
+        sampler.report(state);
+    }
+
+
+    template<typename Harness>
+    void BM_dispatch(benchmark::State &state) {
+        const int clients = state.range(0);
+        const Mix mix = Mix(state.range(1));
+        Harness harness(mix, clients);
+        fill(harness, clients);
+
+        LatencySampler sampler;
+        uint64_t dispatched = 0;
+        int pending = 0;
+        for (auto _ : state) {
+            sampler.run([&harness, &dispatched]() {
+                dispatched += harness.dispatch();
+            });
+            if (++pending == batch) {
+                state.PauseTiming();
+                for (; pending > 0; --pending) {
+                    harness.add();
+                }
+                state.ResumeTiming();
+            }
+        }
+        state.SetItemsProcessed(dispatched);
+        state.SetLabel(mix_names[mix]);
+        // below 1 when some calls found nothing ready
+        state.counters["dispatched"] =
+                state.iterations() ? double(dispatched) / state.iterations() : 0.0;
+        sampler.report(state);
+    }
+
+
+    // reaches the parts of the queue the benchmarks below set up
+    template<uint B>
+    class OpenQueue : public dmc::PullPriorityQueue<ClientId, Request, false, B> {
+        using super = dmc::PullPriorityQueue<ClientId, Request, false, B>;
+
+    public:
+
+        using dmc::PullPriorityQueue<ClientId, Request, false, B>::PullPriorityQueue;
+        using super::do_clean;
+
+        void make_idle(ClientId client) {
+            std::lock_guard<std::mutex> g(this->data_mtx);
+            this->client_map[client]->idle = true;
+        }
+
+        // a mark point older than idle_age, so every do_clean walks
+        // the clients to mark them idle
+        void add_idle_mark() {
+            std::lock_guard<std::mutex> g(this->data_mtx);
+            this->clean_mark_points.emplace_front(
+                    std::chrono::steady_clock::now() - std::chrono::minutes(11),
+                    this->tick);
+        }
+    };
+
+
+    double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+
+    // adding for an idle client looks through every other client for
+    // the lowest proportion tag
+    template<uint B>
+    void BM_reactivate(benchmark::State &state) {
+        const int clients = state.range(0);
+        OpenQueue<B> queue(client_info_f(mix_all), 1e9, 30, true);
+        for (int c = 0; c < clients; ++c) {
+            queue.add_request(Request{}, c, req_params);
+        }
+
+        int client = 0;
+        for (auto _ : state) {
+            queue.make_idle(client);
+            auto start = std::chrono::steady_clock::now();
+            queue.add_request(Request{}, client, req_params);
+            state.SetIterationTime(seconds_since(start));
+            benchmark::DoNotOptimize(queue.pull_request());
+            client = (client + 1) % clients;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    // pulls a window apart, so each pull rolls the window over; this
+    // includes appending every client's counts to scheduling.txt
+    template<uint B>
+    void BM_rollover(benchmark::State &state) {
+        const int clients = state.range(0);
+        OpenQueue<B> queue(client_info_f(mix_all), 1e9, 1.0, true);
+        for (int c = 0; c < clients; ++c) {
+            queue.add_request(Request{}, c, req_params);
+            queue.add_request(Request{}, c, req_params);
+        }
+
+        dmc::Time now = dmc::get_time();
+        int client = 0;
+        for (auto _ : state) {
+            now += 1.0;
+            auto start = std::chrono::steady_clock::now();
+            benchmark::DoNotOptimize(queue.pull_request(now));
+            state.SetIterationTime(seconds_since(start));
+            queue.add_request(Request{}, client, req_params);
+            client = (client + 1) % clients;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    // state.range(1): 0 when no client has been idle for long, so
+    // do_clean only notes a mark point; 1 when it walks every client
+    template<uint B>
+    void BM_do_clean(benchmark::State &state) {
+        const int clients = state.range(0);
+        OpenQueue<B> queue(client_info_f(mix_all), 1e9, 30, true);
+        for (int c = 0; c < clients; ++c) {
+            queue.add_request(Request{}, c, req_params);
+        }
+        if (state.range(1)) {
+            queue.add_idle_mark();
+        }
+
+        for (auto _ : state) {
+            queue.do_clean();
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+
+    const std::vector<int64_t> client_counts = {1, 10, 100, 1000, 10000, 100000};
+
+    void client_mixes(benchmark::internal::Benchmark *b) {
+        b->ArgNames({"clients", "mix"})
+                ->ArgsProduct({client_counts, {mix_r, mix_b, mix_a, mix_o, mix_all}});
+    }
+
+    void client_range(benchmark::internal::Benchmark *b) {
+        b->ArgNames({"clients"})->ArgsProduct({client_counts});
+    }
+
+} // namespace
+
+
+#define DMC_QUEUE_BENCHMARKS(B)                                             \
+    BENCHMARK_TEMPLATE(BM_add, Pull<B>)->Apply(client_mixes);               \
+    BENCHMARK_TEMPLATE(BM_dispatch, Pull<B>)->Apply(client_mixes);          \
+    BENCHMARK_TEMPLATE(BM_add, Push<B>)->Apply(client_mixes);               \
+    BENCHMARK_TEMPLATE(BM_dispatch, Push<B>)->Apply(client_mixes);          \
+    BENCHMARK_TEMPLATE(BM_reactivate, B)->Apply(client_range)->UseManualTime(); \
+    BENCHMARK_TEMPLATE(BM_rollover, B)->Apply(client_range)->UseManualTime(); \
+    BENCHMARK_TEMPLATE(BM_do_clean, B)->ArgNames({"clients", "walk"})       \
+            ->ArgsProduct({client_counts, {0, 1}})
+
+DMC_QUEUE_BENCHMARKS(2);
+DMC_QUEUE_BENCHMARKS(3);
+DMC_QUEUE_BENCHMARKS(4);
+DMC_QUEUE_BENCHMARKS(8);
+
+
+int main(int argc, char **argv) {
+#ifdef DO_NOT_DELAY_TAG_CALC
+    benchmark::AddCustomContext("tag_calc", "immediate");
+#else
+    benchmark::AddCustomContext("tag_calc", "delayed");
+#endif
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -145,6 +145,10 @@ int crimson::qos_simulation::parse_config_file(const std::string &fname, sim_con
     g_conf.system_capacity = stod(val);
   if (!cf.read("global", "mclock_win_size", val))
     g_conf.mclock_win_size = stod(val);
+  if (!cf.read("global", "other_max_wait", val))
+    g_conf.other_max_wait = stod(val);
+  if (!cf.read("global", "profile", val))
+    g_conf.profile = stobool(val);
 
   for (uint i = 0; i < g_conf.server_groups; i++) {
     srv_group_t st;
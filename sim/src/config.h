@@ -116,6 +116,8 @@ namespace crimson {
       double anticipation_timeout;
       double system_capacity;
       double mclock_win_size;
+      double other_max_wait;
+      bool profile;
 
       std::vector<cli_group_t> cli_group;
       std::vector<srv_group_t> srv_group;
@@ -126,14 +128,18 @@ namespace crimson {
 		   bool _server_soft_limit = true,
 		   double _anticipation_timeout = 0.0,
 		   double _system_capacity = 40,
-		   double _mclock_win_size = 30):
+		   double _mclock_win_size = 30,
+		   double _other_max_wait = 0.0,
+		   bool _profile = false):
 	server_groups(_server_groups),
 	client_groups(_client_groups),
 	server_random_selection(_server_random_selection),
 	server_soft_limit(_server_soft_limit),
 	anticipation_timeout(_anticipation_timeout),
 	system_capacity(_system_capacity),
-	mclock_win_size(_mclock_win_size)
+	mclock_win_size(_mclock_win_size),
+	other_max_wait(_other_max_wait),
+	profile(_profile)
       {
 	srv_group.reserve(server_groups);
 	cli_group.reserve(client_groups);
@@ -149,7 +155,9 @@ namespace crimson {
 	  std::fixed << std::setprecision(3) << 
 	  "anticipation_timeout = " << sim_config.anticipation_timeout << "\n" <<
 	  "system_capacity = " << sim_config.system_capacity << "\n" <<
-	  "mclock_win_size = " << sim_config.mclock_win_size;
+	  "mclock_win_size = " << sim_config.mclock_win_size << "\n" <<
+	  "other_max_wait = " << sim_config.other_max_wait << "\n" <<
+	  "profile = " << sim_config.profile;
 	return out;
       }
     }; // class sim_config_t
@@ -23,6 +23,7 @@
 #include <deque>
 
 #include "sim_recs.h"
+#include "perf_counters.h"
 
 
 namespace crimson {
@@ -55,6 +56,9 @@ namespace crimson {
 	std::chrono::nanoseconds request_complete_time;
 	uint32_t add_request_count;
 	uint32_t request_complete_count;
+	// hardware counters of the same calls; see enable_perf_counters
+	crimson::PerfProfile add_request_perf;
+	crimson::PerfProfile request_complete_perf;
 
 	InternalStats() :
 	  add_request_time(0),
@@ -158,12 +162,17 @@ namespace crimson {
 		const ClientId& client_id,
 		const ReqPm& req_params)
       {
-	time_stats(internal_stats.mtx,
-		   internal_stats.add_request_time,
-		   [&](){
-		     priority_queue->add_request(std::move(request),
-						 client_id, req_params);
-		   });
+	{
+	  // the counters are read outside the timed call, so their
+	  // syscalls stay out of the QoS algorithm timings
+	  auto perf = internal_stats.add_request_perf.measure();
+	  time_stats(internal_stats.mtx,
+		     internal_stats.add_request_time,
+		     [&](){
+		       priority_queue->add_request(std::move(request),
+						   client_id, req_params);
+		     });
+	}
 	count_stats(internal_stats.mtx,
 		    internal_stats.add_request_count);
       }
@@ -177,6 +186,15 @@ namespace crimson {
       const Q& get_priority_queue() const { return *priority_queue; }
       const InternalStats& get_internal_stats() const { return internal_stats; }
 
+      // counts cycles, instructions, cache and branch misses of
+      // add_request and request_completed, and of the timing around
+      // them, on the server's threads; false when the counters are
+      // unavailable here
+      bool enable_perf_counters(bool on) {
+	internal_stats.request_complete_perf.set_enabled(on);
+	return internal_stats.add_request_perf.set_enabled(on);
+      }
+
     protected:
 
       void inner_post(const ClientId& client,
@@ -214,11 +232,14 @@ namespace crimson {
 	    // pass in a function that does this mapping?
 	    client_resp_f(client, TestResponse{req->epoch}, id, additional);
 
-	    time_stats(internal_stats.mtx,
-		       internal_stats.request_complete_time,
-		       [&](){
-			 priority_queue->request_completed();
-		       });
+	    {
+	      auto perf = internal_stats.request_complete_perf.measure();
+	      time_stats(internal_stats.mtx,
+			 internal_stats.request_complete_time,
+			 [&](){
+			   priority_queue->request_completed();
+			 });
+	    }
 	    count_stats(internal_stats.mtx,
 			internal_stats.request_complete_count);
 
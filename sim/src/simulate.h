@@ -30,6 +30,8 @@
 #include <cstdio>
 #include <algorithm>
 
+#include "perf_counters.h"
+
 
 namespace crimson {
   namespace qos_simulation {
@@ -350,6 +352,40 @@ namespace crimson {
 	out << "server timing for QOS algorithm: " <<
 	  add_request_time_per_unit + request_complete_time_unit <<
 	  " " << time_unit << " per request/response" << std::endl;
+
+	display_server_perf_counters(out, "add request",
+				     [](const typename TS::InternalStats& is) -> const crimson::PerfProfile& {
+				       return is.add_request_perf;
+				     });
+	display_server_perf_counters(out, "note request complete",
+				     [](const typename TS::InternalStats& is) -> const crimson::PerfProfile& {
+				       return is.request_complete_perf;
+				     });
+      }
+
+
+      // hardware counter means per call over all servers; nothing when
+      // no call was counted
+      template<typename F>
+      void display_server_perf_counters(std::ostream& out,
+					const std::string& op, F profile_of) {
+	uint64_t calls = 0;
+	double sums[crimson::perf_event_count] = {};
+	for (uint i = 0; i < get_server_count(); ++i) {
+	  const crimson::PerfProfile& p =
+	    profile_of(get_server(i).get_internal_stats());
+	  calls += p.get_calls();
+	  for (unsigned e = 0; e < crimson::perf_event_count; ++e) {
+	    sums[e] += p.get_mean(crimson::PerfEvent(e)) * p.get_calls();
+	  }
+	}
+	if (0 == calls) return;
+	out << "hardware counters per " << op << " (" << calls << " calls):";
+	for (unsigned e = 0; e < crimson::perf_event_count; ++e) {
+	  out << " " << crimson::perf_event_name(crimson::PerfEvent(e)) <<
+	    ":" << std::fixed << std::setprecision(1) << sums[e] / calls;
+	}
+	out << std::endl;
       }
 
 
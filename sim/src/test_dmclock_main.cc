@@ -19,9 +19,7 @@
 #include <ctime>
 #include <cstdio>
 
-#ifdef PROFILE
 #include "profile.h"
-#endif
 
 
 namespace dmc = crimson::dmclock;
@@ -87,6 +85,8 @@ int main(int argc, char* argv[]) {
     const double anticipation_timeout = g_conf.anticipation_timeout;
     const double system_capacity = g_conf.system_capacity;
     const double mclock_win_size = g_conf.mclock_win_size;
+    const double other_max_wait = g_conf.other_max_wait;
+    const bool profile = g_conf.profile;
     uint server_total_count = 0;
     uint client_total_count = 0;
 
@@ -190,24 +190,30 @@ int main(int argc, char* argv[]) {
     test::CreateQueueF create_queue_f =
         [&](test::DmcQueue::CanHandleRequestFunc can_f,
             test::DmcQueue::HandleRequestFunc handle_f) -> test::DmcQueue* {
-        return new test::DmcQueue(client_info_f,
-                                  can_f,
-                                  handle_f,
-                                  system_capacity,
-                                  mclock_win_size,
-                                  server_soft_limit,
-                                  anticipation_timeout);
+        test::DmcQueue* queue = new test::DmcQueue(client_info_f,
+                                                   can_f,
+                                                   handle_f,
+                                                   system_capacity,
+                                                   mclock_win_size,
+                                                   server_soft_limit,
+                                                   anticipation_timeout);
+        queue->set_other_max_wait(other_max_wait);
+        // time every call so the report covers the whole run
+        queue->enable_profiling(profile, 0);
+        return queue;
     };
 
  
     auto create_server_f = [&](ServerId id) -> test::DmcServer* {
       uint i = ret_server_group_f(id);
-      return new test::DmcServer(id,
-                                 srv_group[i].server_iops,
-				 srv_group[i].server_threads,
-				 client_response_f,
-				 test::dmc_server_accumulate_f,
-				 create_queue_f);
+      test::DmcServer* server = new test::DmcServer(id,
+                                                    srv_group[i].server_iops,
+                                                    srv_group[i].server_threads,
+                                                    client_response_f,
+                                                    test::dmc_server_accumulate_f,
+                                                    create_queue_f);
+      server->enable_perf_counters(profile);
+      return server;
     };
 
     auto create_client_f = [&](ClientId id) -> test::DmcClient* {
@@ -331,28 +337,136 @@ void test::server_data(std::ostream& out,
 	" k-way heap: " << q.get_heap_branching_factor() << std::endl
 	<< std::endl;
 
-#ifdef PROFILE
-    crimson::ProfileCombiner<std::chrono::nanoseconds> art_combiner;
-    crimson::ProfileCombiner<std::chrono::nanoseconds> rct_combiner;
-    for (uint i = 0; i < sim->get_server_count(); ++i) {
-      const auto& q = sim->get_server(i).get_priority_queue();
-      const auto& art = q.add_request_timer;
-      art_combiner.combine(art);
-      const auto& rct = q.request_complete_timer;
-      rct_combiner.combine(rct);
+    if (q.add_request_timer.is_enabled()) {
+      crimson::ProfileCombiner<std::chrono::nanoseconds> art_combiner;
+      crimson::ProfileCombiner<std::chrono::nanoseconds> rct_combiner;
+      for (uint i = 0; i < sim->get_server_count(); ++i) {
+        const auto& q = sim->get_server(i).get_priority_queue();
+        const auto& art = q.add_request_timer;
+        art_combiner.combine(art.snapshot());
+        const auto& rct = q.request_complete_timer;
+        rct_combiner.combine(rct.snapshot());
+      }
+      out << "Server add_request_timer: count:" << art_combiner.get_count() <<
+        ", mean:" << art_combiner.get_mean() <<
+        ", std_dev:" << art_combiner.get_std_dev() <<
+        ", low:" << art_combiner.get_low() <<
+        ", high:" << art_combiner.get_high() <<
+        ", p50:" << art_combiner.get_p50() <<
+        ", p99:" << art_combiner.get_p99() <<
+        ", p999:" << art_combiner.get_p999() << std::endl;
+      out << "Server request_complete_timer: count:" << rct_combiner.get_count() <<
+        ", mean:" << rct_combiner.get_mean() <<
+        ", std_dev:" << rct_combiner.get_std_dev() <<
+        ", low:" << rct_combiner.get_low() <<
+        ", high:" << rct_combiner.get_high() <<
+        ", p50:" << rct_combiner.get_p50() <<
+        ", p99:" << rct_combiner.get_p99() <<
+        ", p999:" << rct_combiner.get_p999() << std::endl;
+      out << "Server combined mean: " <<
+        (art_combiner.get_mean() + rct_combiner.get_mean()) <<
+        std::endl;
+
+      // decisions summed over all servers
+      dmc::DecisionStats decisions;
+      for (uint i = 0; i < sim->get_server_count(); ++i) {
+        const auto ds =
+          sim->get_server(i).get_priority_queue().get_decision_stats();
+        decisions.calls += ds.calls;
+        decisions.rollovers += ds.rollovers;
+        decisions.timed_calls += ds.timed_calls;
+        for (size_t o = 0; o < dmc::DecisionStats::outcome_count; ++o) {
+          decisions.outcomes[o] += ds.outcomes[o];
+        }
+        for (size_t h = 0; h < 3; ++h) {
+          decisions.promotions[h] += ds.promotions[h];
+        }
+        decisions.max_promotions =
+          std::max(decisions.max_promotions, ds.max_promotions);
+        for (size_t s = 0; s < dmc::DecisionStats::stage_count; ++s) {
+          decisions.stage_entered[s] += ds.stage_entered[s];
+          decisions.stage_ns[s] += ds.stage_ns[s];
+        }
+      }
+      out << "Server decisions: calls:" << decisions.calls <<
+        ", rollovers:" << decisions.rollovers <<
+        ", promotions:" << decisions.total_promotions() <<
+        ", max promotions per call:" << decisions.max_promotions << std::endl;
+      out << "  outcomes:";
+      for (size_t o = 0; o < dmc::DecisionStats::outcome_count; ++o) {
+        out << " " << dmc::DecisionOutcome(o) << ":" << decisions.outcomes[o];
+      }
+      out << std::endl << "  mean ns per stage:";
+      for (size_t s = 0; s < dmc::DecisionStats::stage_count; ++s) {
+        out << " " << dmc::DecisionStage(s) << ":" <<
+          decisions.mean_stage_ns(dmc::DecisionStage(s));
+      }
+      out << std::endl;
+
+      // QoS attainment averaged over all servers' windows
+      dmc::QosStats<ClientId> qos;
+      for (uint i = 0; i < sim->get_server_count(); ++i) {
+        const auto qs = sim->get_server(i).get_priority_queue().get_qos_stats();
+        qos.windows += qs.windows;
+        qos.reservation_sum += qs.reservation_sum;
+        qos.reservation_windows += qs.reservation_windows;
+        qos.overshoot_sum += qs.overshoot_sum;
+        qos.overshoot_windows += qs.overshoot_windows;
+        qos.burst_sum += qs.burst_sum;
+        qos.burst_windows += qs.burst_windows;
+        qos.fairness_sum += qs.fairness_sum;
+        qos.fairness_windows += qs.fairness_windows;
+      }
+      out << "Server QoS: windows:" << qos.windows <<
+        ", reservation attainment:" << qos.mean_reservation_attainment() <<
+        ", limit overshoot:" << qos.mean_limit_overshoot() <<
+        ", burst utilisation:" << qos.mean_burst_utilisation() <<
+        ", fairness:" << qos.mean_fairness() << std::endl;
+
+      // queueing delays inside the scheduler, in microseconds
+      const char* class_names[] = { "R", "B", "A", "O" };
+      for (int t = 0; t < 4; ++t) {
+        crimson::ProfileCombiner<std::chrono::microseconds> delay_combiner;
+        for (uint i = 0; i < sim->get_server_count(); ++i) {
+          delay_combiner.combine(sim->get_server(i).get_priority_queue().
+                                 get_class_delay(dmc::ClientType(t)));
+        }
+        if (0 == delay_combiner.get_count()) continue;
+        out << "Server queueing delay class " << class_names[t] <<
+          ": count:" << delay_combiner.get_count() <<
+          ", mean:" << delay_combiner.get_mean() <<
+          ", p50:" << delay_combiner.get_p50() <<
+          ", p99:" << delay_combiner.get_p99() << std::endl;
+      }
+      for (size_t p = 0; p < dmc::delay_phase_count; ++p) {
+        crimson::ProfileCombiner<std::chrono::microseconds> delay_combiner;
+        for (uint i = 0; i < sim->get_server_count(); ++i) {
+          delay_combiner.combine(sim->get_server(i).get_priority_queue().
+                                 get_phase_delay(dmc::DelayPhase(p)));
+        }
+        if (0 == delay_combiner.get_count()) continue;
+        out << "Server queueing delay phase " << dmc::DelayPhase(p) <<
+          ": count:" << delay_combiner.get_count() <<
+          ", mean:" << delay_combiner.get_mean() <<
+          ", p50:" << delay_combiner.get_p50() <<
+          ", p99:" << delay_combiner.get_p99() << std::endl;
+      }
+
+      for (size_t l = 0; l < dmc::lock_site_count; ++l) {
+        crimson::ProfileCombiner<std::chrono::nanoseconds> wait_combiner;
+        crimson::ProfileCombiner<std::chrono::nanoseconds> hold_combiner;
+        for (uint i = 0; i < sim->get_server_count(); ++i) {
+          const auto& q = sim->get_server(i).get_priority_queue();
+          wait_combiner.combine(q.get_lock_wait(dmc::LockSite(l)));
+          hold_combiner.combine(q.get_lock_hold(dmc::LockSite(l)));
+        }
+        if (0 == hold_combiner.get_count()) continue;
+        out << "Server data_mtx " << dmc::LockSite(l) <<
+          ": count:" << hold_combiner.get_count() <<
+          ", wait p50:" << wait_combiner.get_p50() <<
+          ", wait p99:" << wait_combiner.get_p99() <<
+          ", hold p50:" << hold_combiner.get_p50() <<
+          ", hold p99:" << hold_combiner.get_p99() << std::endl;
+      }
     }
-    out << "Server add_request_timer: count:" << art_combiner.get_count() <<
-      ", mean:" << art_combiner.get_mean() <<
-      ", std_dev:" << art_combiner.get_std_dev() <<
-      ", low:" << art_combiner.get_low() <<
-      ", high:" << art_combiner.get_high() << std::endl;
-    out << "Server request_complete_timer: count:" << rct_combiner.get_count() <<
-      ", mean:" << rct_combiner.get_mean() <<
-      ", std_dev:" << rct_combiner.get_std_dev() <<
-      ", low:" << rct_combiner.get_low() <<
-      ", high:" << rct_combiner.get_high() << std::endl;
-    out << "Server combined mean: " <<
-      (art_combiner.get_mean() + rct_combiner.get_mean()) <<
-      std::endl;
-#endif
 }
@@ -0,0 +1,152 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* The per-client window records the queue keeps in memory -- the
+ * fields printScheduling writes to scheduling.txt plus dispatch latency
+ * percentiles -- for the last N windows.
+ */
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "dmclock_util.h"
+#include "profile.h"
+
+
+namespace crimson {
+  namespace dmclock {
+
+    // Dispatch latencies in microseconds, counted in buckets four to a
+    // power of two, so percentiles are within 25% of the truth.
+    using WindowLatency = ProfileHistogram<std::chrono::microseconds, 3>;
+
+
+    // one client's record of one window
+    template<typename C>
+    struct ClientWindow {
+      C client;
+      int client_no;       // as in scheduling.txt
+      int client_type;     // ClientType
+      double resource;
+      double reservation;
+      double compensation;
+      double weight;
+      double limit;
+      uint32_t reservation_count;
+      uint32_t reservation_break_count;
+      uint32_t deltar_count;
+      uint32_t deltar_break_count;
+      uint32_t burst_count;
+      uint32_t burst_break_count;
+      uint32_t best_effort_count;
+      uint32_t best_effort_break_count;
+      // from the request's arrival to its dispatch
+      uint32_t dispatched;
+      Time latency_p50;
+      Time latency_p99;
+      Time latency_max;
+    };
+
+    // one client's record with the window it belongs to
+    template<typename C>
+    struct ClientHistoryEntry {
+      uint64_t window;
+      Time start;
+      ClientWindow<C> record;
+    };
+
+    // all clients' records of one window
+    template<typename C>
+    struct HistoryWindow {
+      uint64_t index;  // counts windows since history was turned on
+      Time start;
+      Time size;
+      std::vector<ClientWindow<C>> clients;
+    };
+
+
+    // The last capacity windows. One thread pushes, under the queue's
+    // lock; any thread may read without it. A window is immutable once
+    // pushed and is replaced as a whole.
+    template<typename C>
+    class WindowHistory {
+    public:
+
+      using WindowRef = std::shared_ptr<const HistoryWindow<C>>;
+
+    private:
+
+      std::vector<WindowRef> slots;
+      std::atomic<uint64_t> pushed;
+
+    public:
+
+      explicit WindowHistory(size_t capacity) :
+	slots(std::max(capacity, size_t(1))),
+	pushed(0)
+      {}
+
+      size_t capacity() const {
+	return slots.size();
+      }
+
+      uint64_t next_index() const {
+	return pushed.load(std::memory_order_relaxed);
+      }
+
+      void push(WindowRef window) {
+	const uint64_t n = pushed.load(std::memory_order_relaxed);
+	std::atomic_store(&slots[n % slots.size()], window);
+	pushed.store(n + 1, std::memory_order_release);
+      }
+
+      // the window back windows before the latest, or null; a window
+      // pushed meanwhile may take its place, so check index
+      WindowRef get(size_t back) const {
+	const uint64_t n = pushed.load(std::memory_order_acquire);
+	if (back >= n || back >= slots.size()) {
+	  return WindowRef();
+	}
+	return std::atomic_load(&slots[(n - 1 - back) % slots.size()]);
+      }
+
+      // client's records, latest first, over at most max_windows windows
+      std::vector<ClientHistoryEntry<C>>
+      find(const C& client, size_t max_windows) const {
+	std::vector<ClientHistoryEntry<C>> result;
+	uint64_t last_index = UINT64_MAX;
+	for (size_t back = 0; back < std::min(max_windows, slots.size()); ++back) {
+	  WindowRef window = get(back);
+	  // stop when the ring wrapped under us
+	  if (!window || window->index >= last_index) {
+	    break;
+	  }
+	  last_index = window->index;
+	  for (const auto& record : window->clients) {
+	    if (record.client == client) {
+	      result.push_back(ClientHistoryEntry<C>{window->index, window->start, record});
+	      break;
+	    }
+	  }
+	}
+	return result;
+      }
+    }; // class WindowHistory
+
+  } // namespace dmclock
+} // namespace crimson
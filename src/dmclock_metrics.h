@@ -0,0 +1,261 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* Metrics in the Prometheus text exposition format, served over HTTP
+ * from a thread of their own. The scheduler publishes an immutable
+ * copy of its counters and the exporter turns the latest one into a
+ * MetricsSnapshot as it is scraped, so nothing on the dispatch path
+ * formats text, waits for a scrape or does I/O.
+ *
+ *   curl --unix-socket /run/dmclock.sock http://localhost/metrics
+ *   curl http://127.0.0.1:9100/metrics
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+
+
+namespace crimson {
+  namespace dmclock {
+
+    // one metric and its samples; labels are written as they are
+    // given, e.g. "client=\"R_0\",phase=\"reservation\""
+    struct MetricFamily {
+      std::string name;
+      std::string help;
+      std::string type;  // "counter" or "gauge"
+      std::vector<std::pair<std::string,double>> samples;
+
+      MetricFamily(const std::string& _name,
+		   const std::string& _help,
+		   const std::string& _type) :
+	name(_name),
+	help(_help),
+	type(_type)
+      {}
+
+      void add(const std::string& labels, double value) {
+	samples.emplace_back(labels, value);
+      }
+    };
+
+    using MetricsSnapshot = std::vector<MetricFamily>;
+
+
+    inline void write_prometheus(std::ostream& out,
+				 const MetricsSnapshot& snapshot) {
+      for (const auto& family : snapshot) {
+	out << "# HELP " << family.name << " " << family.help << "\n" <<
+	  "# TYPE " << family.name << " " << family.type << "\n";
+	for (const auto& sample : family.samples) {
+	  out << family.name;
+	  if (!sample.first.empty()) {
+	    out << "{" << sample.first << "}";
+	  }
+	  out << " " << sample.second << "\n";
+	}
+      }
+    }
+
+
+    // Serves the snapshot returned by source, as of each scrape, to any
+    // HTTP GET on a Unix socket or a loopback TCP port. Connections are
+    // handled one at a time on the exporter's thread.
+    class MetricsExporter {
+    public:
+
+      using SnapshotSource =
+	std::function<std::shared_ptr<const MetricsSnapshot>()>;
+
+    private:
+
+      SnapshotSource source;
+      int listen_fd;
+      uint16_t bound_port;
+      std::string unix_path;
+      std::atomic_bool finishing;
+      std::thread thd;
+
+      // a scrape that stalls is dropped rather than holding the thread
+      static constexpr int io_timeout_ms = 1000;
+
+      void run() {
+	struct pollfd pfd;
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+	while (!finishing) {
+	  // wake up regularly to notice finishing
+	  if (poll(&pfd, 1, 100) <= 0) {
+	    continue;
+	  }
+	  int fd = accept(listen_fd, nullptr, nullptr);
+	  if (fd < 0) {
+	    continue;
+	  }
+	  serve(fd);
+	  close(fd);
+	}
+      }
+
+      void serve(int fd) {
+	// read the request head; its contents do not matter
+	char buf[1024];
+	std::string request;
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (request.find("\r\n\r\n") == std::string::npos &&
+	       request.size() < 8192) {
+	  if (poll(&pfd, 1, io_timeout_ms) <= 0) {
+	    return;
+	  }
+	  ssize_t got = recv(fd, buf, sizeof(buf), 0);
+	  if (got <= 0) {
+	    return;
+	  }
+	  request.append(buf, got);
+	}
+
+	std::ostringstream body;
+	std::shared_ptr<const MetricsSnapshot> snapshot = source();
+	if (snapshot) {
+	  write_prometheus(body, *snapshot);
+	}
+	const std::string content = body.str();
+	std::ostringstream response;
+	response << "HTTP/1.0 200 OK\r\n" <<
+	  "Content-Type: text/plain; version=0.0.4\r\n" <<
+	  "Content-Length: " << content.size() << "\r\n" <<
+	  "Connection: close\r\n\r\n" << content;
+	const std::string out = response.str();
+
+	size_t sent = 0;
+	pfd.events = POLLOUT;
+	while (sent < out.size()) {
+	  if (poll(&pfd, 1, io_timeout_ms) <= 0) {
+	    return;
+	  }
+	  ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+	  if (n <= 0) {
+	    return;
+	  }
+	  sent += n;
+	}
+      }
+
+      bool start(int fd) {
+	if (listen(fd, 8) < 0) {
+	  close(fd);
+	  return false;
+	}
+	listen_fd = fd;
+	thd = std::thread(&MetricsExporter::run, this);
+	return true;
+      }
+
+    public:
+
+      MetricsExporter(SnapshotSource _source) :
+	source(_source),
+	listen_fd(-1),
+	bound_port(0),
+	finishing(false)
+      {}
+
+      ~MetricsExporter() {
+	finishing = true;
+	if (thd.joinable()) {
+	  thd.join();
+	}
+	if (listen_fd >= 0) {
+	  close(listen_fd);
+	}
+	if (!unix_path.empty()) {
+	  unlink(unix_path.c_str());
+	}
+      }
+
+      MetricsExporter(const MetricsExporter&) = delete;
+      MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+      // listens on a Unix socket at path, replacing a stale one; returns
+      // false, with errno set, when it cannot
+      bool listen_unix(const std::string& path) {
+	struct sockaddr_un addr;
+	if (path.size() >= sizeof(addr.sun_path)) {
+	  errno = ENAMETOOLONG;
+	  return false;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+	  return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+	  close(fd);
+	  return false;
+	}
+	unix_path = path;
+	return start(fd);
+      }
+
+      // listens on 127.0.0.1; port 0 picks a free one, see port()
+      bool listen_loopback(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+	  return false;
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr*) &addr, &len) < 0) {
+	  close(fd);
+	  return false;
+	}
+	bound_port = ntohs(addr.sin_port);
+	return start(fd);
+      }
+
+      // the TCP port listened on, or 0
+      uint16_t port() const {
+	return bound_port;
+      }
+    }; // class MetricsExporter
+
+  } // namespace dmclock
+} // namespace crimson
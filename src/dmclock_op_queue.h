@@ -0,0 +1,271 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* An op queue for embedding the pull queue in a storage daemon. Ops
+ * reach one of three lanes:
+ *
+ *   strict  -- internal high-priority ops, served highest priority
+ *              first and FIFO within a priority, ahead of everything
+ *   front   -- requeued ops, served ahead of the dmclock lane, the most
+ *              recently requeued first
+ *   dmclock -- client ops, scheduled by PullPriorityQueue
+ *
+ * All lanes share the pull queue's data_mtx, so a dequeue takes one
+ * lock no matter which lane it is served from. The pull queue is a
+ * private base: ops go through enqueue and dequeue, so none can reach
+ * the dmclock lane, or leave it, past the lane accounting. Only its
+ * configuration and observation members are re-exported.
+ */
+
+#include <map>
+#include <deque>
+#include <functional>
+
+#include "dmclock_server.h"
+
+
+namespace crimson {
+    namespace dmclock {
+
+        enum class OpLane : uint8_t { strict, front, dmclock };
+
+        inline std::ostream &operator<<(std::ostream &out, const OpLane &lane) {
+            if (OpLane::strict == lane) {
+                out << "strict";
+            } else if (OpLane::front == lane) {
+                out << "front";
+            } else {
+                out << "dmclock";
+            }
+            return out;
+        }
+
+
+        template<typename C, typename R, bool U1 = false, uint B = 2,
+                typename K = HeapBranching<B>>
+        class OpQueue : private PullPriorityQueue<C, R, U1, B, K> {
+            using super = PullPriorityQueue<C, R, U1, B, K>;
+            using base = PriorityQueueBase<C, R, U1, B, K>;
+            using RequestRef = typename base::RequestRef;
+
+            struct OpEntry {
+                C client;
+                RequestRef request;
+                OpClass op_class;
+            };
+
+        public:
+
+            using PullReq = typename super::PullReq;
+            using ClientInfoFunc = typename base::ClientInfoFunc;
+
+            // the dmclock lane's admission, op classes, aging and
+            // background controller
+            using super::set_queue_caps;
+            using super::set_backpressure_f;
+            using super::set_op_class_cost;
+            using super::set_op_class_capacity;
+            using super::get_op_class_used;
+            using super::set_other_max_wait;
+            using super::get_aged_sched_count;
+            using super::set_expired_request_f;
+            using super::get_expired_count;
+            using super::set_background_target;
+            using super::get_background_scale;
+            using super::request_completed;
+            using super::request_completed_time;
+            using super::update_client_info;
+            using super::update_client_infos;
+
+            // observation; none of these adds or removes ops
+            using super::client_count;
+            using super::queued_count;
+            using super::estimate_wait;
+            using super::get_service_rate;
+            using super::get_reservation_scale;
+            using super::get_reservation_demand;
+            using super::get_heap_branching_factor;
+            using super::memory_usage;
+            using super::get_decision_stats;
+            using super::reset_decision_stats;
+            using super::get_qos_stats;
+            using super::reset_qos_stats;
+            using super::enable_profiling;
+            using super::set_decision_timing;
+            using super::enable_lock_profiling;
+            using super::get_lock_wait;
+            using super::get_lock_hold;
+            using super::enable_delay_tracking;
+            using super::get_class_delay;
+            using super::get_phase_delay;
+            using super::track_client_delay;
+            using super::get_client_delay;
+            using super::enable_trace;
+            using super::get_trace_recorder;
+            using super::dump_trace;
+            using super::serve_metrics_unix;
+            using super::serve_metrics_loopback;
+            using super::stop_metrics;
+            using super::get_metrics_port;
+            using super::refresh_metrics;
+            using super::get_metrics_snapshot;
+            using super::publish_shm_stats;
+            using super::stop_shm_stats;
+            using super::set_window_history;
+            using super::get_window_history;
+
+            // the result of dequeue; the pull result is a request only when
+            // one was available, and lane says where it came from
+            struct OpReq {
+                PullReq pull;
+                OpLane lane;
+
+                bool is_retn() const { return pull.is_retn(); }
+            };
+
+            // ops counted per lane, and per op class across all lanes
+            struct OpQueueStats {
+                size_t enqueued[3] = {0, 0, 0};
+                size_t dequeued[3] = {0, 0, 0};
+                size_t op_class_enqueued[2] = {0, 0};
+            };
+
+
+            template<typename... Args>
+            OpQueue(Args &&... args) :
+                    super(std::forward<Args>(args)...) {
+                // empty
+            }
+
+
+            // an internal op; higher priorities are served first
+            void enqueue_strict(const C &client_id,
+                                unsigned priority,
+                                R &&request,
+                                OpClass op_class = OpClass::read) {
+                typename base::DataGuard g(this->data_mtx);
+                strict_lane[priority].push_back(
+                        OpEntry{client_id, RequestRef(new R(std::move(request))), op_class});
+                ++strict_count;
+                count_enqueued(OpLane::strict, op_class);
+            }
+
+
+            // an op that was dequeued but could not be handled yet
+            void enqueue_front(const C &client_id,
+                               R &&request,
+                               OpClass op_class = OpClass::read) {
+                typename base::DataGuard g(this->data_mtx);
+                front_lane.push_front(
+                        OpEntry{client_id, RequestRef(new R(std::move(request))), op_class});
+                count_enqueued(OpLane::front, op_class);
+            }
+
+
+            // a client op, scheduled by dmclock
+            AdmissionResult enqueue(const C &client_id,
+                                    const ReqParams &req_params,
+                                    R &&request,
+                                    OpClass op_class = OpClass::read,
+                                    double addl_cost = 0.0) {
+                typename base::ProfiledGuard g(this->data_mtx,
+                                               this->lock_profile(LockSite::add));
+                auto timing = this->add_request_timer.measure();
+                AdmissionResult result =
+                        base::do_add_request(std::move(request),
+                                             client_id, req_params, get_time(),
+                                             addl_cost, TimeZero, op_class);
+                if (result.accepted) {
+                    count_enqueued(OpLane::dmclock, op_class);
+                }
+                return result;
+            }
+
+
+            inline OpReq dequeue() {
+                return dequeue(get_time());
+            }
+
+            OpReq dequeue(Time now) {
+                typename base::ProfiledGuard g(this->data_mtx,
+                                               this->lock_profile(LockSite::pull));
+                if (strict_count > 0) {
+                    auto it = strict_lane.begin();
+                    OpReq result = take(it->second, OpLane::strict);
+                    --strict_count;
+                    if (it->second.empty()) {
+                        strict_lane.erase(it);
+                    }
+                    return result;
+                }
+                if (!front_lane.empty()) {
+                    return take(front_lane, OpLane::front);
+                }
+                OpReq result{super::do_pull_request(now), OpLane::dmclock};
+                if (result.pull.is_retn()) {
+                    ++stats.dequeued[size_t(OpLane::dmclock)];
+                }
+                return result;
+            }
+
+
+            bool empty() const {
+                typename base::DataGuard g(this->data_mtx);
+                return 0 == strict_count && front_lane.empty() && 0 == this->queued_total;
+            }
+
+
+            size_t length() const {
+                typename base::DataGuard g(this->data_mtx);
+                return strict_count + front_lane.size() + this->queued_total;
+            }
+
+
+            OpQueueStats get_stats() const {
+                typename base::DataGuard g(this->data_mtx);
+                return stats;
+            }
+
+        protected:
+
+            // priority -> ops, highest priority first
+            std::map<unsigned, std::deque<OpEntry>, std::greater<unsigned>> strict_lane;
+            size_t strict_count = 0;
+            std::deque<OpEntry> front_lane;
+            OpQueueStats stats;
+
+            // data_mtx must be held by caller
+            void count_enqueued(OpLane lane, OpClass op_class) {
+                ++stats.enqueued[size_t(lane)];
+                ++stats.op_class_enqueued[size_t(op_class)];
+            }
+
+            // data_mtx must be held by caller; lane must not be empty
+            OpReq take(std::deque<OpEntry> &lane_ops, OpLane lane) {
+                OpEntry &entry = lane_ops.front();
+                OpReq result;
+                result.lane = lane;
+                result.pull.type = base::NextReqType::returning;
+                result.pull.data = typename PullReq::Retn{entry.client,
+                                                          std::move(entry.request),
+                                                          PhaseType::priority};
+                lane_ops.pop_front();
+                ++stats.dequeued[size_t(lane)];
+                return result;
+            }
+        }; // class OpQueue
+
+    } // namespace dmclock
+} // namespace crimson
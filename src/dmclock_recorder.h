@@ -0,0 +1,199 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* An in-memory record of scheduling events -- adds, dispatches, limit
+ * promotions and window rollovers -- kept in a fixed-size ring that
+ * overwrites the oldest events. Recording is lock-free: a writer claims
+ * a slot with one fetch_add and publishes it under a per-slot sequence
+ * number, so the ring can be read, or dumped as Chrome trace-event JSON
+ * for chrome://tracing or ui.perfetto.dev, while the scheduler runs.
+ */
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+#include <cstdio>
+
+
+namespace crimson {
+  namespace dmclock {
+
+    class TraceRecorder {
+    public:
+
+      enum class Kind : uint8_t { add, dispatch, promote, rollover };
+
+      // times are nanoseconds on the queue's clock; start and end are
+      // the same except for a dispatch, which spans from the request's
+      // arrival to its dispatch. detail is the DecisionOutcome of a
+      // dispatch and the limit heap (0 limit, 1 r_limit, 2 best_limit)
+      // of a promotion.
+      struct Event {
+	Kind kind;
+	uint8_t client_type;
+	uint8_t detail;
+	uint32_t depth;
+	uint64_t client;
+	int64_t start_ns;
+	int64_t end_ns;
+      };
+
+    private:
+
+      struct Slot {
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> words[4];
+      };
+
+      const size_t mask;
+      std::unique_ptr<Slot[]> slots;
+      std::atomic<uint64_t> head;
+
+      static size_t round_up(size_t capacity) {
+	size_t result = 1;
+	while (result < capacity) {
+	  result <<= 1;
+	}
+	return result;
+      }
+
+    public:
+
+      // capacity is rounded up to a power of two
+      explicit TraceRecorder(size_t capacity) :
+	mask(round_up(capacity) - 1),
+	slots(new Slot[mask + 1]),
+	head(0)
+      {
+	for (size_t i = 0; i <= mask; ++i) {
+	  slots[i].seq.store(0, std::memory_order_relaxed);
+	}
+      }
+
+      size_t capacity() const {
+	return mask + 1;
+      }
+
+      // events recorded since construction, including overwritten ones
+      uint64_t recorded() const {
+	return head.load(std::memory_order_relaxed);
+      }
+
+      void record(const Event& event) {
+	const uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+	Slot& slot = slots[index & mask];
+	// odd while being written
+	slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.words[0].store(uint64_t(event.kind) |
+			    uint64_t(event.client_type) << 8 |
+			    uint64_t(event.detail) << 16 |
+			    uint64_t(event.depth) << 32,
+			    std::memory_order_relaxed);
+	slot.words[1].store(event.client, std::memory_order_relaxed);
+	slot.words[2].store(uint64_t(event.start_ns), std::memory_order_relaxed);
+	slot.words[3].store(uint64_t(event.end_ns), std::memory_order_relaxed);
+	slot.seq.store(2 * index + 2, std::memory_order_release);
+      }
+
+      // the events still in the ring, oldest first; slots being
+      // rewritten while they are read are left out
+      std::vector<Event> events() const {
+	std::vector<Event> result;
+	const uint64_t end = head.load(std::memory_order_acquire);
+	const uint64_t begin = end > capacity() ? end - capacity() : 0;
+	result.reserve(end - begin);
+	for (uint64_t index = begin; index < end; ++index) {
+	  const Slot& slot = slots[index & mask];
+	  const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+	  if (seq != 2 * index + 2) {
+	    continue;
+	  }
+	  const uint64_t w0 = slot.words[0].load(std::memory_order_relaxed);
+	  Event event;
+	  event.kind = Kind(w0 & 0xff);
+	  event.client_type = uint8_t(w0 >> 8);
+	  event.detail = uint8_t(w0 >> 16);
+	  event.depth = uint32_t(w0 >> 32);
+	  event.client = slot.words[1].load(std::memory_order_relaxed);
+	  event.start_ns = int64_t(slot.words[2].load(std::memory_order_relaxed));
+	  event.end_ns = int64_t(slot.words[3].load(std::memory_order_relaxed));
+	  std::atomic_thread_fence(std::memory_order_acquire);
+	  if (slot.seq.load(std::memory_order_relaxed) == seq) {
+	    result.push_back(event);
+	  }
+	}
+	return result;
+      }
+
+      // Writes the ring as a Chrome trace-event JSON object with one
+      // track per client. Dispatches are complete events spanning the
+      // wait of the request, named by their outcome; adds and promotions
+      // are instants on the client's track, rollovers global instants.
+      // outcome_name gives the name of a dispatch's detail.
+      template<typename NameFunc>
+      void dump_chrome_json(std::ostream& out, NameFunc outcome_name) const {
+	static const char* type_names[] = { "R", "B", "A", "O" };
+	static const char* heap_names[] = { "limit", "r_limit", "best_limit" };
+	// trace-event times are microseconds
+	auto us = [](int64_t ns) -> std::string {
+	  char buf[32];
+	  snprintf(buf, sizeof(buf), "%lld.%03lld",
+		   (long long) (ns / 1000), (long long) (ns % 1000));
+	  return buf;
+	};
+
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	for (const auto& e : events()) {
+	  out << (first ? "\n" : ",\n");
+	  first = false;
+	  const char* type = e.client_type < 4 ? type_names[e.client_type] : "?";
+	  switch (e.kind) {
+	  case Kind::add:
+	    out << "{\"name\":\"add\",\"cat\":\"" << type <<
+	      "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << us(e.start_ns) <<
+	      ",\"pid\":0,\"tid\":" << e.client <<
+	      ",\"args\":{\"depth\":" << e.depth << "}}";
+	    break;
+	  case Kind::dispatch:
+	    out << "{\"name\":\"" << outcome_name(e.detail) << "\",\"cat\":\"" << type <<
+	      "\",\"ph\":\"X\",\"ts\":" << us(e.start_ns) <<
+	      ",\"dur\":" << us(e.end_ns - e.start_ns) <<
+	      ",\"pid\":0,\"tid\":" << e.client <<
+	      ",\"args\":{\"depth\":" << e.depth << "}}";
+	    break;
+	  case Kind::promote:
+	    out << "{\"name\":\"promote\",\"cat\":\"" << type <<
+	      "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << us(e.start_ns) <<
+	      ",\"pid\":0,\"tid\":" << e.client <<
+	      ",\"args\":{\"heap\":\"" << heap_names[e.detail % 3] << "\"}}";
+	    break;
+	  case Kind::rollover:
+	    out << "{\"name\":\"rollover\",\"ph\":\"i\",\"s\":\"g\",\"ts\":" <<
+	      us(e.start_ns) << ",\"pid\":0,\"tid\":0" <<
+	      ",\"args\":{\"queued\":" << e.depth << "}}";
+	    break;
+	  }
+	}
+	out << "\n]}\n";
+      }
+    }; // class TraceRecorder
+
+  } // namespace dmclock
+} // namespace crimson
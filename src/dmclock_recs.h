@@ -31,6 +31,15 @@ namespace crimson {
       return out;
     }
 
+    // the kind of operation a request performs; the server may charge
+    // each kind a different number of capacity units
+    enum class OpClass : uint8_t { read, write };
+
+    inline std::ostream& operator<<(std::ostream& out, const OpClass& op_class) {
+      out << (OpClass::read == op_class ? "read" : "write");
+      return out;
+    }
+
     struct ReqParams {
       // count of all replies since last request; MUSTN'T BE 0
       uint32_t delta;
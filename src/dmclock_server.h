@@ -44,8 +44,12 @@
 #include <cmath>
 #include <memory>
 #include <map>
+#include <set>
+#include <vector>
 #include <deque>
+#include <algorithm>
 #include <queue>
+#include <tuple>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
@@ -58,12 +62,6 @@
 
 #include <cstring>
 
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <netinet/in.h>
-// #include <unistd.h>
-#include <arpa/inet.h>
-
 #include <atomic>
 
 #include <boost/variant.hpp>
@@ -73,9 +71,12 @@
 #include "dmclock_util.h"
 #include "dmclock_recs.h"
 
-#ifdef PROFILE
 #include "profile.h"
-#endif
+#include "dmclock_trace.h"
+#include "dmclock_recorder.h"
+#include "dmclock_metrics.h"
+#include "dmclock_shm.h"
+#include "dmclock_history.h"
 
 
 namespace crimson {
@@ -155,6 +156,245 @@ namespace crimson {
         }; // class ClientInfo
 
 
+        // returned when a request is added; a rejected request was not
+        // queued, nor moved from, and the caller may try again at
+        // retry_after
+        struct AdmissionResult {
+            bool accepted;
+            Time retry_after;
+
+            static inline AdmissionResult accept() {
+                return AdmissionResult{true, TimeZero};
+            }
+
+            static inline AdmissionResult reject(Time _retry_after) {
+                return AdmissionResult{false, _retry_after};
+            }
+
+            friend std::ostream &operator<<(std::ostream &out,
+                                            const AdmissionResult &a) {
+                out << "{ AdmissionResult:: accepted:" << (a.accepted ? "true" : "false");
+                if (!a.accepted) {
+                    out << " retry_after:" << format_time(a.retry_after);
+                }
+                out << " }";
+                return out;
+            }
+        }; // struct AdmissionResult
+
+
+        enum class ClassifierMode { off, propose, apply };
+
+        // Tunes the arrival-pattern classifier. At every window rollover a
+        // client's arrivals are binned into slots; the index of dispersion
+        // (variance / mean) of the slot counts is its burstiness. Rate,
+        // burstiness and queue depth are smoothed across windows. A client
+        // at or above min_rate is proposed B when bursty_index is reached
+        // and R when at most steady_index; in between it keeps its type.
+        // A slower client is proposed A. A proposal must hold for
+        // hysteresis_windows consecutive windows to take effect.
+        struct ClassifierConfig {
+            ClassifierMode mode = ClassifierMode::off;
+            double smoothing = 0.5;
+            double bursty_index = 2.0;
+            double steady_index = 0.5;
+            double min_rate = 1.0;
+            unsigned hysteresis_windows = 3;
+        }; // struct ClassifierConfig
+
+
+        // smoothed arrival statistics the classifier bases its decisions on
+        struct ArrivalStats {
+            double rate;
+            double burstiness;
+            double depth;
+            uint32_t depth_max;
+        }; // struct ArrivalStats
+
+
+        // the stages of a scheduling decision, in the order they run
+        enum class DecisionStage : uint8_t {
+            rollover, reservation, aged, limit_promote, burst,
+            r_limit_promote, deltar, best_limit_promote, best_effort,
+            limit_break, next_call
+        };
+
+        // how a scheduling decision ended
+        enum class DecisionOutcome : uint8_t {
+            reservation, aged, burst, deltar, best_effort,
+            break_burst, break_best_effort, break_deltar, break_reservation,
+            future, none
+        };
+
+        inline std::ostream &operator<<(std::ostream &out, const DecisionStage &stage) {
+            static const char *names[] = {
+                "rollover", "reservation", "aged", "limit_promote", "burst",
+                "r_limit_promote", "deltar", "best_limit_promote", "best_effort",
+                "limit_break", "next_call"
+            };
+            return out << names[size_t(stage)];
+        }
+
+        inline std::ostream &operator<<(std::ostream &out, const DecisionOutcome &outcome) {
+            static const char *names[] = {
+                "reservation", "aged", "burst", "deltar", "best_effort",
+                "break_burst", "break_best_effort", "break_deltar", "break_reservation",
+                "future", "none"
+            };
+            return out << names[size_t(outcome)];
+        }
+
+        // the phase a request was dispatched in; limit_break covers every
+        // dispatch that broke a limit
+        enum class DelayPhase : uint8_t {
+            reservation, deltar, burst, best_effort, limit_break, aged
+        };
+
+        constexpr size_t delay_phase_count = 6;
+
+        inline std::ostream &operator<<(std::ostream &out, const DelayPhase &phase) {
+            static const char *names[] = {
+                "reservation", "deltar", "burst", "best_effort", "limit_break", "aged"
+            };
+            return out << names[size_t(phase)];
+        }
+
+        // queueing delays, from enqueue to dispatch, in microseconds
+        using DelayHistogram = ProfileHistogram<std::chrono::microseconds>;
+
+        // the operations whose hold on data_mtx is profiled; rollover is
+        // the part of a pull that starts a new window
+        enum class LockSite : uint8_t {
+            add, pull, request_completed, clean, rollover, remove
+        };
+
+        constexpr size_t lock_site_count = 6;
+
+        inline std::ostream &operator<<(std::ostream &out, const LockSite &site) {
+            static const char *names[] = {
+                "add", "pull", "request_completed", "clean", "rollover", "remove"
+            };
+            return out << names[size_t(site)];
+        }
+
+        // Counts and times the decisions made by do_next_request. Calls,
+        // outcomes and promotions are always counted. Stage times are
+        // only gathered while decision timing is on, and then only for
+        // the sampled calls counted in timed_calls; stage_ns[s] is the
+        // time those calls spent in stage s, stage_entered[s] how many of
+        // them reached it. Promotions are the requests moved from the
+        // limit, r_limit and best_limit heaps once within their limit.
+        struct DecisionStats {
+            static constexpr size_t stage_count = 11;
+            static constexpr size_t outcome_count = 11;
+
+            uint64_t calls = 0;
+            uint64_t rollovers = 0;
+            uint64_t outcomes[outcome_count] = {};
+            uint64_t promotions[3] = {};
+            uint64_t max_promotions = 0;  // most promotions in one call
+            uint64_t timed_calls = 0;
+            uint64_t stage_entered[stage_count] = {};
+            uint64_t stage_ns[stage_count] = {};
+
+            uint64_t outcome(DecisionOutcome o) const {
+                return outcomes[size_t(o)];
+            }
+
+            uint64_t total_promotions() const {
+                return promotions[0] + promotions[1] + promotions[2];
+            }
+
+            // mean time per timed call spent in stage s
+            double mean_stage_ns(DecisionStage s) const {
+                return timed_calls ? double(stage_ns[size_t(s)]) / timed_calls : 0.0;
+            }
+        }; // struct DecisionStats
+
+
+        // Whether a window kept the clients' contracts, counting the
+        // clients with requests queued or dispatched in it. Reservation
+        // attainment is r0_counter over reservation * win_size, capped at
+        // 1, for R clients with a reservation; a client met it at 1.
+        // Limit overshoot is the share of dispatches that broke a limit.
+        // Burst utilisation is b_units over resource for B clients.
+        // Fairness is Jain's index over the weighted shares
+        // (dispatched / weight) of A clients: 1 when they are equal, 1/n
+        // when one client got everything.
+        struct QosWindow {
+            uint32_t r_clients = 0;
+            uint32_t r_met = 0;
+            double reservation_attainment = 0.0;     // mean
+            double min_reservation_attainment = 0.0;
+            uint64_t dispatched = 0;
+            uint64_t limit_breaks = 0;
+            double limit_overshoot = 0.0;
+            uint32_t b_clients = 0;
+            double burst_utilisation = 0.0;          // mean
+            uint32_t a_clients = 0;
+            double fairness = 1.0;
+        }; // struct QosWindow
+
+        // the last window evaluated, with the reservation attainment of
+        // each R client counted in it, and sums over all windows for which
+        // a measure was defined
+        template<typename C>
+        struct QosStats {
+            uint64_t windows = 0;
+            QosWindow last;
+            std::map<C, double> last_reservation_attainment;
+            double reservation_sum = 0.0;
+            uint64_t reservation_windows = 0;
+            double overshoot_sum = 0.0;
+            uint64_t overshoot_windows = 0;
+            double burst_sum = 0.0;
+            uint64_t burst_windows = 0;
+            double fairness_sum = 0.0;
+            uint64_t fairness_windows = 0;
+
+            double mean_reservation_attainment() const {
+                return reservation_windows ? reservation_sum / reservation_windows : 0.0;
+            }
+
+            double mean_limit_overshoot() const {
+                return overshoot_windows ? overshoot_sum / overshoot_windows : 0.0;
+            }
+
+            double mean_burst_utilisation() const {
+                return burst_windows ? burst_sum / burst_windows : 0.0;
+            }
+
+            double mean_fairness() const {
+                return fairness_windows ? fairness_sum / fairness_windows : 1.0;
+            }
+        }; // struct QosStats
+
+
+        // Bytes of scheduler state, estimated from element sizes and the
+        // counts the queue keeps as clients and requests come and go;
+        // allocator overhead and unused vector capacity are not counted.
+        // Request storage includes the requests themselves, which the
+        // queue owns while they are queued. by_class holds what scales with
+        // a class's clients and requests; side maps, the compensated infos
+        // of erased clients and latency buffers are shared. The expiry
+        // marks of requests and the dispatch times kept for the
+        // background target are side maps that are also charged to the
+        // class of their client.
+        struct MemoryUsage {
+            size_t client_records = 0;
+            size_t request_storage = 0;
+            size_t heap_arrays = 0;
+            size_t client_infos = 0;
+            size_t side_maps = 0;
+            size_t by_class[4] = {};
+
+            size_t total() const {
+                return client_records + request_storage + heap_arrays +
+                       client_infos + side_maps;
+            }
+        }; // struct MemoryUsage
+
+
         struct RequestTag {
             double reservation;
             double proportion;
@@ -277,10 +517,33 @@ namespace crimson {
         }; // class RequestTag
 
 
+        // The branching factor of each of the seven heaps; all B by
+        // default. To give one heap role another factor, derive and hide
+        // the members concerned, e.g.
+        //
+        //     struct Branching : HeapBranching<2> {
+        //         static constexpr uint limit = 4;
+        //     };
+        //
+        // benchmark/src/heap_bench.cc measures the candidates and suggests
+        // factors for a machine.
+        template<uint B>
+        struct HeapBranching {
+            static constexpr uint resv = B;
+            static constexpr uint deltar = B;
+            static constexpr uint r_limit = B;
+            static constexpr uint limit = B;
+            static constexpr uint burst = B;
+            static constexpr uint best = B;
+            static constexpr uint best_limit = B;
+        };
+
+
         // C is client identifier type, R is request type,
         // U1 determines whether to use client information function dynamically,
-        // B is heap branching factor
-        template<typename C, typename R, bool U1, uint B>
+        // B is heap branching factor, K overrides it per heap (see
+        // HeapBranching)
+        template<typename C, typename R, bool U1, uint B, typename K = HeapBranching<B>>
         class PriorityQueueBase {
             // we don't want to include gtest.h just for FRIEND_TEST
             friend class dmclock_server_client_idle_erase_Test;
@@ -297,6 +560,10 @@ namespace crimson {
 
             friend class dmclock_server_burst_client_info_Test;
 
+            friend class dmclock_server_pull_qos_stats_Test;
+
+            friend class dmclock_server_pull_reservation_overcommit_Test;
+
         public:
 
             using RequestRef = std::unique_ptr<R>;
@@ -312,7 +579,7 @@ namespace crimson {
             };
 
             // forward decl for friend decls
-            template<double RequestTag::*, ReadyOption, bool>
+            template<double RequestTag::*, ReadyOption, bool, bool>
             struct ClientCompare;
 
             class ClientReq {
@@ -322,18 +589,38 @@ namespace crimson {
                 C client_id;
                 RequestRef request;
                 ClientType client_type;
+                // absolute time after which the request is dropped rather
+                // than dispatched; TimeZero means it never expires
+                Time expiry;
+                // for O clients, the time by which the request has waited its
+                // maximum and must be served; max_tag when aging is off
+                Time age_limit;
+                OpClass op_class;
+                // when the request was added; unlike tag.arrival it is not
+                // changed when the client moves to another heap
+                Time enqueued;
 
             public:
 
                 ClientReq(const RequestTag &_tag,
                           const C &_client_id,
-                          RequestRef &&_request) :
+                          RequestRef &&_request,
+                          const Time _expiry = TimeZero,
+                          const OpClass _op_class = OpClass::read) :
                         tag(_tag),
                         client_id(_client_id),
-                        request(std::move(_request)) {
+                        request(std::move(_request)),
+                        expiry(_expiry),
+                        age_limit(max_tag),
+                        op_class(_op_class),
+                        enqueued(_tag.arrival) {
                     // empty
                 }
 
+                inline bool is_expired(const Time now) const {
+                    return TimeZero != expiry && expiry <= now;
+                }
+
                 friend std::ostream &operator<<(std::ostream &out, const ClientReq &c) {
                     out << "{ ClientReq:: tag:" << c.tag << " client:" <<
                         c.client_id << " }";
@@ -348,7 +635,7 @@ namespace crimson {
             // ClientRec could be "protected" with no issue. [See comments
             // associated with function submit_top_request.]
             class ClientRec {
-                friend PriorityQueueBase<C, R, U1, B>;
+                friend PriorityQueueBase<C, R, U1, B, K>;
 
                 C client;
                 RequestTag prev_tag;
@@ -379,6 +666,47 @@ namespace crimson {
                 uint32_t cur_delta;
 
                 double resource;
+                // capacity units charged against the burst and deltar
+                // budgets this window; equal to b_counter and deltar_counter
+                // when every op class costs one unit
+                double b_units = 0.0;
+                double deltar_units = 0.0;
+                // arrivals binned across the current window, queue depth
+                // seen at arrival, and their smoothed history
+                static constexpr unsigned arrival_slots = 10;
+                uint32_t slot_arrivals[arrival_slots] = {0};
+                double depth_sum = 0.0;
+                uint32_t depth_max = 0;
+                ArrivalStats arrival_stats = {0.0, 0.0, 0.0, 0};
+                ClientType proposed_type = ClientType::O;
+                unsigned proposed_windows = 0;
+                // the info client_info_f supplied, when the classifier has
+                // replaced info with one of its own; nullptr otherwise
+                const ClientInfo *supplied_info = nullptr;
+
+                // requests dispatched this window and the smoothed rate, in
+                // requests per second, at which the client has been served
+                uint32_t win_dispatched = 0;
+                double service_rate = 0.0;
+                // dispatch latencies this window; allocated once the window
+                // history is on
+                std::unique_ptr<WindowLatency> win_latency;
+                // when the requests not yet reported completed were
+                // dispatched, oldest first; allocated for foreground clients
+                // once the background controller is on
+                std::unique_ptr<std::deque<Time>> outstanding;
+                // queueing delays of this client's requests; see
+                // track_client_delay
+                std::unique_ptr<DelayHistogram> delay_histogram;
+                // the class the client and its requests are counted under
+                // for memory_usage; follows info->client_type when the
+                // client changes heaps
+                ClientType counted_type = ClientType::O;
+
+                // the op class of the next request has used up its capacity
+                // for the window; sorts the client behind ready clients in
+                // the burst and deltar heaps until the window rolls over
+                bool op_blocked = false;
                 // deltar counter
                 std::atomic_uint deltar_counter;
                 std::atomic_uint deltar_break_limit_counter;
@@ -398,6 +726,10 @@ namespace crimson {
 
                 std::atomic_uint r_compensation;
 
+                // true between crossing the backpressure high watermark and
+                // draining back to the low watermark
+                bool throttled = false;
+
                 ClientRec(C _client,
                           const ClientInfo *_info,
                           Counter current_tick) :
@@ -441,8 +773,11 @@ namespace crimson {
 
                 inline void add_request(const RequestTag &tag,
                                         const C &client_id,
-                                        RequestRef &&request) {
-                    requests.emplace_back(ClientReq(tag, client_id, std::move(request)));
+                                        RequestRef &&request,
+                                        const Time expiry = TimeZero,
+                                        const OpClass op_class = OpClass::read) {
+                    requests.emplace_back(ClientReq(tag, client_id, std::move(request),
+                                                    expiry, op_class));
                 }
 
                 inline const ClientReq &next_request() const {
@@ -511,7 +846,7 @@ namespace crimson {
 
                 friend std::ostream &
                 operator<<(std::ostream &out,
-                           const typename PriorityQueueBase<C, R, U1, B>::ClientRec &e) {
+                           const typename PriorityQueueBase<C, R, U1, B, K>::ClientRec &e) {
                     out << "{ ClientRec::" <<
                         " client:" << e.client <<
                         " prev_tag:" << e.prev_tag <<
@@ -578,6 +913,15 @@ namespace crimson {
             // a function that can be called to look up client information
             using ClientInfoFunc = std::function<const ClientInfo *(const C &)>;
 
+            // a function that is handed each request dropped because its
+            // expiry time passed before it could be dispatched
+            using ExpiredRequestFunc = std::function<void(const C &, RequestRef &&)>;
+
+            // a function told when a client's queue depth crosses the high
+            // watermark (throttle is true) and when it drains back to the
+            // low watermark (throttle is false); called with data_mtx held
+            using BackpressureFunc = std::function<void(const C &, bool throttle)>;
+
 
             bool empty() const {
                 // TODO: to be modified
@@ -615,11 +959,13 @@ namespace crimson {
             bool remove_by_req_filter(std::function<bool(RequestRef &&)> filter_accum,
                                       bool visit_backwards = false) {
                 bool any_removed = false;
-                DataGuard g(data_mtx);
+                ProfiledGuard g(data_mtx, lock_profile(LockSite::remove));
                 for (auto i : client_map) {
+                    const size_t before = i.second->request_count();
                     bool modified =
                             i.second->remove_by_req_filter(filter_accum, visit_backwards);
                     if (modified) {
+                        note_requests_removed(*i.second, before - i.second->request_count());
                         // TODO: by different client type
                         if (i.second->info->client_type == ClientType::R) {
                             resv_heap.adjust(*i.second);
@@ -656,7 +1002,7 @@ namespace crimson {
             void remove_by_client(const C &client,
                                   bool reverse = false,
                                   std::function<void(RequestRef &&)> accum = request_sink) {
-                DataGuard g(data_mtx);
+                ProfiledGuard g(data_mtx, lock_profile(LockSite::remove));
 
                 auto i = client_map.find(client);
 
@@ -676,7 +1022,9 @@ namespace crimson {
                     }
                 }
 
+                const size_t removed = i->second->request_count();
                 i->second->requests.clear();
+                note_requests_removed(*i->second, removed);
 // TODO: by different client type
                 if (i->second->info->client_type == ClientType::R) {
                     resv_heap.adjust(*i->second);
@@ -704,186 +1052,843 @@ namespace crimson {
             }
 
 
-            uint get_heap_branching_factor() const {
-                return B;
+            // Sets how many capacity units one op of the class consumes;
+            // system_capacity and the burst and deltar budgets are
+            // expressed in these units. Both classes cost 1 by default.
+            void set_op_class_cost(OpClass op_class, double units) {
+                assert(units > 0.0);
+                DataGuard g(data_mtx);
+                op_class_cost[size_t(op_class)] = units;
             }
 
 
-            void update_client_info(const C &client_id) {
+            // Caps the units per second the op class may consume before its
+            // requests stop being admitted in the burst and deltar phases;
+            // 0 means the class is only bound by system_capacity.
+            void set_op_class_capacity(OpClass op_class, double units_per_sec) {
                 DataGuard g(data_mtx);
-                auto client_it = client_map.find(client_id);
-                if (client_map.end() != client_it) {
-                    ClientRec &client = (*client_it->second);
-                    double old_wgt = client.info->weight;
-                    //reduce_total_wgt(client.info->weight);
-                    // reduce_total_reserv(client.info->reservation);
-                    client.info = client_info_f(client_id);
-                    // add_total_wgt(client.info->weight);
-                    //add_total_reserv(client.info->reservation);
-                    if (ClientType::O != client.info->client_type) {
-                        add_total_wgt_and_update_client_res(client.info->weight - old_wgt);
-                    }
+                op_class_capacity[size_t(op_class)] = units_per_sec;
+            }
+
+
+            // capacity units the op class has consumed in the current window
+            double get_op_class_used(OpClass op_class) const {
+                DataGuard g(data_mtx);
+                return op_class_used[size_t(op_class)];
+            }
+
+
+            // Caps the requests a single client, and the queue as a whole,
+            // may have queued; requests over a cap are rejected. 0 means no
+            // cap.
+            void set_queue_caps(size_t _client_max, size_t _total_max) {
+                DataGuard g(data_mtx);
+                client_queue_max = _client_max;
+                total_queue_max = _total_max;
+            }
+
+
+            void set_backpressure_f(size_t _high_mark,
+                                    size_t _low_mark,
+                                    BackpressureFunc _backpressure_f) {
+                assert(_low_mark < _high_mark);
+                DataGuard g(data_mtx);
+                backpressure_high = _high_mark;
+                backpressure_low = _low_mark;
+                backpressure_f = _backpressure_f;
+            }
+
+
+            // requests currently queued, tracked as they come and go
+            size_t queued_count() const {
+                DataGuard g(data_mtx);
+                return queued_total;
+            }
+
+
+            // use as a default value when no expired request handler is
+            // provided
+            static void expired_request_sink(const C &client, RequestRef &&req) {
+                // do nothing
+            }
+
+
+            void set_expired_request_f(ExpiredRequestFunc _expired_request_f) {
+                DataGuard g(data_mtx);
+                expired_request_f = _expired_request_f;
+            }
+
+
+            // Drops every queued request whose expiry is at or before
+            // now. Only clients that were handed a request with an expiry
+            // since the last sweep are visited, so the cost does not grow
+            // with the number of clients. Returns the number dropped.
+            size_t expire_requests(Time now) {
+                DataGuard g(data_mtx);
+                return do_expire_requests(now);
+            }
+
+
+            size_t expire_requests() {
+                return expire_requests(get_time());
+            }
+
+
+            size_t get_expired_count(ClientType client_type) const {
+                DataGuard g(data_mtx);
+                return expired_count[client_type];
+            }
+
+
+            // Bounds how long a request of an O client may wait: once it
+            // has waited max_wait seconds it is served right after the
+            // reservation phase, ahead of burst, deltar and best-effort
+            // requests. 0 turns aging off. Applies to requests added
+            // afterwards. The bound does not override the client's limit
+            // (nor the background scale applied to it): while the client
+            // is over its limit its request is not ready and the aged
+            // stage passes it over, so it waits for its limit tag and is
+            // then served as aged. The wait is thus at most the larger of
+            // max_wait and the time to the limit tag.
+            void set_other_max_wait(Time max_wait) {
+                DataGuard g(data_mtx);
+                other_max_wait = max_wait;
+            }
+
+
+            size_t get_aged_sched_count() const {
+                DataGuard g(data_mtx);
+                return aged_sched_count;
+            }
+
+
+            // Turns the stage timing of scheduling decisions on or off;
+            // while on, one decision in every 2^sample_shift is timed.
+            // Outcome and promotion counts are kept either way.
+            void set_decision_timing(bool on, unsigned sample_shift = 6) {
+                if (on) {
+                    ProfileClock::calibrate_once();
                 }
+                DataGuard g(data_mtx);
+                decision_timing = on;
+                decision_sample_mask = (uint64_t(1) << sample_shift) - 1;
             }
 
 
-            void update_client_infos() {
+            DecisionStats get_decision_stats() const {
                 DataGuard g(data_mtx);
-                for (auto i : client_map) {
-                    i.second->info = client_info_f(i.second->client);
+                DecisionStats result = decision_stats;
+                const double ns_per_tick = ProfileClock::ns_per_tick();
+                for (size_t s = 0; s < DecisionStats::stage_count; ++s) {
+                    result.stage_ns[s] = uint64_t(decision_stage_ticks[s] * ns_per_tick);
                 }
+                return result;
             }
 
 
-            friend std::ostream &operator<<(std::ostream &out,
-                                            const PriorityQueueBase &q) {
-                std::lock_guard<decltype(q.data_mtx)> guard(q.data_mtx);
+            // Turns wait and hold timing of data_mtx on or off for every
+            // LockSite; while on, one acquisition in every 2^sample_shift
+            // on each thread is timed.
+            void enable_lock_profiling(bool on, unsigned sample_shift = 6) {
+                for (auto &profile : lock_profiles) {
+                    profile.set_enabled(on, sample_shift);
+                }
+            }
 
-                out << "{ PriorityQueue::";
-                for (const auto &c : q.client_map) {
-                    out << "  { client:" << c.first << ", record:" << *c.second <<
-                        " }";
-                }
-                if (!q.resv_heap.empty()) {
-                    const auto &resv = q.resv_heap.top();
-                    out << " { reservation_top:" << resv << " }";
-                    const auto &ready = q.burst_heap.top();
-                    out << " { ready_top:" << ready << " }";
-                    const auto &limit = q.limit_heap.top();
-                    out << " { limit_top:" << limit << " }";
+
+            // Turns on or off recording the queueing delay of every
+            // dispatched request by client class and by DelayPhase; turning
+            // it on starts afresh.
+            void enable_delay_tracking(bool on) {
+                DataGuard g(data_mtx);
+                if (on) {
+                    delay_tracking.reset(new DelayTracking);
                 } else {
-                    out << " HEAPS-EMPTY";
+                    delay_tracking.reset();
                 }
-                out << " }";
+            }
 
-                return out;
+
+            DelayHistogram get_class_delay(ClientType type) const {
+                DataGuard g(data_mtx);
+                return delay_tracking ? delay_tracking->by_class[type] : DelayHistogram();
             }
 
-            // for debugging
-            void display_queues(std::ostream &out,
-                                bool show_res = true,
-                                bool show_lim = true,
-                                bool show_ready = true,
-                                bool show_prop = true) const {
-                auto filter = [](const ClientRec &e) -> bool { return true; };
+
+            DelayHistogram get_phase_delay(DelayPhase phase) const {
                 DataGuard g(data_mtx);
-                if (show_res) {
-                    resv_heap.display_sorted(out << "RESER:", filter);
-                    deltar_heap.display_sorted(out << "DELTA:", filter);
+                return delay_tracking ? delay_tracking->by_phase[size_t(phase)] : DelayHistogram();
+            }
+
+
+            // Records, or stops recording, the queueing delays of client's
+            // requests into a histogram of its own, whether or not delay
+            // tracking is on; for a few hot clients, as each histogram
+            // takes about 9KB. Does nothing for an unknown client.
+            void track_client_delay(const C &client_id, bool on) {
+                DataGuard g(data_mtx);
+                auto i = client_map.find(client_id);
+                if (client_map.end() == i) {
+                    return;
                 }
-                if (show_lim) {
-                    limit_heap.display_sorted(out << "LIMIT:", filter);
+                if (!on && i->second->delay_histogram) {
+                    i->second->delay_histogram.reset();
+                    --delay_histograms;
+                } else if (on && !i->second->delay_histogram) {
+                    i->second->delay_histogram.reset(new DelayHistogram);
+                    ++delay_histograms;
                 }
-                if (show_ready) {
-                    burst_heap.display_sorted(out << "READY:", filter);
+            }
+
+
+            // empty unless the client's delays are tracked
+            DelayHistogram get_client_delay(const C &client_id) const {
+                DataGuard g(data_mtx);
+                auto i = client_map.find(client_id);
+                if (client_map.end() == i || !i->second->delay_histogram) {
+                    return DelayHistogram();
                 }
-//#if USE_PROP_HEAP
-//                if (show_prop) {
-//                    prop_heap.display_sorted(out << "PROPO:", filter);
-//                }
-//#endif
-            } // display_queues
+                return *i->second->delay_histogram;
+            }
 
 
-        protected:
+            // the sampled waits for data_mtx at site, in nanoseconds; the
+            // rollover site has none, since it runs inside a pull
+            RuntimeProfile::Histogram get_lock_wait(LockSite site) const {
+                return lock_profiles[size_t(site)].wait.snapshot();
+            }
 
-            // The ClientCompare functor is essentially doing a precedes?
-            // operator, returning true if and only if the first parameter
-            // must precede the second parameter. If the second must precede
-            // the first, or if they are equivalent, false should be
-            // returned. The reason for this behavior is that it will be
-            // called to test if two items are out of order and if true is
-            // returned it will reverse the items. Therefore false is the
-            // default return when it doesn't matter to prevent unnecessary
-            // re-ordering.
-            //
-            // The template is supporting variations in sorting based on the
-            // heap in question and allowing these variations to be handled
-            // at compile-time.
-            //
-            // tag_field determines which tag is being used for comparison
-            //
-            // ready_opt determines how the ready flag influences the sort
-            //
-            // use_prop_delta determines whether the proportional delta is
-            // added in for comparison
-            template<double RequestTag::*tag_field,
-                    ReadyOption ready_opt,
-                    bool use_prop_delta>
-            struct ClientCompare {
-                bool operator()(const ClientRec &n1, const ClientRec &n2) const {
-                    if (n1.has_request()) {
-                        if (n2.has_request()) {
-                            const auto &t1 = n1.next_request().tag;
-                            const auto &t2 = n2.next_request().tag;
-                            if (ReadyOption::ignore == ready_opt || t1.ready == t2.ready) {
-                                // if we don't care about ready or the ready values are the same
-                                if (use_prop_delta) {
-                                    return (t1.*tag_field + n1.prop_delta) <
-                                           (t2.*tag_field + n2.prop_delta);
-                                } else {
-                                    return t1.*tag_field < t2.*tag_field;
-                                }
-                            } else if (ReadyOption::raises == ready_opt) {
-                                // use_ready == true && the ready fields are different
-                                return t1.ready;
-                            } else {
-                                return t2.ready;
-                            }
-                        } else {
-                            // n1 has request but n2 does not
-                            return true;
-                        }
-                    } else if (n2.has_request()) {
-                        // n2 has request but n1 does not
-                        return false;
-                    } else {
-                        // both have none; keep stable w false
-                        return false;
-                    }
+
+            // the sampled holds of data_mtx at site, in nanoseconds
+            RuntimeProfile::Histogram get_lock_hold(LockSite site) const {
+                return lock_profiles[size_t(site)].hold.snapshot();
+            }
+
+
+            // Starts recording adds, dispatches, limit promotions and window
+            // rollovers into a fresh ring of at least capacity events;
+            // 0 stops recording. A recorder already handed out by
+            // get_trace_recorder keeps what it holds.
+            void enable_trace(size_t capacity) {
+                DataGuard g(data_mtx);
+                if (capacity > 0) {
+                    trace_recorder = std::make_shared<TraceRecorder>(capacity);
+                } else {
+                    trace_recorder.reset();
                 }
-            };
+            }
 
-            ClientInfoFunc client_info_f;
-            static constexpr bool is_dynamic_cli_info_f = U1;
 
-            mutable std::mutex data_mtx;
-            using DataGuard = std::lock_guard<decltype(data_mtx)>;
+            std::shared_ptr<TraceRecorder> get_trace_recorder() const {
+                DataGuard g(data_mtx);
+                return trace_recorder;
+            }
 
-            // stable mapping between client ids and client queues
-            std::map<C, ClientRecRef> client_map;
 
-            //
-            std::map<C, int> client_no;
-            std::atomic_uint next_client_no;
+            // writes the recorded events as Chrome trace-event JSON; the
+            // ring is read without holding data_mtx
+            void dump_trace(std::ostream &out) const {
+                std::shared_ptr<TraceRecorder> recorder = get_trace_recorder();
+                if (!recorder) {
+                    out << "{\"traceEvents\":[]}\n";
+                    return;
+                }
+                recorder->dump_chrome_json(out, [](uint8_t outcome) {
+                    std::ostringstream name;
+                    name << DecisionOutcome(outcome);
+                    return name.str();
+                });
+            }
 
-            std::map<C, const ClientInfo*> compensated_client_map; 
 
-            c::IndIntruHeap<ClientRecRef,
-                    ClientRec,
-                    &ClientRec::reserv_heap_data,
-                    ClientCompare<&RequestTag::reservation,
-                            ReadyOption::ignore,
-                            false>,
-                    B> resv_heap;
-            c::IndIntruHeap<ClientRecRef,
-                    ClientRec,
-                    &ClientRec::deltar_heap_data,
-                    ClientCompare<&RequestTag::proportion,
-                            ReadyOption::raises,
-                            true>,
-                    B> deltar_heap;
-            c::IndIntruHeap<ClientRecRef,
-                    ClientRec,
-                    &ClientRec::r_limit_heap_data,
-                    ClientCompare<&RequestTag::limit,
-                            ReadyOption::lowers,
-                            false>,
-                    B> r_limit_heap;
-//#if USE_PROP_HEAP
-//            c::IndIntruHeap<ClientRecRef,
-//                    ClientRec,
-//                    &ClientRec::prop_heap_data,
+            // Serves the metrics published at every window rollover in
+            // Prometheus text format, on a Unix socket at path or on
+            // 127.0.0.1:port (0 picks a free port, see get_metrics_port).
+            // Replaces an exporter already running. Returns false, with
+            // errno set, when the socket cannot be set up.
+            bool serve_metrics_unix(const std::string &path) {
+                return serve_metrics([&path](MetricsExporter &e) {
+                    return e.listen_unix(path);
+                });
+            }
+
+
+            bool serve_metrics_loopback(uint16_t port) {
+                return serve_metrics([port](MetricsExporter &e) {
+                    return e.listen_loopback(port);
+                });
+            }
+
+
+            void stop_metrics() {
+                std::unique_ptr<MetricsExporter> stopping;
+                {
+                    DataGuard g(data_mtx);
+                    stopping = std::move(metrics_exporter);
+                }
+                // joined outside the lock
+            }
+
+
+            uint16_t get_metrics_port() const {
+                DataGuard g(data_mtx);
+                return metrics_exporter ? metrics_exporter->port() : 0;
+            }
+
+
+            // publishes the current state now rather than at the next
+            // rollover
+            void refresh_metrics() {
+                DataGuard g(data_mtx);
+                publish_metrics();
+            }
+
+
+            // the latest published metrics; null before the first
+            // publication. Does not take data_mtx: the counters published
+            // are formatted here, on the caller's thread.
+            std::shared_ptr<const MetricsSnapshot> get_metrics_snapshot() const {
+                std::shared_ptr<const MetricsCounters> counters =
+                        std::atomic_load(&metrics_counters);
+                if (!counters) {
+                    return nullptr;
+                }
+                return format_metrics(*counters);
+            }
+
+
+            // Publishes the counters of every window, as it ends, into the
+            // POSIX shared-memory segment name (see dmclock_shm.h and
+            // dmc_top), room for max_clients clients. Replaces a segment
+            // already published. Returns false, with errno set, when the
+            // segment cannot be created.
+            bool publish_shm_stats(const std::string &name, uint32_t max_clients = 1024) {
+                std::unique_ptr<ShmStatsWriter> writer(new ShmStatsWriter);
+                if (!writer->open(name, max_clients)) {
+                    return false;
+                }
+                DataGuard g(data_mtx);
+                shm_writer = std::move(writer);
+                write_shm_stats();
+                return true;
+            }
+
+
+            // unlinks the segment
+            void stop_shm_stats() {
+                DataGuard g(data_mtx);
+                shm_writer.reset();
+            }
+
+
+            // Keeps the per-client records of the last windows windows --
+            // what printScheduling writes, plus dispatch latency
+            // percentiles -- in memory, starting afresh; 0 stops.
+            void set_window_history(size_t windows) {
+                DataGuard g(data_mtx);
+                std::shared_ptr<WindowHistory<C>> history;
+                if (windows > 0) {
+                    history = std::make_shared<WindowHistory<C>>(windows);
+                }
+                for (auto &c : client_map) {
+                    c.second->win_latency.reset();
+                }
+                latency_buffers = 0;
+                std::atomic_store(&window_history, history);
+            }
+
+
+            // all clients' records of the window back windows before the
+            // latest ended one; null if it is not kept. Does not take
+            // data_mtx.
+            std::shared_ptr<const HistoryWindow<C>> get_window_history(size_t back = 0) const {
+                std::shared_ptr<WindowHistory<C>> history = std::atomic_load(&window_history);
+                if (!history) {
+                    return std::shared_ptr<const HistoryWindow<C>>();
+                }
+                return history->get(back);
+            }
+
+
+            // client's records of at most max_windows of the kept windows,
+            // latest first. Does not take data_mtx.
+            std::vector<ClientHistoryEntry<C>> get_client_history(const C &client,
+                                                                  size_t max_windows = SIZE_MAX) const {
+                std::shared_ptr<WindowHistory<C>> history = std::atomic_load(&window_history);
+                if (!history) {
+                    return std::vector<ClientHistoryEntry<C>>();
+                }
+                return history->find(client, max_windows);
+            }
+
+
+            // O(1); see MemoryUsage
+            MemoryUsage memory_usage() const {
+                DataGuard g(data_mtx);
+                return compute_memory_usage();
+            }
+
+
+            QosStats<C> get_qos_stats() const {
+                DataGuard g(data_mtx);
+                return qos_stats;
+            }
+
+
+            void reset_qos_stats() {
+                DataGuard g(data_mtx);
+                qos_stats = QosStats<C>();
+            }
+
+
+            void reset_decision_stats() {
+                DataGuard g(data_mtx);
+                decision_stats = DecisionStats();
+                std::fill(std::begin(decision_stage_ticks),
+                          std::end(decision_stage_ticks), 0);
+            }
+
+
+            // Treats O clients as background IO (recovery, scrub) whose
+            // limit is scaled by a controller. A foreground request's
+            // latency runs from its dispatch to the request_completed for
+            // its client, completions being matched to dispatches in
+            // order. Every interval seconds, starting now, the p99 of the
+            // latencies is compared with target_p99: above it the scale is
+            // halved, below 80% of it the scale grows by 0.1 up to 1. Fewer
+            // than min_samples latencies (but more than none, which means
+            // headroom) hold the step off until there are enough. An O
+            // client without a limit is scaled against system_capacity. A
+            // target_p99 of 0 turns the controller off.
+            void set_background_target(Time target_p99,
+                                       Time interval = 1.0,
+                                       double min_scale = 0.05,
+                                       size_t min_samples = 20) {
+                DataGuard g(data_mtx);
+                bg_target_p99 = target_p99;
+                bg_interval = interval;
+                bg_min_scale = min_scale;
+                bg_min_samples = min_samples;
+                bg_scale = 1.0;
+                bg_last_adjust = get_time();
+                fg_latencies.clear();
+                fg_latency_next = 0;
+                for (auto &c : client_map) {
+                    c.second->outstanding.reset();
+                }
+                std::fill_n(class_outstanding_buffers, 4, 0);
+                std::fill_n(class_outstanding_times, 4, 0);
+                apply_background_scale();
+            }
+
+
+            double get_background_scale() const {
+                DataGuard g(data_mtx);
+                return bg_scale;
+            }
+
+
+            // Expected seconds until a request of the given cost, added now
+            // by the client, is dispatched. It is the larger of the delay
+            // its next reservation or limit tag imposes and the time the
+            // client's recent service rate needs to drain its queue. A
+            // client the queue has not seen is assumed to get its weight's
+            // share of its class's recent service rate.
+            Time estimate_wait(const C &client_id, double cost = 1.0) const {
+                DataGuard g(data_mtx);
+                return do_estimate_wait(client_id, cost, get_time());
+            }
+
+
+            // requests per second recently dispatched to clients of the type
+            double get_service_rate(ClientType client_type) const {
+                DataGuard g(data_mtx);
+                return class_service_rate[client_type];
+            }
+
+
+            // Factor the reservations of R clients are currently scaled by;
+            // below 1 while their sum exceeds system_capacity.
+            double get_reservation_scale() const {
+                DataGuard g(data_mtx);
+                return reservation_scale;
+            }
+
+
+            // sum of the reservations of the active R clients, as of the
+            // last window rollover
+            double get_reservation_demand() const {
+                DataGuard g(data_mtx);
+                return reservation_demand;
+            }
+
+
+            // Called whenever the classifier proposes or applies a new
+            // type for a client.
+            using ClassifyFunc = std::function<void(const C &client,
+                                                    ClientType from,
+                                                    ClientType to,
+                                                    bool applied)>;
+
+            void set_classifier(const ClassifierConfig &config,
+                                ClassifyFunc classify_f = ClassifyFunc()) {
+                DataGuard g(data_mtx);
+                classifier = config;
+                classifier_f = classify_f;
+            }
+
+
+            ArrivalStats get_arrival_stats(const C &client_id) const {
+                DataGuard g(data_mtx);
+                auto client_it = client_map.find(client_id);
+                if (client_map.end() == client_it) {
+                    return ArrivalStats{0.0, 0.0, 0.0, 0};
+                }
+                return client_it->second->arrival_stats;
+            }
+
+
+            uint get_heap_branching_factor() const {
+                return B;
+            }
+
+
+            void update_client_info(const C &client_id) {
+                DataGuard g(data_mtx);
+                auto client_it = client_map.find(client_id);
+                if (client_map.end() != client_it) {
+                    ClientRec &client = (*client_it->second);
+                    double old_wgt = client.info->weight;
+                    //reduce_total_wgt(client.info->weight);
+                    // reduce_total_reserv(client.info->reservation);
+                    client.info = client_info_f(client_id);
+                    // add_total_wgt(client.info->weight);
+                    //add_total_reserv(client.info->reservation);
+                    if (ClientType::O != client.info->client_type) {
+                        add_total_wgt_and_update_client_res(client.info->weight - old_wgt);
+                    }
+                }
+            }
+
+
+            void update_client_infos() {
+                DataGuard g(data_mtx);
+                for (auto i : client_map) {
+                    i.second->info = client_info_f(i.second->client);
+                }
+            }
+
+
+            // A copy of what diagnostics show of a client record; it reads
+            // like the record to ClientCompare, so a snapshot sorts in heap
+            // order without the lock.
+            struct RecordView {
+                struct Top {
+                    RequestTag tag;
+                    Time age_limit;
+                };
+
+                C client;
+                ClientType client_type;
+                RequestTag prev_tag;
+                size_t request_count;
+                bool op_blocked;
+                double prop_delta;
+                Top top; // prev_tag when there is no request
+
+                explicit RecordView(const ClientRec &rec) :
+                        client(rec.client),
+                        client_type(rec.info->client_type),
+                        prev_tag(rec.prev_tag),
+                        request_count(rec.request_count()),
+                        op_blocked(rec.op_blocked),
+                        prop_delta(rec.prop_delta),
+                        top{rec.has_request() ? rec.next_request().tag : rec.prev_tag,
+                            rec.has_request() ? rec.next_request().age_limit : max_tag} {
+                    // empty
+                }
+
+                bool has_request() const {
+                    return request_count > 0;
+                }
+
+                const Top &next_request() const {
+                    return top;
+                }
+
+                // as ClientRec is shown
+                friend std::ostream &operator<<(std::ostream &out, const RecordView &v) {
+                    out << "{ ClientRec::" <<
+                        " client:" << v.client <<
+                        " prev_tag:" << v.prev_tag <<
+                        " req_count:" << v.request_count <<
+                        " top_req:";
+                    if (v.has_request()) {
+                        out << "{ ClientReq:: tag:" << v.top.tag << " client:" <<
+                            v.client << " }";
+                    } else {
+                        out << "none";
+                    }
+                    out << " }";
+                    return out;
+                }
+            }; // struct RecordView
+
+            // the client records, in client order, and the tops of the
+            // reservation, burst and limit heaps
+            struct QueueSnapshot {
+                std::vector<RecordView> records;
+                std::unique_ptr<RecordView> resv_top;
+                std::unique_ptr<RecordView> ready_top;
+                std::unique_ptr<RecordView> limit_top;
+            };
+
+            // Copies the client records chunk records at a time, releasing
+            // data_mtx in between, so the lock is never held for more than
+            // a chunk however many clients there are. Each chunk is
+            // consistent; clients added or erased between chunks may be
+            // missed or shown as they were.
+            QueueSnapshot snapshot(size_t chunk = 256) const {
+                QueueSnapshot result;
+                chunk = std::max(chunk, size_t(1));
+                bool started = false;
+                C last = C();
+                while (true) {
+                    DataGuard g(data_mtx);
+                    auto i = started ? client_map.upper_bound(last) : client_map.begin();
+                    for (size_t n = 0; n < chunk && client_map.end() != i; ++n, ++i) {
+                        result.records.emplace_back(*i->second);
+                    }
+                    if (client_map.end() == i) {
+                        if (!resv_heap.empty()) {
+                            result.resv_top.reset(new RecordView(resv_heap.top()));
+                        }
+                        if (!burst_heap.empty()) {
+                            result.ready_top.reset(new RecordView(burst_heap.top()));
+                        }
+                        if (!limit_heap.empty()) {
+                            result.limit_top.reset(new RecordView(limit_heap.top()));
+                        }
+                        return result;
+                    }
+                    last = result.records.back().client;
+                    started = true;
+                }
+            }
+
+
+            // formats a snapshot, outside data_mtx
+            friend std::ostream &operator<<(std::ostream &out,
+                                            const PriorityQueueBase &q) {
+                const QueueSnapshot snap = q.snapshot();
+
+                out << "{ PriorityQueue::";
+                for (const auto &r : snap.records) {
+                    out << "  { client:" << r.client << ", record:" << r << " }";
+                }
+                if (snap.resv_top) {
+                    out << " { reservation_top:" << *snap.resv_top << " }";
+                    if (snap.ready_top) {
+                        out << " { ready_top:" << *snap.ready_top << " }";
+                    }
+                    if (snap.limit_top) {
+                        out << " { limit_top:" << *snap.limit_top << " }";
+                    }
+                } else {
+                    out << " HEAPS-EMPTY";
+                }
+                out << " }";
+
+                return out;
+            }
+
+            // for debugging; the heaps are rebuilt from a snapshot and
+            // sorted outside data_mtx
+            void display_queues(std::ostream &out,
+                                bool show_res = true,
+                                bool show_lim = true,
+                                bool show_ready = true,
+                                bool show_prop = true) const {
+                const QueueSnapshot snap = snapshot();
+                if (show_res) {
+                    display_sorted(out << "RESER:", snap, ClientType::R, resv_heap);
+                    display_sorted(out << "DELTA:", snap, ClientType::R, deltar_heap);
+                }
+                if (show_lim) {
+                    display_sorted(out << "LIMIT:", snap, ClientType::B, limit_heap);
+                }
+                if (show_ready) {
+                    display_sorted(out << "READY:", snap, ClientType::B, burst_heap);
+                }
+//#if USE_PROP_HEAP
+//                if (show_prop) {
+//                    prop_heap.display_sorted(out << "PROPO:", filter);
+//                }
+//#endif
+            } // display_queues
+
+
+        protected:
+
+            // The ClientCompare functor is essentially doing a precedes?
+            // operator, returning true if and only if the first parameter
+            // must precede the second parameter. If the second must precede
+            // the first, or if they are equivalent, false should be
+            // returned. The reason for this behavior is that it will be
+            // called to test if two items are out of order and if true is
+            // returned it will reverse the items. Therefore false is the
+            // default return when it doesn't matter to prevent unnecessary
+            // re-ordering.
+            //
+            // The template is supporting variations in sorting based on the
+            // heap in question and allowing these variations to be handled
+            // at compile-time.
+            //
+            // tag_field determines which tag is being used for comparison
+            //
+            // ready_opt determines how the ready flag influences the sort
+            //
+            // use_prop_delta determines whether the proportional delta is
+            // added in for comparison
+            //
+            // use_aging caps the compared value at the request's age limit,
+            // so a request that has waited its maximum sorts ahead of
+            // every request whose tag is later than that limit
+            template<double RequestTag::*tag_field,
+                    ReadyOption ready_opt,
+                    bool use_prop_delta,
+                    bool use_aging>
+            struct ClientCompare {
+                // Rec is ClientRec or RecordView
+                template<typename Rec>
+                bool operator()(const Rec &n1, const Rec &n2) const {
+                    if (n1.has_request()) {
+                        if (n2.has_request()) {
+                            const auto &t1 = n1.next_request().tag;
+                            const auto &t2 = n2.next_request().tag;
+                            // an op-blocked client is not ready as far as
+                            // the heaps that raise ready clients go
+                            const bool ready1 = t1.ready &&
+                                                (ReadyOption::raises != ready_opt || !n1.op_blocked);
+                            const bool ready2 = t2.ready &&
+                                                (ReadyOption::raises != ready_opt || !n2.op_blocked);
+                            if (ReadyOption::ignore == ready_opt || ready1 == ready2) {
+                                // if we don't care about ready or the ready values are the same
+                                if (use_aging) {
+                                    return std::min(t1.*tag_field + n1.prop_delta,
+                                                    n1.next_request().age_limit) <
+                                           std::min(t2.*tag_field + n2.prop_delta,
+                                                    n2.next_request().age_limit);
+                                } else if (use_prop_delta) {
+                                    return (t1.*tag_field + n1.prop_delta) <
+                                           (t2.*tag_field + n2.prop_delta);
+                                } else {
+                                    return t1.*tag_field < t2.*tag_field;
+                                }
+                            } else if (ReadyOption::raises == ready_opt) {
+                                // use_ready == true && the ready fields are different
+                                return ready1;
+                            } else {
+                                return ready2;
+                            }
+                        } else {
+                            // n1 has request but n2 does not
+                            return true;
+                        }
+                    } else if (n2.has_request()) {
+                        // n2 has request but n1 does not
+                        return false;
+                    } else {
+                        // both have none; keep stable w false
+                        return false;
+                    }
+                }
+            };
+
+            ClientInfoFunc client_info_f;
+            static constexpr bool is_dynamic_cli_info_f = U1;
+
+            mutable std::mutex data_mtx;
+            using DataGuard = std::lock_guard<decltype(data_mtx)>;
+            using ProfiledGuard = ProfiledLockGuard<decltype(data_mtx)>;
+
+            struct DelayTracking {
+                DelayHistogram by_class[4];
+                DelayHistogram by_phase[delay_phase_count];
+            };
+
+            // null unless enable_delay_tracking is on
+            std::unique_ptr<DelayTracking> delay_tracking;
+
+            // wait and hold times of data_mtx, by LockSite
+            std::array<LockProfile, lock_site_count> lock_profiles;
+
+            LockProfile &lock_profile(LockSite site) {
+                return lock_profiles[size_t(site)];
+            }
+
+            // stable mapping between client ids and client queues
+            std::map<C, ClientRecRef> client_map;
+
+            //
+            std::map<C, int> client_no;
+            std::atomic_uint next_client_no;
+
+            std::map<C, const ClientInfo*> compensated_client_map; 
+
+            // (expiry, client, class counted in) for every request added
+            // with an expiry; a sweep pops the due entries and only visits
+            // those clients
+            using ExpiryMark = std::tuple<Time, C, ClientType>;
+            std::priority_queue<ExpiryMark,
+                    std::vector<ExpiryMark>,
+                    std::greater<ExpiryMark>> expiry_marks;
+            ExpiredRequestFunc expired_request_f = expired_request_sink;
+            // expired requests dropped, indexed by ClientType
+            size_t expired_count[4] = {0, 0, 0, 0};
+
+            // per op class: units charged per op, units per second allowed
+            // (0 means no separate cap) and units used this window
+            double op_class_cost[2] = {1.0, 1.0};
+            double op_class_capacity[2] = {0.0, 0.0};
+            double op_class_used[2] = {0.0, 0.0};
+
+            // admission control; 0 means no cap
+            size_t client_queue_max = 0;
+            size_t total_queue_max = 0;
+            size_t queued_total = 0;
+            size_t backpressure_high = 0;
+            size_t backpressure_low = 0;
+            BackpressureFunc backpressure_f;
+
+            c::IndIntruHeap<ClientRecRef,
+                    ClientRec,
+                    &ClientRec::reserv_heap_data,
+                    ClientCompare<&RequestTag::reservation,
+                            ReadyOption::ignore,
+                            false,
+                            false>,
+                    K::resv> resv_heap;
+            c::IndIntruHeap<ClientRecRef,
+                    ClientRec,
+                    &ClientRec::deltar_heap_data,
+                    ClientCompare<&RequestTag::proportion,
+                            ReadyOption::raises,
+                            true,
+                            false>,
+                    K::deltar> deltar_heap;
+            c::IndIntruHeap<ClientRecRef,
+                    ClientRec,
+                    &ClientRec::r_limit_heap_data,
+                    ClientCompare<&RequestTag::limit,
+                            ReadyOption::lowers,
+                            false,
+                            false>,
+                    K::r_limit> r_limit_heap;
+//#if USE_PROP_HEAP
+//            c::IndIntruHeap<ClientRecRef,
+//                    ClientRec,
+//                    &ClientRec::prop_heap_data,
 //                    ClientCompare<&RequestTag::proportion,
 //                            ReadyOption::raises,
 //                            true>,
@@ -894,29 +1899,33 @@ namespace crimson {
                     &ClientRec::lim_heap_data,
                     ClientCompare<&RequestTag::limit,
                             ReadyOption::lowers,
+                            false,
                             false>,
-                    B> limit_heap;
+                    K::limit> limit_heap;
             c::IndIntruHeap<ClientRecRef,
                     ClientRec,
                     &ClientRec::burst_heap_data,
                     ClientCompare<&RequestTag::proportion,
                             ReadyOption::raises,
-                            true>,
-                    B> burst_heap;
+                            true,
+                            false>,
+                    K::burst> burst_heap;
             c::IndIntruHeap<ClientRecRef,
                     ClientRec,
                     &ClientRec::best_heap_data,
                     ClientCompare<&RequestTag::proportion,
                             ReadyOption::raises,
+                            true,
                             true>,
-                    B> best_heap;
+                    K::best> best_heap;
             c::IndIntruHeap<ClientRecRef,
                     ClientRec,
                     &ClientRec::best_limit_heap_data,
                     ClientCompare<&RequestTag::limit,
                             ReadyOption::lowers,
+                            false,
                             false>,
-                    B> best_limit_heap;
+                    K::best_limit> best_limit_heap;
             // if all reservations are met and all other requestes are under
             // limit, this will allow the request next in terms of
             // proportion to still get issued
@@ -932,6 +1941,62 @@ namespace crimson {
             size_t reserv_sched_count = 0;
             size_t prop_sched_count = 0;
             size_t limit_break_sched_count = 0;
+            size_t aged_sched_count = 0;
+
+            // see DecisionStats; stage times are kept in ProfileClock ticks
+            DecisionStats decision_stats;
+            uint64_t decision_stage_ticks[DecisionStats::stage_count] = {};
+            bool decision_timing = false;
+            uint64_t decision_sample_mask = 0;
+            // see QosStats; evaluated at every rollover
+            QosStats<C> qos_stats;
+            // clients and queued requests by class, and clients with a
+            // WindowLatency or a DelayHistogram; kept for memory_usage
+            size_t class_client_count[4] = {0, 0, 0, 0};
+            size_t class_queued_count[4] = {0, 0, 0, 0};
+            size_t latency_buffers = 0;
+            size_t delay_histograms = 0;
+            // by class, expiry marks, clients with outstanding dispatch
+            // times and the times they hold; kept for memory_usage
+            size_t class_expiry_marks[4] = {0, 0, 0, 0};
+            size_t class_outstanding_buffers[4] = {0, 0, 0, 0};
+            size_t class_outstanding_times[4] = {0, 0, 0, 0};
+            // how the last call of do_next_request ended
+            DecisionOutcome last_decision = DecisionOutcome::none;
+
+            // null unless enable_trace was called
+            std::shared_ptr<TraceRecorder> trace_recorder;
+
+            // maximum wait of an O client's request; 0 disables aging
+            Time other_max_wait = 0.0;
+
+            ClassifierConfig classifier;
+            ClassifyFunc classifier_f;
+
+            // per client type: requests dispatched this window, smoothed
+            // requests per second and summed weight of the clients
+            size_t class_dispatched[4] = {0, 0, 0, 0};
+            double class_service_rate[4] = {0.0, 0.0, 0.0, 0.0};
+            double class_weight[4] = {0.0, 0.0, 0.0, 0.0};
+
+            // reservations of the active R clients at the last rollover and
+            // the factor their effective reservations were scaled by
+            double reservation_demand = 0.0;
+            double reservation_scale = 1.0;
+
+            // background throttling of O clients; see set_background_target
+            static constexpr size_t fg_latency_window = 512;
+            // dispatches remembered per client; beyond that the oldest are
+            // taken to have completed unreported
+            static constexpr size_t fg_outstanding_max = 1024;
+            Time bg_target_p99 = 0.0;
+            Time bg_interval = 1.0;
+            double bg_min_scale = 0.05;
+            double bg_scale = 1.0;
+            size_t bg_min_samples = 20;
+            Time bg_last_adjust = 0.0;
+            std::vector<Time> fg_latencies;
+            size_t fg_latency_next = 0;
 
             Duration idle_age;
             Duration erase_age;
@@ -950,34 +2015,54 @@ namespace crimson {
             std::ofstream ofs;
             std::ofstream ofs_pwd;
             std::string s_path;
-            int client_socket;
 
             // mutex for the end of a window
             std::mutex m_win;
             std::mutex m_update_wgt_res;
 
-            // NB: All threads declared at end, so they're destructed first!
+            // what publish_metrics copies out under data_mtx, in the order
+            // format_metrics lists it
+            struct MetricsCounters {
+                struct Client {
+                    int type = 0;
+                    int no = -1;
+                    // reservation, deltar, burst and best effort, each
+                    // within and then breaking the limit
+                    uint64_t phases[8] = {};
+                    size_t queued = 0;
+                    double resource = 0.0;
+                    double compensation = 0.0;
+                    double lag = 0.0;
+                };
 
-            std::unique_ptr<RunEvery> cleaning_job;
+                size_t queued_total = 0;
+                Time win_start = TimeZero;
+                uint64_t outcomes[DecisionStats::outcome_count] = {};
+                uint64_t promotions = 0;
+                QosWindow qos;
+                MemoryUsage memory;
+                size_t class_clients[4] = {};
+                size_t class_queued[4] = {};
+                size_t class_dispatched[4] = {};
+                double class_service_rate[4] = {};
+                std::vector<Client> clients;
+            };
 
+            // the latest published counters; read and replaced only with
+            // std::atomic_load and std::atomic_store
+            std::shared_ptr<const MetricsCounters> metrics_counters;
 
-            void init_client_socket() {
-                client_socket = socket(AF_INET, SOCK_STREAM, 0);
-                if (client_socket == -1) {
-                    // std::cout << "Error: socket" << std::endl;
-                    return;
-                }
-                // connect
-                struct sockaddr_in serverAddr;
-                serverAddr.sin_family = AF_INET;
-                serverAddr.sin_port = htons(18000);
-                serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-                if (connect(client_socket, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
-                    // std::cout << "Error: connect" << std::endl;
-                    client_socket = -1;
-                    return;
-                }
-            }
+            // null unless publish_shm_stats was called
+            std::unique_ptr<ShmStatsWriter> shm_writer;
+
+            // null unless set_window_history was called; replaced only with
+            // std::atomic_store
+            std::shared_ptr<WindowHistory<C>> window_history;
+
+            // NB: All threads declared at end, so they're destructed first!
+
+            std::unique_ptr<RunEvery> cleaning_job;
+            std::unique_ptr<MetricsExporter> metrics_exporter;
 
             // COMMON constructor that others feed into; we can accept three
             // different variations of durations
@@ -1008,7 +2093,6 @@ namespace crimson {
                 getcwd(path, 255);
                 s_path = path;
                 s_path += "/scheduling.txt";
-//              init_client_socket();
                 next_client_no.store(0);
                 // just update client res due to the update of the sys cap and win size
                 add_total_wgt_and_update_client_res(0);
@@ -1043,7 +2127,6 @@ namespace crimson {
                 getcwd(path, 255);
                 s_path = path;
                 s_path += "/scheduling.txt";
-//              init_client_socket();
                 next_client_no.store(0);
                 // just update client res due to the update of the sys cap and win size
                 add_total_wgt_and_update_client_res(0);
@@ -1051,7 +2134,6 @@ namespace crimson {
 
             ~PriorityQueueBase() {
                 finishing = true;
-//              close(client_socket);
                 //ofs.close();
             }
 
@@ -1096,6 +2178,9 @@ namespace crimson {
                     // return info.get();
                     return compensated_client_map[client.client];
                 }
+                if (client.info->client_type == ClientType::O && bg_target_p99 > 0.0) {
+                    return compensated_client_map[client.client];
+                }
 //                if (client.info->client_type == ClientType::B) {
 //                    const std::shared_ptr<ClientInfo> info(
 //                            new ClientInfo(0.0, client.info->weight, client.dlimit, ClientType::B));
@@ -1121,6 +2206,20 @@ namespace crimson {
             }
 
             void move_to_another_heap(std::shared_ptr<ClientRec> client, const ClientInfo* new_client_info){
+                DMC_TRACE3(type_change, trace::client_id(client->client),
+                           int(client->info->client_type),
+                           int(new_client_info->client_type));
+                --class_client_count[client->counted_type];
+                ++class_client_count[new_client_info->client_type];
+                class_queued_count[client->counted_type] -= client->request_count();
+                class_queued_count[new_client_info->client_type] += client->request_count();
+                if (client->outstanding) {
+                    --class_outstanding_buffers[client->counted_type];
+                    ++class_outstanding_buffers[new_client_info->client_type];
+                    class_outstanding_times[client->counted_type] -= client->outstanding->size();
+                    class_outstanding_times[new_client_info->client_type] += client->outstanding->size();
+                }
+                client->counted_type = new_client_info->client_type;
                 // delete from original heap
                 delete_from_heaps(client);
                 if (client->has_request())
@@ -1216,6 +2315,13 @@ namespace crimson {
             }
 
 
+            // the client's number in scheduling.txt, or -1 when it has
+            // none; unlike client_no[], never adds an entry
+            int client_number(const C &client_id) const {
+                auto no = client_no.find(client_id);
+                return client_no.end() == no ? -1 : no->second;
+            }
+
             void printScheduling(std::shared_ptr<ClientRec> client) {
                 std::string client_name;
                 if (ClientType::R == client->info->client_type) {
@@ -1229,7 +2335,7 @@ namespace crimson {
                 }
 
 //                if (typeid(client->client) != typeid(int)){
-                client_name += std::to_string(client_no[client->client]);
+                client_name += std::to_string(client_number(client->client));
 //                }
                 std::stringstream s_builder;
                 s_builder << std::fixed << get_time() << "," << client_name << "(" << client->resource << ", "
@@ -1242,27 +2348,58 @@ namespace crimson {
                 const std::string info = s_builder.str();
 //              ofs << info;
                 ofs_pwd << info;
-//              if (client_socket != -1) {
-//                send(client_socket, info.c_str(), info.length(), 0);
-//              } else {
-//                ofs << "socket connect failed" << std::endl;
-//                ofs_pwd << "socket connect failed" << std::endl;
-//              }
             }
 
-            // data_mtx must be held by caller
-            void do_add_request(RequestRef &&request,
-                                const C &client_id,
-                                const ReqParams &req_params,
-                                const Time time,
-                                const double cost = 0.0) {
+            // seconds for requests to drain at rate per second; with no
+            // rate to go by (a system_capacity of 0), a window
+            double drain_time(size_t requests, double rate) const {
+                return rate > 0.0 ? requests / rate : win_size;
+            }
+
+            // what do_add_request queues, once the request is admitted
+            static RequestRef make_request_ref(RequestRef &&request) {
+                return std::move(request);
+            }
+
+            static RequestRef make_request_ref(R &&request) {
+                return RequestRef(new R(std::move(request)));
+            }
+
+            // data_mtx must be held by caller; request is an R or a
+            // RequestRef, moved from only once admitted, so a rejected
+            // request is left with the caller
+            template<typename Req>
+            AdmissionResult do_add_request(Req &&request,
+                                           const C &client_id,
+                                           const ReqParams &req_params,
+                                           const Time time,
+                                           const double cost = 0.0,
+                                           const Time expiry = TimeZero,
+                                           const OpClass op_class = OpClass::read) {
+                auto client_it = client_map.find(client_id);
+
+                if (total_queue_max > 0 && queued_total >= total_queue_max) {
+                    return AdmissionResult::reject(
+                            time + drain_time(queued_total - total_queue_max + 1,
+                                              system_capacity));
+                }
+                if (client_queue_max > 0 && client_map.end() != client_it &&
+                    client_it->second->request_count() >= client_queue_max) {
+                    const ClientRec &full = *client_it->second;
+                    // the client drains at roughly its share of the capacity
+                    const double rate = full.resource > 0.0 ?
+                                        full.resource / win_size : system_capacity;
+                    return AdmissionResult::reject(
+                            time + drain_time(full.request_count() - client_queue_max + 1,
+                                              rate));
+                }
+
                 ++tick;
 
                 // this pointer will help us create a reference to a shared
                 // pointer, no matter which of two codepaths we take
                 ClientRec *temp_client;
 
-                auto client_it = client_map.find(client_id);
                 if (client_map.end() != client_it) {
                     temp_client = &(*client_it->second); // address of obj of shared_ptr
                 } else {
@@ -1288,7 +2425,16 @@ namespace crimson {
 //                    prop_heap.push(client_rec);
 
                     client_map[client_id] = client_rec;
-                    compensated_client_map[client_id] = new ClientInfo(info->reservation, info->weight, info->limit, info->client_type);
+                    client_rec->counted_type = info->client_type;
+                    ++class_client_count[info->client_type];
+                    // a new R client is scaled like the others until the next
+                    // rollover recomputes the scale
+                    const double scale =
+                            ClientType::R == info->client_type ? reservation_scale : 1.0;
+                    compensated_client_map[client_id] = new ClientInfo(info->reservation * scale, info->weight, info->limit, info->client_type);
+                    if (ClientType::O == info->client_type && bg_target_p99 > 0.0) {
+                        apply_background_scale();
+                    }
 //                    client_no[client_id] = atomic_fetch_add(&next_client_no, 1);
                     client_no[client_id] = next_client_no.fetch_add(1);
 
@@ -1385,7 +2531,31 @@ namespace crimson {
                 client.update_req_tag(tag, tick);
 #endif
 
-                client.add_request(tag, client.client, std::move(request));
+                client.add_request(tag, client.client,
+                                   make_request_ref(std::forward<Req>(request)),
+                                   expiry, op_class);
+                if (ClassifierMode::off != classifier.mode) {
+                    note_arrival(client, time);
+                }
+                ++queued_total;
+                ++class_queued_count[client.counted_type];
+                DMC_TRACE6(add_request, trace::client_id(client.client),
+                           int(client.info->client_type),
+                           trace::ns(tag.reservation), trace::ns(tag.proportion),
+                           trace::ns(tag.limit), client.request_count());
+                trace_event(TraceRecorder::Kind::add, client, 0, time, time);
+                if (backpressure_f && !client.throttled &&
+                    client.request_count() >= backpressure_high) {
+                    client.throttled = true;
+                    backpressure_f(client.client, true);
+                }
+                if (other_max_wait > 0.0 && ClientType::O == client.info->client_type) {
+                    client.requests.back().age_limit = time + other_max_wait;
+                }
+                if (TimeZero != expiry) {
+                    expiry_marks.emplace(expiry, client.client, client.counted_type);
+                    ++class_expiry_marks[client.counted_type];
+                }
                 if (1 == client.requests.size()) {
                     // NB: can the following 4 calls to adjust be changed
                     // promote? Can adding a request ever demote a client in the
@@ -1428,143 +2598,1145 @@ namespace crimson {
                     best_limit_heap.adjust(client);
                 }
 
-//                prop_heap.adjust(client);
-            } // add_request
+//                prop_heap.adjust(client);
+                return AdmissionResult::accept();
+            } // add_request
+
+
+            // data_mtx must be held by caller; bookkeeping for requests
+            // that left the client's queue by any path
+            void note_requests_removed(ClientRec &client, size_t count) {
+                assert(queued_total >= count);
+                queued_total -= count;
+                class_queued_count[client.counted_type] -= count;
+                if (client.throttled && client.request_count() <= backpressure_low) {
+                    client.throttled = false;
+                    if (backpressure_f) {
+                        backpressure_f(client.client, false);
+                    }
+                }
+            }
+
+
+            // data_mtx should be held when called; top of heap should have
+            // a ready request
+            template<typename C1, IndIntruHeapData ClientRec::*C2, typename C3, uint B4>
+            void pop_process_request(IndIntruHeap<C1, ClientRec, C2, C3, B4> &heap,
+                                     std::function<void(const C &client,
+                                                        RequestRef &request)> process, Time now,
+                                     bool is_delta = false) {
+                // gain access to data
+                ClientRec &top = heap.top();
+                DMC_TRACE6(dispatch, trace::client_id(top.client),
+                           int(top.info->client_type),
+                           trace::ns(top.next_request().tag.reservation),
+                           trace::ns(top.next_request().tag.proportion),
+                           trace::ns(top.next_request().tag.limit),
+                           top.request_count());
+                trace_event(TraceRecorder::Kind::dispatch, top, uint8_t(last_decision),
+                            top.next_request().tag.arrival, now);
+
+                RequestRef request = std::move(top.next_request().request);
+                op_class_used[size_t(top.next_request().op_class)] +=
+                        op_class_cost[size_t(top.next_request().op_class)];
+                ++top.win_dispatched;
+                ++class_dispatched[top.info->client_type];
+                const Time delay = now - top.next_request().enqueued;
+                if (window_history) {
+                    if (!top.win_latency) {
+                        top.win_latency.reset(new WindowLatency);
+                        ++latency_buffers;
+                    }
+                    top.win_latency->record(
+                            std::chrono::microseconds::rep(std::max(delay, 0.0) * 1e6));
+                }
+                if (delay_tracking || top.delay_histogram) {
+                    record_delay(top, delay);
+                }
+                if (bg_target_p99 > 0.0 && ClientType::O != top.info->client_type) {
+                    if (!top.outstanding) {
+                        top.outstanding.reset(new std::deque<Time>);
+                        ++class_outstanding_buffers[top.counted_type];
+                    } else if (top.outstanding->size() >= fg_outstanding_max) {
+                        top.outstanding->pop_front();
+                        --class_outstanding_times[top.counted_type];
+                    }
+                    top.outstanding->push_back(now);
+                    ++class_outstanding_times[top.counted_type];
+                }
+#ifndef DO_NOT_DELAY_TAG_CALC
+                RequestTag tag = top.next_request().tag;
+#endif
+
+                // pop request and adjust heaps
+                top.pop_request();
+                note_requests_removed(top, 1);
+
+#ifndef DO_NOT_DELAY_TAG_CALC
+                if (top.has_request()) {
+                    ClientReq &next_first = top.next_request();
+//	  const ClientInfo* client_info = get_cli_info(top);
+                    const ClientInfo *client_info = client_info_wrapper(top);
+                    assert(client_info);
+                    // next_first.tag.arrival就是这个request到达时的now, 这里没问题
+                    next_first.tag = RequestTag(tag, *client_info,
+                                                top.cur_delta, top.cur_rho,
+                                                next_first.tag.arrival,
+                                                0.0, anticipation_timeout);
+
+                    // copy tag to previous tag for client
+                    top.update_req_tag(next_first.tag, tick);
+                }
+#endif
+//    const ClientInfo* client_info = get_cli_info(top);
+                const ClientInfo *client_info = client_info_wrapper(top);
+                if (client_info->client_type == ClientType::R) {
+
+                    if (is_delta /*&& (now - win_start) < win_size*/) {
+                        // top.deltar_counter++;
+                        reduce_reservation_tags(top);
+                    }
+                    // else{
+                    //   top.r0_counter++;
+                    // }
+                    resv_heap.demote(top);
+                    deltar_heap.demote(top);
+                    r_limit_heap.adjust(top);
+                }
+
+                if (client_info->client_type == ClientType::B) {
+                    // if (top.info->client_type == ClientType::B) {
+                    //     top.b_counter++;
+                    // }
+                    burst_heap.demote(top);
+                    limit_heap.adjust(top);
+                }
+                if (client_info->client_type == ClientType::A || client_info->client_type == ClientType::O) {
+                    //   top.be_counter++;
+                    best_heap.demote(top);
+                    best_limit_heap.adjust(top);
+                }
+
+//                prop_heap.demote(top);
+
+
+                // TODO: update counter in do_next_request
+
+
+                // process
+                process(top.client, request);
+            } // pop_process_request
+
+
+            // data_mtx should be held when called
+            void reduce_reservation_tags(ClientRec &client) {
+                const ClientInfo* client_info = client.info;
+                if (ClientType::R == client.info->client_type)
+                {
+                    client_info = compensated_client_map[client.client];
+                }
+                
+                for (auto &r : client.requests) {
+                    // r.tag.reservation -= client.info->reservation_inv;
+                    r.tag.reservation -= client_info->reservation_inv;
+
+#ifndef DO_NOT_DELAY_TAG_CALC
+                    // reduce only for front tag. because next tags' value are invalid
+                    break;
+#endif
+                }
+                // don't forget to update previous tag
+                // client.prev_tag.reservation -= client.info->reservation_inv;
+                client.prev_tag.reservation -= client_info->reservation_inv;
+                resv_heap.promote(client);
+            }
+
+            // 针对有补偿机制的情况, 这里就会有一些误差
+            // data_mtx should be held when called
+            void reduce_reservation_tags(const C &client_id) {
+                auto client_it = client_map.find(client_id);
+
+                // means the client was cleaned from map; should never happen
+                // as long as cleaning times are long enough
+                assert(client_map.end() != client_it);
+                reduce_reservation_tags(*client_it->second);
+            }
+
+            // data_mtx must be held by caller; capacity units the client's
+            // next request will consume
+            inline double next_op_cost(const ClientRec &client) const {
+                return op_class_cost[size_t(client.next_request().op_class)];
+            }
+
+            // data_mtx must be held by caller; whether the op class of the
+            // client's next request still has budget left this window
+            inline bool op_class_has_budget(const ClientRec &client) const {
+                const size_t op_class = size_t(client.next_request().op_class);
+                return 0.0 == op_class_capacity[op_class] ||
+                       op_class_used[op_class] < op_class_capacity[op_class] * win_size;
+            }
+
+            // data_mtx must be held by caller; re-sorts the client in every
+            // heap its type belongs to
+            void adjust_heaps(ClientRec &client) {
+                if (client.info->client_type == ClientType::R) {
+                    resv_heap.adjust(client);
+                    deltar_heap.adjust(client);
+                    r_limit_heap.adjust(client);
+                }
+                if (client.info->client_type == ClientType::B) {
+                    burst_heap.adjust(client);
+                    limit_heap.adjust(client);
+                }
+                if (client.info->client_type == ClientType::A ||
+                    client.info->client_type == ClientType::O) {
+                    best_heap.adjust(client);
+                    best_limit_heap.adjust(client);
+                }
+            }
+
+            // data_mtx must be held by caller; hands expired requests of
+            // the client to expired_request_f, either just those at the
+            // front of its queue or all of them
+            size_t drop_expired_requests(ClientRec &client, Time now, bool front_only) {
+                if (!client.has_request()) {
+                    return 0;
+                }
+                const bool front_expired = client.next_request().is_expired(now);
+                if (front_only && !front_expired) {
+                    return 0;
+                }
+#ifndef DO_NOT_DELAY_TAG_CALC
+                const RequestTag front_tag = client.next_request().tag;
+#endif
+                size_t dropped = 0;
+                for (auto i = client.requests.begin(); i != client.requests.end(); /* no inc */) {
+                    if (i->is_expired(now)) {
+                        expired_request_f(client.client, std::move(i->request));
+                        i = client.requests.erase(i);
+                        ++dropped;
+                    } else if (front_only) {
+                        break;
+                    } else {
+                        ++i;
+                    }
+                }
+                if (0 == dropped) {
+                    return 0;
+                }
+                expired_count[client.info->client_type] += dropped;
+                note_requests_removed(client, dropped);
+#ifndef DO_NOT_DELAY_TAG_CALC
+                // the dropped front request was never served, so its
+                // successor takes over its tag instead of being charged a
+                // new one
+                if (front_expired && client.has_request()) {
+                    ClientReq &next_first = client.next_request();
+                    const Time arrival = next_first.tag.arrival;
+                    next_first.tag = front_tag;
+                    next_first.tag.arrival = arrival;
+                }
+#endif
+                adjust_heaps(client);
+                return dropped;
+            }
+
+            // data_mtx must be held by caller; lazily drops expired
+            // requests that have reached the top of the heap
+            template<typename C1, IndIntruHeapData ClientRec::*C2, typename C3, uint B4>
+            void drop_expired_tops(IndIntruHeap<C1, ClientRec, C2, C3, B4> &heap, Time now) {
+                while (!heap.empty() &&
+                       drop_expired_requests(heap.top(), now, true) > 0) {
+                    // top changed; check the new one
+                }
+            }
+
+            // data_mtx must be held by caller; a foreground completion feeds
+            // the background controller the latency since the client's
+            // oldest outstanding dispatch
+            void do_request_completed(const C &client_id, Time now) {
+                if (0.0 == bg_target_p99) {
+                    return;
+                }
+                auto client_it = client_map.find(client_id);
+                if (client_map.end() != client_it &&
+                    ClientType::O != client_it->second->info->client_type &&
+                    client_it->second->outstanding &&
+                    !client_it->second->outstanding->empty()) {
+                    std::deque<Time> &outstanding = *client_it->second->outstanding;
+                    const Time latency = now - outstanding.front();
+                    outstanding.pop_front();
+                    --class_outstanding_times[client_it->second->counted_type];
+                    if (fg_latencies.size() < fg_latency_window) {
+                        fg_latencies.push_back(latency);
+                    } else {
+                        fg_latencies[fg_latency_next] = latency;
+                        fg_latency_next = (fg_latency_next + 1) % fg_latency_window;
+                    }
+                }
+                // the sample window caps how many can be asked for
+                const size_t min_samples = bg_min_samples < fg_latency_window ?
+                                           bg_min_samples : fg_latency_window;
+                if (now - bg_last_adjust >= bg_interval &&
+                    (fg_latencies.empty() || fg_latencies.size() >= min_samples)) {
+                    bg_last_adjust = now;
+                    adjust_background_scale();
+                }
+            }
+
+            // data_mtx must be held by caller; one AIMD step over the
+            // samples collected since the previous step
+            void adjust_background_scale() {
+                Time p99 = 0.0;
+                if (!fg_latencies.empty()) {
+                    size_t rank = size_t(std::ceil(0.99 * fg_latencies.size())) - 1;
+                    std::nth_element(fg_latencies.begin(),
+                                     fg_latencies.begin() + rank,
+                                     fg_latencies.end());
+                    p99 = fg_latencies[rank];
+                    fg_latencies.clear();
+                    fg_latency_next = 0;
+                }
+                double scale = bg_scale;
+                if (p99 > bg_target_p99) {
+                    scale = std::max(bg_scale * 0.5, bg_min_scale);
+                } else if (p99 < bg_target_p99 * 0.8) {
+                    scale = std::min(bg_scale + 0.1, 1.0);
+                }
+                if (scale != bg_scale) {
+                    bg_scale = scale;
+                    apply_background_scale();
+                }
+            }
+
+            // data_mtx must be held by caller; rebuilds the effective
+            // client info of every O client from the current scale
+            void apply_background_scale() {
+                for (auto &c : client_map) {
+                    const ClientInfo *info = c.second->info;
+                    if (ClientType::O != info->client_type) {
+                        continue;
+                    }
+                    double limit = info->limit > 0.0 ? info->limit : system_capacity;
+                    const ClientInfo *old_info = compensated_client_map[c.first];
+                    compensated_client_map[c.first] =
+                            new ClientInfo(info->reservation, info->weight,
+                                           limit * bg_scale, info->client_type);
+                    delete old_info;
+                }
+            }
+
+            // data_mtx must be held by caller; O(log n) for the map lookup
+            Time do_estimate_wait(const C &client_id, double cost, Time now) const {
+                auto client_it = client_map.find(client_id);
+                if (client_map.end() == client_it) {
+                    const ClientInfo *info = client_info_f(client_id);
+                    const ClientType type = info->client_type;
+                    double rate = class_service_rate[type] * info->weight /
+                                  (class_weight[type] + info->weight);
+                    if (rate <= 0.0) {
+                        rate = system_capacity * info->weight / (total_wgt + info->weight);
+                    }
+                    rate = std::max(rate, info->reservation);
+                    return rate > 0.0 ? cost / rate : TimeMax;
+                }
+
+                const ClientRec &client = *client_it->second;
+                const ClientInfo *info = client.info;
+                auto comp_it = compensated_client_map.find(client_id);
+                if (ClientType::R == info->client_type &&
+                    compensated_client_map.end() != comp_it) {
+                    info = comp_it->second;
+                }
+                double rate = client.service_rate;
+                if (rate <= 0.0) {
+                    rate = client.resource / win_size;
+                }
+                rate = std::max(rate, info->reservation);
+                const size_t queued = client.request_count();
+                Time wait = rate > 0.0 ? (queued + cost) / rate : TimeMax;
+
+                // the tag the new request would get bounds it from below;
+                // only the front tag is valid when tag calculation is
+                // delayed, so the rest are extrapolated from it
+                const RequestTag &base = queued ? client.next_request().tag : client.prev_tag;
+                const double ahead = queued ? queued - 1 + cost : cost;
+                if (ClientType::R == info->client_type && info->reservation_inv > 0.0) {
+                    wait = std::max(wait, base.reservation + ahead * info->reservation_inv - now);
+                }
+                if (info->limit_inv > 0.0) {
+                    wait = std::max(wait, base.limit + ahead * info->limit_inv - now);
+                }
+                return std::max(wait, 0.0);
+            }
+
+            // data_mtx must be held by caller; folds the window's dispatch
+            // counts into the per-client and per-type service rates
+            void update_service_rates() {
+                for (int t = 0; t < 4; ++t) {
+                    const double rate = class_dispatched[t] / win_size;
+                    class_service_rate[t] = class_service_rate[t] > 0.0 ?
+                                            0.5 * rate + 0.5 * class_service_rate[t] : rate;
+                    class_dispatched[t] = 0;
+                    class_weight[t] = 0.0;
+                }
+                for (auto &c : client_map) {
+                    ClientRec &client = *c.second;
+                    const double rate = client.win_dispatched / win_size;
+                    client.service_rate = client.service_rate > 0.0 ?
+                                          0.5 * rate + 0.5 * client.service_rate : rate;
+                    client.win_dispatched = 0;
+                    class_weight[client.info->client_type] += client.info->weight;
+                }
+            }
+
+            // data_mtx must be held by caller; when the reservations of the
+            // active R clients add up to more than system_capacity, every
+            // effective reservation is scaled by the same factor so each
+            // client gets its share of what can be delivered rather than
+            // all of them missing
+            void scale_reservations() {
+                double demand = 0.0;
+                for (auto &c : client_map) {
+                    if (ClientType::R == c.second->info->client_type && !c.second->idle) {
+                        demand += c.second->info->reservation + c.second->r_compensation;
+                    }
+                }
+                reservation_demand = demand;
+                const double scale = demand > system_capacity ? system_capacity / demand : 1.0;
+                if (scale == reservation_scale && 1.0 == scale) {
+                    return;
+                }
+                if (scale != reservation_scale) {
+                    ofs_pwd << "overcommit: reservations " << demand << " capacity " <<
+                            system_capacity << " scale " << scale << "\n";
+                }
+                reservation_scale = scale;
+                for (auto &c : client_map) {
+                    if (ClientType::R != c.second->info->client_type) {
+                        continue;
+                    }
+                    const ClientInfo *info = c.second->info;
+                    const ClientInfo *old_info = compensated_client_map[c.first];
+                    compensated_client_map[c.first] =
+                            new ClientInfo((info->reservation + c.second->r_compensation) * scale,
+                                           info->weight, info->limit, ClientType::R);
+                    delete old_info;
+                }
+            }
+
+            // data_mtx must be held by caller
+            void note_arrival(ClientRec &client, Time time) {
+                const unsigned slots = ClientRec::arrival_slots;
+                double pos = (time - win_start) / win_size * slots;
+                unsigned slot = pos <= 0.0 ? 0 : std::min(unsigned(pos), slots - 1);
+                ++client.slot_arrivals[slot];
+                const uint32_t depth = uint32_t(client.requests.size());
+                client.depth_sum += depth;
+                client.depth_max = std::max(client.depth_max, depth);
+            }
+
+            // data_mtx must be held by caller; folds the window's arrivals
+            // into the client's statistics and, once a different type has
+            // been proposed for long enough, proposes or applies it
+            void classify_client(ClientRecRef client) {
+                const unsigned slots = ClientRec::arrival_slots;
+                uint32_t total = 0;
+                for (unsigned i = 0; i < slots; ++i) {
+                    total += client->slot_arrivals[i];
+                }
+                const double mean = double(total) / slots;
+                double variance = 0.0;
+                for (unsigned i = 0; i < slots; ++i) {
+                    variance += (client->slot_arrivals[i] - mean) * (client->slot_arrivals[i] - mean);
+                    client->slot_arrivals[i] = 0;
+                }
+                variance /= slots;
+
+                const double a = classifier.smoothing;
+                ArrivalStats &stats = client->arrival_stats;
+                stats.rate = a * (total / win_size) + (1 - a) * stats.rate;
+                stats.burstiness = a * (total ? variance / mean : 0.0) + (1 - a) * stats.burstiness;
+                stats.depth = a * (total ? client->depth_sum / total : 0.0) + (1 - a) * stats.depth;
+                stats.depth_max = client->depth_max;
+                client->depth_sum = 0.0;
+                client->depth_max = 0;
+
+                const ClientInfo *info = client->info;
+                if (ClientType::O == info->client_type || 0 == total) {
+                    // background clients are not reclassified; an idle
+                    // window says nothing about the pattern
+                    client->proposed_windows = 0;
+                    return;
+                }
+                ClientType target = info->client_type;
+                if (stats.rate < classifier.min_rate) {
+                    target = ClientType::A;
+                } else if (stats.burstiness >= classifier.bursty_index) {
+                    target = ClientType::B;
+                } else if (stats.burstiness <= classifier.steady_index) {
+                    target = ClientType::R;
+                }
+                if (target == info->client_type) {
+                    client->proposed_windows = 0;
+                    return;
+                }
+                if (target != client->proposed_type) {
+                    client->proposed_type = target;
+                    client->proposed_windows = 0;
+                }
+                if (++client->proposed_windows < classifier.hysteresis_windows) {
+                    return;
+                }
+                client->proposed_windows = 0;
+
+                const bool apply = ClassifierMode::apply == classifier.mode;
+                const ClientType from = info->client_type;
+                ofs_pwd << "classify: " << get_client_type(from) << " -> " <<
+                        get_client_type(target) << " rate:" << stats.rate <<
+                        " burstiness:" << stats.burstiness << " depth:" << stats.depth <<
+                        (apply ? " applied\n" : " proposed\n");
+                if (apply) {
+                    // a client turned R without a configured reservation
+                    // is reserved the rate it has been sustaining
+                    double reservation = info->reservation;
+                    if (ClientType::R == target && 0.0 == reservation) {
+                        reservation = stats.rate;
+                    }
+                    const ClientInfo *new_info =
+                            new ClientInfo(reservation, info->weight, info->limit, target);
+                    move_to_another_heap(client, new_info);
+                    if (nullptr == client->supplied_info) {
+                        client->supplied_info = info;
+                    } else {
+                        delete info;
+                    }
+                    client->info = new_info;
+                    const ClientInfo *old_compensated = compensated_client_map[client->client];
+                    compensated_client_map[client->client] =
+                            new ClientInfo(reservation, new_info->weight, new_info->limit, target);
+                    delete old_compensated;
+                }
+                if (classifier_f) {
+                    classifier_f(client->client, from, target, apply);
+                }
+            }
+
+            // data_mtx must be held by caller; sinks ready tops whose op
+            // class is out of budget so the next client can be considered
+            template<typename C1, IndIntruHeapData ClientRec::*C2, typename C3, uint B4>
+            void block_op_class_tops(IndIntruHeap<C1, ClientRec, C2, C3, B4> &heap) {
+                while (!heap.empty()) {
+                    auto &top = heap.top();
+                    if (top.op_blocked || !top.has_request() ||
+                        !top.next_request().tag.ready || op_class_has_budget(top)) {
+                        break;
+                    }
+                    top.op_blocked = true;
+                    heap.demote(top);
+                }
+            }
+
+            // data_mtx must be held by caller; limit breaking serves tops
+            // that are not ready, which block_op_class_tops leaves alone,
+            // so their op class is checked here and a top over budget is
+            // blocked until the window rolls over
+            bool op_class_admits(ClientRec &client) {
+                if (!client.op_blocked && !op_class_has_budget(client)) {
+                    client.op_blocked = true;
+                    adjust_heaps(client);
+                }
+                return !client.op_blocked;
+            }
+
+            // data_mtx must be held by caller
+            size_t do_expire_requests(Time now) {
+                std::set<C> due;
+                while (!expiry_marks.empty() && std::get<0>(expiry_marks.top()) <= now) {
+                    due.insert(std::get<1>(expiry_marks.top()));
+                    --class_expiry_marks[std::get<2>(expiry_marks.top())];
+                    expiry_marks.pop();
+                }
+                size_t dropped = 0;
+                for (const auto &client_id : due) {
+                    auto client_it = client_map.find(client_id);
+                    if (client_map.end() != client_it) {
+                        dropped += drop_expired_requests(*client_it->second, now, false);
+                    }
+                }
+                return dropped;
+            }
+
+            std::string get_client_type(const ClientInfo* info){
+                return get_client_type(info->client_type);
+            }
+
+            std::string get_client_type(ClientType client_type){
+                if (ClientType::R == client_type) {
+                    return "R";
+                } else if (ClientType::B == client_type) {
+                    return "B";
+                } else if (ClientType::A == client_type) {
+                    return "A";
+                } else {
+                    return "O";
+                }
+            }
+            bool serve_metrics(std::function<bool(MetricsExporter &)> listen) {
+                std::unique_ptr<MetricsExporter> exporter(new MetricsExporter([this]() {
+                    return get_metrics_snapshot();
+                }));
+                if (!listen(*exporter)) {
+                    return false;
+                }
+                std::unique_ptr<MetricsExporter> replaced;
+                {
+                    DataGuard g(data_mtx);
+                    replaced = std::move(metrics_exporter);
+                    metrics_exporter = std::move(exporter);
+                    publish_metrics();
+                }
+                return true;
+            }
+
+            // data_mtx must be held by caller; copies the per-client and
+            // per-class counters into a MetricsCounters and makes it the
+            // one served. Window counts are those of the window just ended
+            // when called at rollover. Labels and text are left to
+            // format_metrics, on the exporter's thread.
+            void publish_metrics() {
+                const Time now = get_time();
+                std::shared_ptr<MetricsCounters> snapshot =
+                        std::make_shared<MetricsCounters>();
+                MetricsCounters &m = *snapshot;
+
+                m.queued_total = queued_total;
+                m.win_start = win_start;
+                std::copy(std::begin(decision_stats.outcomes),
+                          std::end(decision_stats.outcomes),
+                          std::begin(m.outcomes));
+                m.promotions = decision_stats.total_promotions();
+                m.qos = qos_stats.last;
+                m.memory = compute_memory_usage();
+                for (int t = 0; t < 4; ++t) {
+                    m.class_dispatched[t] = class_dispatched[t];
+                    m.class_service_rate[t] = class_service_rate[t];
+                }
+
+                m.clients.reserve(client_map.size());
+                for (const auto &c : client_map) {
+                    const ClientRec &client = *c.second;
+                    const int type = client.info->client_type;
+                    ++m.class_clients[type];
+                    m.class_queued[type] += client.request_count();
+
+                    m.clients.emplace_back();
+                    typename MetricsCounters::Client &out = m.clients.back();
+                    out.type = type;
+                    out.no = client_number(client.client);
+                    out.phases[0] = client.r0_counter;
+                    out.phases[1] = client.r0_break_limit_counter;
+                    out.phases[2] = client.deltar_counter;
+                    out.phases[3] = client.deltar_break_limit_counter;
+                    out.phases[4] = client.b_counter;
+                    out.phases[5] = client.b_break_limit_counter;
+                    out.phases[6] = client.be_counter;
+                    out.phases[7] = client.be_break_limit_counter;
+                    out.queued = client.request_count();
+                    out.resource = client.resource;
+                    out.compensation = client.r_compensation;
+                    if (client.has_request()) {
+                        const RequestTag &tag = client.requests.front().tag;
+                        const double head = ClientType::R == type ?
+                                            tag.reservation : tag.proportion;
+                        if (head < max_tag) {
+                            out.lag = now - head;
+                        }
+                    }
+                }
+
+                std::atomic_store(&metrics_counters,
+                                  std::shared_ptr<const MetricsCounters>(snapshot));
+            }
+
+            // Turns published counters into metric families. Runs without
+            // data_mtx, on whichever thread asks for the metrics.
+            static std::shared_ptr<const MetricsSnapshot>
+            format_metrics(const MetricsCounters &c) {
+                static const char *class_names[] = {"R", "B", "A", "O"};
+                static const char *phase_names[] = {
+                        "reservation", "reservation_break", "deltar", "deltar_break",
+                        "burst", "burst_break", "best_effort", "best_effort_break"
+                };
+                std::shared_ptr<MetricsSnapshot> snapshot =
+                        std::make_shared<MetricsSnapshot>();
+                MetricsSnapshot &m = *snapshot;
+
+                m.emplace_back("dmclock_queued_requests",
+                               "requests queued in the dmclock queue", "gauge");
+                m.back().add("", c.queued_total);
+                m.emplace_back("dmclock_window_start_seconds",
+                               "start of the current window", "gauge");
+                m.back().add("", c.win_start);
+
+                m.emplace_back("dmclock_decisions_total",
+                               "scheduling decisions by outcome", "counter");
+                for (size_t o = 0; o < DecisionStats::outcome_count; ++o) {
+                    std::ostringstream labels;
+                    labels << "outcome=\"" << DecisionOutcome(o) << "\"";
+                    m.back().add(labels.str(), c.outcomes[o]);
+                }
+                m.emplace_back("dmclock_limit_promotions_total",
+                               "requests promoted once within their limit", "counter");
+                m.back().add("", c.promotions);
+
+                m.emplace_back("dmclock_qos_reservation_attainment",
+                               "mean share of their reservation R clients got "
+                               "in the last window", "gauge");
+                m.back().add("", c.qos.reservation_attainment);
+                m.emplace_back("dmclock_qos_limit_overshoot",
+                               "share of the last window's dispatches that broke "
+                               "a limit", "gauge");
+                m.back().add("", c.qos.limit_overshoot);
+                m.emplace_back("dmclock_qos_burst_utilisation",
+                               "mean share of their burst budget B clients used "
+                               "in the last window", "gauge");
+                m.back().add("", c.qos.burst_utilisation);
+                m.emplace_back("dmclock_qos_fairness",
+                               "Jain's index over A clients' weighted shares in "
+                               "the last window", "gauge");
+                m.back().add("", c.qos.fairness);
+
+                m.emplace_back("dmclock_memory_bytes",
+                               "estimated bytes of scheduler state by part", "gauge");
+                m.back().add("part=\"client_records\"", c.memory.client_records);
+                m.back().add("part=\"request_storage\"", c.memory.request_storage);
+                m.back().add("part=\"heap_arrays\"", c.memory.heap_arrays);
+                m.back().add("part=\"client_infos\"", c.memory.client_infos);
+                m.back().add("part=\"side_maps\"", c.memory.side_maps);
+                m.emplace_back("dmclock_class_memory_bytes",
+                               "estimated bytes of scheduler state by class", "gauge");
+                for (int t = 0; t < 4; ++t) {
+                    m.back().add(std::string("class=\"") + class_names[t] + "\"",
+                                 c.memory.by_class[t]);
+                }
 
+                m.emplace_back("dmclock_class_clients", "clients by class", "gauge");
+                m.emplace_back("dmclock_class_queued_requests",
+                               "requests queued by class", "gauge");
+                m.emplace_back("dmclock_class_window_dispatched",
+                               "requests dispatched by class in the window", "gauge");
+                m.emplace_back("dmclock_class_service_rate",
+                               "smoothed dispatch rate by class, per second", "gauge");
+                for (int t = 0; t < 4; ++t) {
+                    const std::string labels =
+                            std::string("class=\"") + class_names[t] + "\"";
+                    m[m.size() - 4].add(labels, c.class_clients[t]);
+                    m[m.size() - 3].add(labels, c.class_queued[t]);
+                    m[m.size() - 2].add(labels, c.class_dispatched[t]);
+                    m[m.size() - 1].add(labels, c.class_service_rate[t]);
+                }
 
-            // data_mtx should be held when called; top of heap should have
-            // a ready request
-            template<typename C1, IndIntruHeapData ClientRec::*C2, typename C3>
-            void pop_process_request(IndIntruHeap<C1, ClientRec, C2, C3, B> &heap,
-                                     std::function<void(const C &client,
-                                                        RequestRef &request)> process, Time now,
-                                     bool is_delta = false) {
-                // gain access to data
-                ClientRec &top = heap.top();
+                m.emplace_back("dmclock_client_window_dispatched",
+                               "requests dispatched by client and phase in the window",
+                               "gauge");
+                m.emplace_back("dmclock_client_queued_requests",
+                               "requests queued by client", "gauge");
+                m.emplace_back("dmclock_client_resource",
+                               "requests the client is budgeted per window", "gauge");
+                m.emplace_back("dmclock_client_compensation",
+                               "reservation compensation of an R client", "gauge");
+                m.emplace_back("dmclock_client_tag_lag_seconds",
+                               "how far the head request's tag (reservation for R, "
+                               "proportion otherwise) is behind now", "gauge");
+                MetricFamily &dispatched = m[m.size() - 5];
+                for (const auto &client : c.clients) {
+                    std::ostringstream name;
+                    name << "client=\"" << class_names[client.type] << "_" <<
+                         client.no << "\",class=\"" <<
+                         class_names[client.type] << "\"";
+                    const std::string labels = name.str();
+                    for (int p = 0; p < 8; ++p) {
+                        dispatched.add(labels + ",phase=\"" + phase_names[p] + "\"",
+                                       client.phases[p]);
+                    }
+                    m[m.size() - 4].add(labels, client.queued);
+                    m[m.size() - 3].add(labels, client.resource);
+                    m[m.size() - 2].add(labels, client.compensation);
+                    m[m.size() - 1].add(labels, client.lag);
+                }
 
-                RequestRef request = std::move(top.next_request().request);
-#ifndef DO_NOT_DELAY_TAG_CALC
-                RequestTag tag = top.next_request().tag;
-#endif
+                return snapshot;
+            }
 
-                // pop request and adjust heaps
-                top.pop_request();
+            // data_mtx must be held by caller; clients beyond the
+            // segment's room are left out
+            void write_shm_stats() {
+                uint64_t class_clients[4] = {0, 0, 0, 0};
+                uint64_t class_queued[4] = {0, 0, 0, 0};
+                shm_writer->begin_window(win_start, win_size, queued_total);
+                uint32_t index = 0;
+                for (const auto &c : client_map) {
+                    const ClientRec &client = *c.second;
+                    const int type = client.info->client_type;
+                    ++class_clients[type];
+                    class_queued[type] += client.request_count();
+                    if (index < shm_writer->max_clients()) {
+                        const uint64_t dispatched[shm_phase_count] = {
+                                client.r0_counter, client.r0_break_limit_counter,
+                                client.deltar_counter, client.deltar_break_limit_counter,
+                                client.b_counter, client.b_break_limit_counter,
+                                client.be_counter, client.be_break_limit_counter
+                        };
+                        shm_writer->set_client(index++, uint64_t(client_number(client.client)),
+                                               type, client.request_count(), client.resource,
+                                               client.r_compensation, dispatched);
+                    }
+                }
+                for (int t = 0; t < 4; ++t) {
+                    shm_writer->set_class(t, class_clients[t], class_queued[t],
+                                          class_dispatched[t], class_service_rate[t]);
+                }
+                shm_writer->end_window(index);
+            }
 
-#ifndef DO_NOT_DELAY_TAG_CALC
-                if (top.has_request()) {
-                    ClientReq &next_first = top.next_request();
-//	  const ClientInfo* client_info = get_cli_info(top);
-                    const ClientInfo *client_info = client_info_wrapper(top);
-                    assert(client_info);
-                    // next_first.tag.arrival就是这个request到达时的now, 这里没问题
-                    next_first.tag = RequestTag(tag, *client_info,
-                                                top.cur_delta, top.cur_rho,
-                                                next_first.tag.arrival,
-                                                0.0, anticipation_timeout);
+            // data_mtx must be held by caller
+            MemoryUsage compute_memory_usage() const {
+                // std::deque allocates 512-byte chunks, or one element per
+                // chunk when larger, and a map of 8 chunk pointers when
+                // created
+                const size_t chunk_elements = std::max(size_t(1), 512 / sizeof(ClientReq));
+                const size_t chunk_bytes = chunk_elements * sizeof(ClientReq);
+                const size_t deque_bytes = sizeof(ClientReq*) * 8 + chunk_bytes;
+                // std::map nodes hold a colour and three links
+                const size_t node_bytes = 4 * sizeof(void *);
+                // make_shared puts the counts next to the record
+                const size_t record_bytes = sizeof(ClientRec) + 2 * sizeof(long);
+                const size_t heap_entries[4] = {3, 2, 2, 2};
+                // likewise for the std::deque<Time> of outstanding dispatches
+                const size_t time_chunk_elements = 512 / sizeof(Time);
+                const size_t time_deque_bytes = sizeof(Time*) * 8 + 512;
+
+                MemoryUsage result;
+                for (int t = 0; t < 4; ++t) {
+                    const size_t clients = class_client_count[t];
+                    const size_t queued = class_queued_count[t];
+                    const size_t records = clients * record_bytes;
+                    const size_t requests = clients * deque_bytes +
+                                            (queued / chunk_elements) * chunk_bytes +
+                                            queued * sizeof(R);
+                    const size_t heaps = clients * heap_entries[t] * sizeof(ClientRecRef);
+                    const size_t infos = clients * sizeof(ClientInfo);
+                    const size_t side = class_expiry_marks[t] * sizeof(ExpiryMark) +
+                                        class_outstanding_buffers[t] * time_deque_bytes +
+                                        (class_outstanding_times[t] / time_chunk_elements) * 512;
+                    result.client_records += records;
+                    result.request_storage += requests;
+                    result.heap_arrays += heaps;
+                    result.side_maps += side;
+                    result.by_class[t] = records + requests + heaps + infos + side;
+                }
+                result.client_records += latency_buffers * sizeof(WindowLatency) +
+                                         delay_histograms * sizeof(DelayHistogram);
+                result.client_infos = compensated_client_map.size() * sizeof(ClientInfo);
+                result.side_maps +=
+                        client_map.size() * (node_bytes + sizeof(std::pair<const C, ClientRecRef>)) +
+                        client_no.size() * (node_bytes + sizeof(std::pair<const C, int>)) +
+                        compensated_client_map.size() *
+                        (node_bytes + sizeof(std::pair<const C, const ClientInfo *>));
+                return result;
+            }
 
-                    // copy tag to previous tag for client
-                    top.update_req_tag(next_first.tag, tick);
+            // the records of a snapshot in heap, of the clients of type, in
+            // the order heap keeps them, as IndIntruHeap::display_sorted
+            // shows them
+            template<typename C1, IndIntruHeapData ClientRec::*C2, typename C3, uint B4>
+            static void display_sorted(std::ostream &out, const QueueSnapshot &snap,
+                                       ClientType type,
+                                       const IndIntruHeap<C1, ClientRec, C2, C3, B4> &heap) {
+                std::vector<const RecordView *> members;
+                for (const auto &r : snap.records) {
+                    if (type == r.client_type) {
+                        members.push_back(&r);
+                    }
                 }
-#endif
-//    const ClientInfo* client_info = get_cli_info(top);
-                const ClientInfo *client_info = client_info_wrapper(top);
-                if (client_info->client_type == ClientType::R) {
+                C3 compare;
+                std::sort(members.begin(), members.end(),
+                          [&](const RecordView *a, const RecordView *b) {
+                              return compare(*a, *b);
+                          });
+                bool first = true;
+                for (const RecordView *r : members) {
+                    if (!first) {
+                        out << ", ";
+                    }
+                    first = false;
+                    out << *r;
+                }
+            }
 
-                    if (is_delta /*&& (now - win_start) < win_size*/) {
-                        // top.deltar_counter++;
-                        reduce_reservation_tags(top);
+            // data_mtx must be held by caller; before the window's counters
+            // are reset
+            void evaluate_qos() {
+                QosWindow w;
+                qos_stats.last_reservation_attainment.clear();
+                double share_sum = 0.0;
+                double share_sq_sum = 0.0;
+                for (const auto &c : client_map) {
+                    const ClientRec &client = *c.second;
+                    if (0 == client.win_dispatched && !client.has_request()) {
+                        continue;
+                    }
+                    w.dispatched += client.win_dispatched;
+                    w.limit_breaks += client.r0_break_limit_counter +
+                                      client.deltar_break_limit_counter +
+                                      client.b_break_limit_counter +
+                                      client.be_break_limit_counter;
+                    const ClientInfo *info = client.info;
+                    if (ClientType::R == info->client_type && info->reservation > 0.0) {
+                        const double attained = std::min(
+                                client.r0_counter / (info->reservation * win_size), 1.0);
+                        if (0 == w.r_clients || attained < w.min_reservation_attainment) {
+                            w.min_reservation_attainment = attained;
+                        }
+                        ++w.r_clients;
+                        w.reservation_attainment += attained;
+                        qos_stats.last_reservation_attainment.emplace_hint(
+                                qos_stats.last_reservation_attainment.end(),
+                                client.client, attained);
+                        if (attained >= 1.0) {
+                            ++w.r_met;
+                        }
+                    } else if (ClientType::B == info->client_type && client.resource > 0.0) {
+                        ++w.b_clients;
+                        w.burst_utilisation += client.b_units / client.resource;
+                    } else if (ClientType::A == info->client_type && info->weight > 0.0) {
+                        const double share = client.win_dispatched * info->weight_inv;
+                        ++w.a_clients;
+                        share_sum += share;
+                        share_sq_sum += share * share;
                     }
-                    // else{
-                    //   top.r0_counter++;
-                    // }
-                    resv_heap.demote(top);
-                    deltar_heap.demote(top);
-                    r_limit_heap.adjust(top);
                 }
 
-                if (client_info->client_type == ClientType::B) {
-                    // if (top.info->client_type == ClientType::B) {
-                    //     top.b_counter++;
-                    // }
-                    burst_heap.demote(top);
-                    limit_heap.adjust(top);
+                ++qos_stats.windows;
+                if (w.r_clients) {
+                    w.reservation_attainment /= w.r_clients;
+                    qos_stats.reservation_sum += w.reservation_attainment;
+                    ++qos_stats.reservation_windows;
                 }
-                if (client_info->client_type == ClientType::A || client_info->client_type == ClientType::O) {
-                    //   top.be_counter++;
-                    best_heap.demote(top);
-                    best_limit_heap.adjust(top);
+                if (w.dispatched) {
+                    w.limit_overshoot = double(w.limit_breaks) / w.dispatched;
+                    qos_stats.overshoot_sum += w.limit_overshoot;
+                    ++qos_stats.overshoot_windows;
                 }
+                if (w.b_clients) {
+                    w.burst_utilisation /= w.b_clients;
+                    qos_stats.burst_sum += w.burst_utilisation;
+                    ++qos_stats.burst_windows;
+                }
+                if (w.a_clients && share_sq_sum > 0.0) {
+                    w.fairness = share_sum * share_sum / (w.a_clients * share_sq_sum);
+                    qos_stats.fairness_sum += w.fairness;
+                    ++qos_stats.fairness_windows;
+                }
+                qos_stats.last = w;
+            }
 
-//                prop_heap.demote(top);
-
+            // data_mtx must be held by caller; records the window that
+            // started at start and clears the latencies
+            void write_window_history(Time start) {
+                std::shared_ptr<HistoryWindow<C>> window = std::make_shared<HistoryWindow<C>>();
+                window->index = window_history->next_index();
+                window->start = start;
+                window->size = win_size;
+                window->clients.reserve(client_map.size());
+                for (const auto &c : client_map) {
+                    ClientRec &client = *c.second;
+                    ClientWindow<C> record;
+                    record.client = client.client;
+                    record.client_no = client_number(client.client);
+                    record.client_type = client.info->client_type;
+                    record.resource = client.resource;
+                    record.reservation = client.info->reservation;
+                    record.compensation = client.r_compensation;
+                    record.weight = client.info->weight;
+                    record.limit = client.info->limit;
+                    record.reservation_count = client.r0_counter;
+                    record.reservation_break_count = client.r0_break_limit_counter;
+                    record.deltar_count = client.deltar_counter;
+                    record.deltar_break_count = client.deltar_break_limit_counter;
+                    record.burst_count = client.b_counter;
+                    record.burst_break_count = client.b_break_limit_counter;
+                    record.best_effort_count = client.be_counter;
+                    record.best_effort_break_count = client.be_break_limit_counter;
+                    if (client.win_latency && client.win_latency->get_count() > 0) {
+                        const WindowLatency &latency = *client.win_latency;
+                        record.dispatched = latency.get_count();
+                        record.latency_p50 = latency.get_p50() / 1e6;
+                        record.latency_p99 = latency.get_p99() / 1e6;
+                        record.latency_max = latency.get_high() / 1e6;
+                        *client.win_latency = WindowLatency();
+                    } else {
+                        record.dispatched = 0;
+                        record.latency_p50 = record.latency_p99 = record.latency_max = 0.0;
+                    }
+                    window->clients.push_back(record);
+                }
+                window_history->push(window);
+            }
 
-                // TODO: update counter in do_next_request
+            // data_mtx must be held by caller; the phase is that of the
+            // decision being carried out
+            void record_delay(const ClientRec &client, Time delay) {
+                const auto us = std::chrono::microseconds::rep(std::max(delay, 0.0) * 1e6);
+                if (client.delay_histogram) {
+                    client.delay_histogram->record(us);
+                }
+                if (!delay_tracking) {
+                    return;
+                }
+                DelayPhase phase;
+                switch (last_decision) {
+                case DecisionOutcome::reservation:
+                    phase = DelayPhase::reservation;
+                    break;
+                case DecisionOutcome::deltar:
+                    phase = DelayPhase::deltar;
+                    break;
+                case DecisionOutcome::burst:
+                    phase = DelayPhase::burst;
+                    break;
+                case DecisionOutcome::aged:
+                    phase = DelayPhase::aged;
+                    break;
+                case DecisionOutcome::break_burst:
+                case DecisionOutcome::break_best_effort:
+                case DecisionOutcome::break_deltar:
+                case DecisionOutcome::break_reservation:
+                    phase = DelayPhase::limit_break;
+                    break;
+                default:
+                    phase = DelayPhase::best_effort;
+                    break;
+                }
+                delay_tracking->by_class[client.info->client_type].record(us);
+                delay_tracking->by_phase[size_t(phase)].record(us);
+            }
 
+            // data_mtx must be held by caller
+            void trace_event(TraceRecorder::Kind kind, const ClientRec &client,
+                             uint8_t detail, Time start, Time end) {
+                if (trace_recorder) {
+                    trace_recorder->record(TraceRecorder::Event{
+                            kind, uint8_t(client.info->client_type), detail,
+                            uint32_t(client.request_count()),
+                            trace::client_id(client.client),
+                            trace::ns(start), trace::ns(end)});
+                }
+            }
 
-                // process
-                process(top.client, request);
-            } // pop_process_request
+            // Accounts one call of do_next_request in decision_stats. When
+            // the call is sampled for timing, enter() charges the time since
+            // the previous stage began to that stage, and the destructor
+            // charges the last stage, so early returns are covered.
+            class DecisionScope {
+                PriorityQueueBase &q;
+                bool timed;
+                DecisionStage stage;
+                uint64_t start;
+                uint64_t promoted = 0;
+
+                void charge(uint64_t now) {
+                    q.decision_stage_ticks[size_t(stage)] += now - start;
+                }
 
+            public:
 
-            // data_mtx should be held when called
-            void reduce_reservation_tags(ClientRec &client) {
-                const ClientInfo* client_info = client.info;
-                if (ClientType::R == client.info->client_type)
-                {
-                    client_info = compensated_client_map[client.client];
+                DecisionScope(PriorityQueueBase &_q) :
+                        q(_q),
+                        timed(false),
+                        stage(DecisionStage::rollover),
+                        start(0) {
+                    const uint64_t call = ++q.decision_stats.calls;
+                    timed = q.decision_timing && 0 == (call & q.decision_sample_mask);
+                    if (timed) {
+                        ++q.decision_stats.timed_calls;
+                        ++q.decision_stats.stage_entered[size_t(stage)];
+                        start = ProfileClock::ticks();
+                    }
                 }
-                
-                for (auto &r : client.requests) {
-                    // r.tag.reservation -= client.info->reservation_inv;
-                    r.tag.reservation -= client_info->reservation_inv;
 
-#ifndef DO_NOT_DELAY_TAG_CALC
-                    // reduce only for front tag. because next tags' value are invalid
-                    break;
-#endif
+                ~DecisionScope() {
+                    if (promoted > q.decision_stats.max_promotions) {
+                        q.decision_stats.max_promotions = promoted;
+                    }
+                    if (timed) {
+                        charge(ProfileClock::ticks());
+                    }
                 }
-                // don't forget to update previous tag
-                // client.prev_tag.reservation -= client.info->reservation_inv;
-                client.prev_tag.reservation -= client_info->reservation_inv;
-                resv_heap.promote(client);
-            }
 
-            // 针对有补偿机制的情况, 这里就会有一些误差
-            // data_mtx should be held when called
-            void reduce_reservation_tags(const C &client_id) {
-                auto client_it = client_map.find(client_id);
+                void enter(DecisionStage next) {
+                    if (timed) {
+                        const uint64_t now = ProfileClock::ticks();
+                        charge(now);
+                        stage = next;
+                        ++q.decision_stats.stage_entered[size_t(stage)];
+                        start = now;
+                    }
+                }
 
-                // means the client was cleaned from map; should never happen
-                // as long as cleaning times are long enough
-                assert(client_map.end() != client_it);
-                reduce_reservation_tags(*client_it->second);
-            }
+                // heap is 0 for limit, 1 for r_limit, 2 for best_limit
+                void promote(size_t heap) {
+                    ++q.decision_stats.promotions[heap];
+                    ++promoted;
+                }
 
-            std::string get_client_type(const ClientInfo* info){
-                if (ClientType::R == info->client_type) {
-                    return "R";
-                } else if (ClientType::B == info->client_type) {
-                    return "B";
-                } else if (ClientType::A == info->client_type) {
-                    return "A";
-                } else {
-                    return "O";
+                NextReq decide(NextReq next, DecisionOutcome outcome) {
+                    ++q.decision_stats.outcomes[size_t(outcome)];
+                    q.last_decision = outcome;
+                    DMC_TRACE2(decision, int(outcome),
+                               trace::ns(NextReqType::future == next.type ?
+                                         next.when_ready : 0.0));
+                    return next;
                 }
-            }
+            }; // class DecisionScope
+
             // data_mtx should be held when called
             NextReq do_next_request(Time now) {
+                DecisionScope decision(*this);
+
                 // if proportional queue is empty, all are empty (i.e., no
                 // active clients)
                 if (resv_heap.empty() && burst_heap.empty() && best_heap.empty()) {
-                    return NextReq::none();
+                    return decision.decide(NextReq::none(), DecisionOutcome::none);
                 }
 
                 if (now - win_start >= win_size) {
                     // 避免多线程并发执行这块代码
                     std::unique_lock<std::mutex> lock(m_win, std::try_to_lock);
                     if (lock.owns_lock()) {
+                        const Time ended_start = win_start;
                         // 先执行这个, 减少并发进入这个区域的概率
                         win_start = std::max(win_start + win_size, now);
+                        ++decision_stats.rollovers;
+                        auto rollover_timing =
+                                lock_profile(LockSite::rollover).hold.measure();
+                        DMC_TRACE2(rollover_start, trace::ns(win_start), client_map.size());
+                        evaluate_qos();
+                        if (metrics_exporter) {
+                            publish_metrics();
+                        }
+                        if (shm_writer) {
+                            write_shm_stats();
+                        }
+                        if (window_history) {
+                            write_window_history(ended_start);
+                        }
+                        if (trace_recorder) {
+                            trace_recorder->record(TraceRecorder::Event{
+                                    TraceRecorder::Kind::rollover, 0, 0, uint32_t(queued_total),
+                                    0, trace::ns(now), trace::ns(now)});
+                        }
 
 //                ofs.open("/root/swh/result/scheduling.txt", std::ios_base::app);
 
@@ -1575,8 +3747,19 @@ namespace crimson {
                             // 为了延迟clientinfo更新, 由于clientRec本来就存的指针, 直接访问还是能访问到新的
                             // 所以必须每次更新后在外部都产生一个新的指针, 用来判断不同 
                             const ClientInfo* temp_client_info = client_info_f(c.second->client);
-                            if (temp_client_info != c.second->info)
+                            const ClientInfo* supplied_info =
+                                    c.second->supplied_info ? c.second->supplied_info : c.second->info;
+                            if (temp_client_info != supplied_info)
                             {
+                                // the operator's new info overrides any classification
+                                if (c.second->supplied_info)
+                                {
+                                    if (supplied_info->weight != 0 || supplied_info->reservation != 0 || supplied_info->limit != 0)
+                                    {
+                                        delete supplied_info;
+                                    }
+                                    c.second->supplied_info = nullptr;
+                                }
                                 std::string new_client_type = get_client_type(temp_client_info);
                                 std::string old_client_type = get_client_type(c.second->info);
 
@@ -1602,6 +3785,10 @@ namespace crimson {
                                 }
                             }
 
+                            if (ClassifierMode::off != classifier.mode) {
+                                classify_client(c.second);
+                            }
+
                             if (ClientType::R == c.second->info->client_type) {
                                 // if (c.second->idle)
                                 // {
@@ -1609,10 +3796,15 @@ namespace crimson {
                                 // }
                                 // 一般来说, 在本实验场景下, 请求足够多时, 由于算法的缺陷导致的reservation的达标率最低也会到80%以上
                                 // 如果达标率不到80%, 说明是client自己请求本来就不多
-                                if (c.second->r0_counter >= c.second->info->reservation * win_size * 0.8)
+                                // measured against the reservation as scaled in the
+                                // window just ended; the compensation itself is
+                                // unscaled, like the reservation it is added to
+                                const double scaled_target =
+                                        c.second->info->reservation * reservation_scale * win_size;
+                                if (c.second->r0_counter >= scaled_target * 0.8)
                                 {
                                     int compensate =
-                                        (c.second->info->reservation * win_size - c.second->r0_counter) / win_size;
+                                        (scaled_target - c.second->r0_counter) / (reservation_scale * win_size);
                                     c.second->r_compensation += compensate;
                                     if (c.second->r_compensation < 0) {
                                         c.second->r_compensation = 0;
@@ -1622,7 +3814,7 @@ namespace crimson {
                                     }
 
                                     const ClientInfo* temp_info = compensated_client_map[c.second->client];
-                                    compensated_client_map[c.second->client] = new ClientInfo(c.second->info->reservation + c.second->r_compensation, c.second->info->weight,
+                                    compensated_client_map[c.second->client] = new ClientInfo((c.second->info->reservation + c.second->r_compensation) * reservation_scale, c.second->info->weight,
                                                c.second->info->limit, ClientType::R);
                                     delete temp_info;
 
@@ -1630,6 +3822,8 @@ namespace crimson {
                             }
 
                             c.second->b_counter = 0;
+                            c.second->b_units = 0.0;
+                            c.second->deltar_units = 0.0;
                             c.second->b_break_limit_counter = 0;
                             c.second->deltar_counter = 0;
                             c.second->deltar_break_limit_counter = 0;
@@ -1641,9 +3835,25 @@ namespace crimson {
                         // for (auto c : client_map) {
                         //   printScheduling(c.second);
                         // }
+                        scale_reservations();
+                        update_service_rates();
+                        if (bg_target_p99 > 0.0) {
+                            // O infos follow the refreshed limits and types
+                            apply_background_scale();
+                        }
 //                ofs.close();
                         ofs_pwd.close();
 
+                        op_class_used[size_t(OpClass::read)] = 0.0;
+                        op_class_used[size_t(OpClass::write)] = 0.0;
+                        for (auto &c : client_map) {
+                            if (c.second->op_blocked) {
+                                c.second->op_blocked = false;
+                                adjust_heaps(*c.second);
+                            }
+                        }
+                        DMC_TRACE2(rollover_end, trace::ns(win_start), queued_total);
+
                         // handle clientinfo update
                         // for (auto c: new_client_map)
                         // {
@@ -1654,14 +3864,49 @@ namespace crimson {
                 }
 
 
+                // expired requests are only looked for when some request
+                // was given an expiry
+                const bool check_expiry = !expiry_marks.empty();
+
                 // try constraint (reservation) based scheduling
+                decision.enter(DecisionStage::reservation);
+                if (check_expiry) {
+                    drop_expired_tops(resv_heap, now);
+                }
                 if (!resv_heap.empty()) {
                     auto &reserv = resv_heap.top();
 //                    reserv.r_counter = 0;
                     if (reserv.has_request() &&
                         reserv.next_request().tag.reservation <= now) {
                         reserv.r0_counter++;
-                        return NextReq(HeapId::reservation);
+                        return decision.decide(NextReq(HeapId::reservation),
+                                               DecisionOutcome::reservation);
+                    }
+                }
+
+                // O requests that have waited their maximum reach the top of
+                // the best-effort heap through its aged ordering, so one
+                // look at the top is enough to honor the bound; one over
+                // its limit waits for its limit tag (see set_other_max_wait)
+                if (other_max_wait > 0.0) {
+                    decision.enter(DecisionStage::aged);
+                    if (check_expiry) {
+                        drop_expired_tops(best_heap, now);
+                    }
+                    if (!best_heap.empty()) {
+                        auto &bests = best_heap.top();
+                        // best_limit_heap promotes later in this call, so
+                        // a request within its limit may not be marked
+                        // ready yet
+                        if (bests.has_request() &&
+                            (bests.next_request().tag.ready ||
+                             bests.next_request().tag.limit <= now) &&
+                            bests.next_request().age_limit <= now) {
+                            bests.be_counter++;
+                            ++aged_sched_count;
+                            return decision.decide(NextReq(HeapId::best_effort),
+                                                   DecisionOutcome::aged);
+                        }
                     }
                 }
 
@@ -1670,6 +3915,7 @@ namespace crimson {
 
                 // all items that are within limit are eligible based on
                 // priority
+                decision.enter(DecisionStage::limit_promote);
                 if (!limit_heap.empty()) {
                     auto limits = &limit_heap.top();
                     while (limits->has_request() &&
@@ -1681,6 +3927,8 @@ namespace crimson {
 //                        }
 //                        if (limits->info->client_type == ClientType::B) {
                         burst_heap.promote(*limits);
+                        decision.promote(0);
+                        trace_event(TraceRecorder::Kind::promote, *limits, 0, now, now);
 //                        }
 //                        prop_heap.promote(*limits);
                         limit_heap.demote(*limits);
@@ -1690,17 +3938,26 @@ namespace crimson {
                 }
 
                 // try burst based scheduling
+                decision.enter(DecisionStage::burst);
+                if (check_expiry) {
+                    drop_expired_tops(burst_heap, now);
+                }
+                block_op_class_tops(burst_heap);
                 if (!burst_heap.empty()) {
                     auto &bursts = burst_heap.top();
-                    if (bursts.b_counter < std::max(bursts.resource, 0.0) &&
+                    if (bursts.b_units < std::max(bursts.resource, 0.0) &&
                         bursts.has_request() &&
                         bursts.next_request().tag.ready &&
-                        bursts.next_request().tag.proportion < max_tag) {
+                        bursts.next_request().tag.proportion < max_tag &&
+                        !bursts.op_blocked) {
                         bursts.b_counter++;
-                        return NextReq(HeapId::burst);
+                        bursts.b_units += next_op_cost(bursts);
+                        return decision.decide(NextReq(HeapId::burst),
+                                               DecisionOutcome::burst);
                     }
                 }
 
+                decision.enter(DecisionStage::r_limit_promote);
                 if (!r_limit_heap.empty()) {
                     auto limits = &r_limit_heap.top();
                     while (limits->has_request() &&
@@ -1712,6 +3969,8 @@ namespace crimson {
 //                        }
 //                        if (limits->info->client_type == ClientType::B) {
                         deltar_heap.promote(*limits);
+                        decision.promote(1);
+                        trace_event(TraceRecorder::Kind::promote, *limits, 1, now, now);
 //                        }
 //                        prop_heap.promote(*limits);
                         r_limit_heap.demote(*limits);
@@ -1721,18 +3980,27 @@ namespace crimson {
                 }
 
 
+                decision.enter(DecisionStage::deltar);
+                if (check_expiry) {
+                    drop_expired_tops(deltar_heap, now);
+                }
+                block_op_class_tops(deltar_heap);
                 if (!deltar_heap.empty()) {
                     auto &deltar = deltar_heap.top();
-                    if (deltar.deltar_counter < std::max(deltar.resource - deltar.info->reservation * win_size, 0.0) &&
+                    if (deltar.deltar_units < std::max(deltar.resource - client_info_wrapper(deltar)->reservation * win_size, 0.0) &&
                         deltar.has_request() &&
                         deltar.next_request().tag.ready &&
-                        deltar.next_request().tag.proportion < max_tag) {
+                        deltar.next_request().tag.proportion < max_tag &&
+                        !deltar.op_blocked) {
                         deltar.deltar_counter++;
-                        return NextReq(HeapId::deltar);
+                        deltar.deltar_units += next_op_cost(deltar);
+                        return decision.decide(NextReq(HeapId::deltar),
+                                               DecisionOutcome::deltar);
                     }
                 }
 
                 // 这里必须有, 否则其他转到be和be转到其他client时, ready tag可能会出问题, 这里能保证ready是根据标签变化的.
+                decision.enter(DecisionStage::best_limit_promote);
              if (!best_limit_heap.empty()) {
                auto limits = &best_limit_heap.top();
                while (limits->has_request() &&
@@ -1741,19 +4009,26 @@ namespace crimson {
                  limits->next_request().tag.ready = true;
 
                  best_heap.promote(*limits);
+                 decision.promote(2);
+                 trace_event(TraceRecorder::Kind::promote, *limits, 2, now, now);
                  best_limit_heap.demote(*limits);
 
                  limits = &best_limit_heap.top();
                }
              }
 
+                decision.enter(DecisionStage::best_effort);
+                if (check_expiry) {
+                    drop_expired_tops(best_heap, now);
+                }
                 if (!best_heap.empty()) {
                     auto &bests = best_heap.top();
                     if (bests.has_request() &&
                         bests.next_request().tag.ready &&
                         bests.next_request().tag.proportion < max_tag) {
                         bests.be_counter++;
-                        return NextReq(HeapId::best_effort);
+                        return decision.decide(NextReq(HeapId::best_effort),
+                                               DecisionOutcome::best_effort);
                     }
                 }
 
@@ -1762,14 +4037,17 @@ namespace crimson {
                 // schedule something with the lowest proportion tag or
                 // alternatively lowest reservation tag.
                 if (allow_limit_break) {
+                    decision.enter(DecisionStage::limit_break);
 
                     // 只有burst的限制是硬性的, 这里应该先处理burst, 从而减小burst的尾延迟
                     if (!burst_heap.empty()) {
                         auto &bursts = burst_heap.top();
                         if (bursts.has_request() &&
-                            bursts.next_request().tag.proportion < max_tag) {
+                            bursts.next_request().tag.proportion < max_tag &&
+                            op_class_admits(bursts)) {
                             bursts.b_break_limit_counter++;
-                            return NextReq(HeapId::burst);
+                            return decision.decide(NextReq(HeapId::burst),
+                                                   DecisionOutcome::break_burst);
                         }
                     }
 
@@ -1778,7 +4056,8 @@ namespace crimson {
                         if (bests.has_request() &&
                             bests.next_request().tag.proportion < max_tag) {
                             bests.be_break_limit_counter++;
-                            return NextReq(HeapId::best_effort);
+                            return decision.decide(NextReq(HeapId::best_effort),
+                                                   DecisionOutcome::break_best_effort);
                         }
                     }
 
@@ -1786,9 +4065,11 @@ namespace crimson {
                     if (!deltar_heap.empty()) {
                         auto &deltar = deltar_heap.top();
                         if (deltar.has_request() &&
-                            deltar.next_request().tag.proportion < max_tag) {
+                            deltar.next_request().tag.proportion < max_tag &&
+                            op_class_admits(deltar)) {
                             deltar.deltar_break_limit_counter++;
-                            return NextReq(HeapId::deltar);
+                            return decision.decide(NextReq(HeapId::deltar),
+                                                   DecisionOutcome::break_deltar);
                         }
 
                     }
@@ -1800,7 +4081,8 @@ namespace crimson {
                         if (reserv.has_request() &&
                             reserv.next_request().tag.reservation < max_tag) {
                             reserv.r0_break_limit_counter++;
-                            return NextReq(HeapId::reservation);
+                            return decision.decide(NextReq(HeapId::reservation),
+                                                   DecisionOutcome::break_reservation);
                         }
                     }
                 }
@@ -1809,6 +4091,7 @@ namespace crimson {
 
                 // nothing scheduled; make sure we re-run when next
                 // reservation item or next limited item comes up
+                decision.enter(DecisionStage::next_call);
                 Time next_call = TimeMax;
                 if (!resv_heap.empty()) {
                     if (resv_heap.top().has_request()) {
@@ -1820,21 +4103,28 @@ namespace crimson {
                 if (!r_limit_heap.empty()) {
                     if (r_limit_heap.top().has_request()) {
                         const auto &next = r_limit_heap.top().next_request();
-                        assert(!next.tag.ready || max_tag == next.tag.proportion);
+                        assert(!next.tag.ready || max_tag == next.tag.proportion ||
+                               r_limit_heap.top().op_blocked);
                         next_call = min_not_0_time(next_call, next.tag.limit);
                     }
                 }
                 if (!limit_heap.empty()) {
                     if (limit_heap.top().has_request()) {
                         const auto &next = limit_heap.top().next_request();
-                        assert(!next.tag.ready || max_tag == next.tag.proportion);
+                        assert(!next.tag.ready || max_tag == next.tag.proportion ||
+                               limit_heap.top().op_blocked);
                         next_call = min_not_0_time(next_call, next.tag.limit);
                     }
                 }
+                // op-blocked clients become eligible when the window rolls over
+                if ((!burst_heap.empty() && burst_heap.top().op_blocked) ||
+                    (!deltar_heap.empty() && deltar_heap.top().op_blocked)) {
+                    next_call = min_not_0_time(next_call, win_start + win_size);
+                }
                 if (next_call < TimeMax) {
-                    return NextReq(next_call);
+                    return decision.decide(NextReq(next_call), DecisionOutcome::future);
                 } else {
-                    return NextReq::none();
+                    return decision.decide(NextReq::none(), DecisionOutcome::none);
                 }
             } // do_next_request
 
@@ -1858,9 +4148,13 @@ namespace crimson {
              */
             void do_clean() {
                 TimePoint now = std::chrono::steady_clock::now();
-                DataGuard g(data_mtx);
+                ProfiledGuard g(data_mtx, lock_profile(LockSite::clean));
+                DMC_TRACE1(clean_start, client_map.size());
                 clean_mark_points.emplace_back(MarkPoint(now, tick));
 
+                // also bounds the expiry marks of callers that never sweep
+                (void) do_expire_requests(get_time());
+
                 // first erase the super-old client records
 
                 Counter erase_point = 0;
@@ -1884,6 +4178,20 @@ namespace crimson {
                     for (auto i = client_map.begin(); i != client_map.end(); /* empty */) {
                         auto i2 = i++;
                         if (erase_point && i2->second->last_tick <= erase_point) {
+                            const int type = i2->second->counted_type;
+                            queued_total -= i2->second->request_count();
+                            class_queued_count[type] -= i2->second->request_count();
+                            --class_client_count[type];
+                            if (i2->second->win_latency) {
+                                --latency_buffers;
+                            }
+                            if (i2->second->delay_histogram) {
+                                --delay_histograms;
+                            }
+                            if (i2->second->outstanding) {
+                                --class_outstanding_buffers[type];
+                                class_outstanding_times[type] -= i2->second->outstanding->size();
+                            }
                             delete_from_heaps(i2->second);
                             client_map.erase(i2);
                             client_no.erase(i2->first);
@@ -1906,13 +4214,14 @@ namespace crimson {
                 } // if
 
                 // 针对pool创建后删除的情况，手动检查
+                DMC_TRACE2(clean_end, client_map.size(), queued_total);
             } // do_clean
 
 
             // data_mtx must be held by caller
-            template<IndIntruHeapData ClientRec::*C1, typename C2>
+            template<IndIntruHeapData ClientRec::*C1, typename C2, uint B4>
             void delete_from_heap(ClientRecRef &client,
-                                  c::IndIntruHeap<ClientRecRef, ClientRec, C1, C2, B> &heap) {
+                                  c::IndIntruHeap<ClientRecRef, ClientRec, C1, C2, B4> &heap) {
                 auto i = heap.rfind(client);
                 heap.remove(i);
             }
@@ -2015,9 +4324,10 @@ namespace crimson {
         }; // class PriorityQueueBase
 
 
-        template<typename C, typename R, bool U1 = false, uint B = 2>
-        class PullPriorityQueue : public PriorityQueueBase<C, R, U1, B> {
-            using super = PriorityQueueBase<C, R, U1, B>;
+        template<typename C, typename R, bool U1 = false, uint B = 2,
+                typename K = HeapBranching<B>>
+        class PullPriorityQueue : public PriorityQueueBase<C, R, U1, B, K> {
+            using super = PriorityQueueBase<C, R, U1, B, K>;
 
         public:
 
@@ -2046,10 +4356,22 @@ namespace crimson {
             };
 
 
-#ifdef PROFILE
-            ProfileTimer<std::chrono::nanoseconds> pull_request_timer;
-            ProfileTimer<std::chrono::nanoseconds> add_request_timer;
-#endif
+            // always compiled in and off until enabled; see
+            // enable_profiling
+            RuntimeProfile pull_request_timer;
+            RuntimeProfile add_request_timer;
+
+
+            // Turns the timers, the stage timing of scheduling decisions,
+            // the data_mtx profiles and delay tracking on or off; while on,
+            // one call in every 2^sample_shift on each thread is timed.
+            void enable_profiling(bool on, unsigned sample_shift = 6) {
+                pull_request_timer.set_enabled(on, sample_shift);
+                add_request_timer.set_enabled(on, sample_shift);
+                this->set_decision_timing(on, sample_shift);
+                this->enable_lock_profiling(on, sample_shift);
+                this->enable_delay_tracking(on);
+            }
 
             template<typename Rep, typename Per>
             PullPriorityQueue(typename super::ClientInfoFunc _client_info_f,
@@ -2109,11 +4431,11 @@ namespace crimson {
                 // empty
             }
 
-            inline void add_request(R &&request,
+            inline AdmissionResult add_request(R &&request,
                                     const C &client_id,
                                     const ReqParams &req_params,
                                     double addl_cost = 0.0) {
-                add_request(typename super::RequestRef(new R(std::move(request))),
+                return guarded_add_request(std::move(request),
                             client_id,
                             req_params,
                             get_time(),
@@ -2121,11 +4443,11 @@ namespace crimson {
             }
 
 
-            inline void add_request(R &&request,
+            inline AdmissionResult add_request(R &&request,
                                     const C &client_id,
                                     double addl_cost = 0.0) {
                 static const ReqParams null_req_params;
-                add_request(typename super::RequestRef(new R(std::move(request))),
+                return guarded_add_request(std::move(request),
                             client_id,
                             null_req_params,
                             get_time(),
@@ -2133,12 +4455,12 @@ namespace crimson {
             }
 
 
-            inline void add_request_time(R &&request,
+            inline AdmissionResult add_request_time(R &&request,
                                          const C &client_id,
                                          const ReqParams &req_params,
                                          const Time time,
                                          double addl_cost = 0.0) {
-                add_request(typename super::RequestRef(new R(std::move(request))),
+                return guarded_add_request(std::move(request),
                             client_id,
                             req_params,
                             time,
@@ -2146,41 +4468,79 @@ namespace crimson {
             }
 
 
-            inline void add_request(typename super::RequestRef &&request,
+            inline AdmissionResult add_request(typename super::RequestRef &&request,
                                     const C &client_id,
                                     const ReqParams &req_params,
                                     double addl_cost = 0.0) {
-                add_request(request, req_params, client_id, get_time(), addl_cost);
+                return add_request(std::move(request), client_id, req_params, get_time(), addl_cost);
             }
 
 
-            inline void add_request(typename super::RequestRef &&request,
+            inline AdmissionResult add_request(typename super::RequestRef &&request,
                                     const C &client_id,
                                     double addl_cost = 0.0) {
                 static const ReqParams null_req_params;
-                add_request(request, null_req_params, client_id, get_time(), addl_cost);
+                return add_request(std::move(request), client_id, null_req_params, get_time(), addl_cost);
+            }
+
+
+            // the request is charged the capacity units of its op class
+            inline AdmissionResult add_request(R &&request,
+                                    const C &client_id,
+                                    const ReqParams &req_params,
+                                    const OpClass op_class,
+                                    double addl_cost = 0.0) {
+                return guarded_add_request(std::move(request),
+                            client_id,
+                            req_params,
+                            get_time(),
+                            addl_cost,
+                            TimeZero,
+                            op_class);
+            }
+
+
+            // the request is dropped instead of pulled once expiry (an
+            // absolute time) has passed
+            inline AdmissionResult add_request_expiry(R &&request,
+                                           const C &client_id,
+                                           const ReqParams &req_params,
+                                           const Time expiry,
+                                           double addl_cost = 0.0) {
+                return guarded_add_request(std::move(request),
+                            client_id,
+                            req_params,
+                            get_time(),
+                            addl_cost,
+                            expiry);
             }
 
 
             // this does the work; the versions above provide alternate interfaces
-            void add_request(typename super::RequestRef &&request,
+            AdmissionResult add_request(typename super::RequestRef &&request,
                              const C &client_id,
                              const ReqParams &req_params,
                              const Time time,
-                             double addl_cost = 0.0) {
-                typename super::DataGuard g(this->data_mtx);
-#ifdef PROFILE
-                add_request_timer.start();
-#endif
-                super::do_add_request(std::move(request),
-                                      client_id,
-                                      req_params,
-                                      time,
-                                      addl_cost);
-                // no call to schedule_request for pull version
-#ifdef PROFILE
-                add_request_timer.stop();
-#endif
+                             double addl_cost = 0.0,
+                             const Time expiry = TimeZero,
+                             const OpClass op_class = OpClass::read) {
+                return guarded_add_request(std::move(request), client_id,
+                                           req_params, time, addl_cost,
+                                           expiry, op_class);
+            }
+
+
+            // reports that the client's oldest outstanding pulled request
+            // finished
+            inline void request_completed(const C &client_id) {
+                request_completed_time(client_id, get_time());
+            }
+
+
+            void request_completed_time(const C &client_id, const Time now) {
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::request_completed));
+                super::do_request_completed(client_id, now);
             }
 
 
@@ -2189,11 +4549,43 @@ namespace crimson {
             }
 
             PullReq pull_request(Time now) {
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::pull));
+                return do_pull_request(now);
+            }
+
+        protected:
+
+            // request is an R or a RequestRef; either way it is moved from
+            // only once admitted
+            template<typename Req>
+            AdmissionResult guarded_add_request(Req &&request,
+                                                const C &client_id,
+                                                const ReqParams &req_params,
+                                                const Time time,
+                                                double addl_cost = 0.0,
+                                                const Time expiry = TimeZero,
+                                                const OpClass op_class = OpClass::read) {
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::add));
+                auto timing = add_request_timer.measure();
+                AdmissionResult result = super::do_add_request(std::forward<Req>(request),
+                                                               client_id,
+                                                               req_params,
+                                                               time,
+                                                               addl_cost,
+                                                               expiry,
+                                                               op_class);
+                // no call to schedule_request for pull version
+                return result;
+            }
+
+
+            // data_mtx must be held by caller; lets a derived queue pull
+            // under a lock it already holds for its own state
+            PullReq do_pull_request(Time now) {
                 PullReq result;
-                typename super::DataGuard g(this->data_mtx);
-#ifdef PROFILE
-                pull_request_timer.start();
-#endif
+                auto timing = pull_request_timer.measure();
 
                 typename super::NextReq next = super::do_next_request(now);
                 result.type = next.type;
@@ -2257,14 +4649,8 @@ namespace crimson {
                         assert(false);
                 }
 
-#ifdef PROFILE
-                pull_request_timer.stop();
-#endif
                 return result;
-            } // pull_request
-
-
-        protected:
+            } // do_pull_request
 
 
             // data_mtx should be held when called; unfortunately this
@@ -2277,12 +4663,13 @@ namespace crimson {
 
 
         // PUSH version
-        template<typename C, typename R, bool U1 = false, uint B = 2>
-        class PushPriorityQueue : public PriorityQueueBase<C, R, U1, B> {
+        template<typename C, typename R, bool U1 = false, uint B = 2,
+                typename K = HeapBranching<B>>
+        class PushPriorityQueue : public PriorityQueueBase<C, R, U1, B, K> {
 
         protected:
 
-            using super = PriorityQueueBase<C, R, U1, B>;
+            using super = PriorityQueueBase<C, R, U1, B, K>;
 
         public:
 
@@ -2303,12 +4690,26 @@ namespace crimson {
             std::condition_variable sched_ahead_cv;
             Time sched_ahead_when = TimeZero;
 
-#ifdef PROFILE
-            public:
-              ProfileTimer<std::chrono::nanoseconds> add_request_timer;
-              ProfileTimer<std::chrono::nanoseconds> request_complete_timer;
-            protected:
-#endif
+        public:
+
+            // always compiled in and off until enabled; see
+            // enable_profiling
+            RuntimeProfile add_request_timer;
+            RuntimeProfile request_complete_timer;
+
+
+            // Turns the timers, the stage timing of scheduling decisions,
+            // the data_mtx profiles and delay tracking on or off; while on,
+            // one call in every 2^sample_shift on each thread is timed.
+            void enable_profiling(bool on, unsigned sample_shift = 6) {
+                add_request_timer.set_enabled(on, sample_shift);
+                request_complete_timer.set_enabled(on, sample_shift);
+                this->set_decision_timing(on, sample_shift);
+                this->enable_lock_profiling(on, sample_shift);
+                this->enable_delay_tracking(on);
+            }
+
+        protected:
 
             // NB: threads declared last, so constructed last and destructed first
 
@@ -2399,11 +4800,11 @@ namespace crimson {
 
         public:
 
-            inline void add_request(R &&request,
+            inline AdmissionResult add_request(R &&request,
                                     const C &client_id,
                                     const ReqParams &req_params,
                                     double addl_cost = 0.0) {
-                add_request(typename super::RequestRef(new R(std::move(request))),
+                return guarded_add_request(std::move(request),
                             client_id,
                             req_params,
                             get_time(),
@@ -2411,20 +4812,20 @@ namespace crimson {
             }
 
 
-            inline void add_request(typename super::RequestRef &&request,
+            inline AdmissionResult add_request(typename super::RequestRef &&request,
                                     const C &client_id,
                                     const ReqParams &req_params,
                                     double addl_cost = 0.0) {
-                add_request(request, req_params, client_id, get_time(), addl_cost);
+                return add_request(std::move(request), client_id, req_params, get_time(), addl_cost);
             }
 
 
-            inline void add_request_time(const R &request,
+            inline AdmissionResult add_request_time(const R &request,
                                          const C &client_id,
                                          const ReqParams &req_params,
                                          const Time time,
                                          double addl_cost = 0.0) {
-                add_request(typename super::RequestRef(new R(request)),
+                return add_request(typename super::RequestRef(new R(request)),
                             client_id,
                             req_params,
                             time,
@@ -2432,40 +4833,98 @@ namespace crimson {
             }
 
 
-            void add_request(typename super::RequestRef &&request,
+            // the request is charged the capacity units of its op class
+            inline AdmissionResult add_request(R &&request,
+                                    const C &client_id,
+                                    const ReqParams &req_params,
+                                    const OpClass op_class,
+                                    double addl_cost = 0.0) {
+                return guarded_add_request(std::move(request),
+                            client_id,
+                            req_params,
+                            get_time(),
+                            addl_cost,
+                            TimeZero,
+                            op_class);
+            }
+
+
+            // the request is dropped instead of handled once expiry (an
+            // absolute time) has passed
+            inline AdmissionResult add_request_expiry(R &&request,
+                                           const C &client_id,
+                                           const ReqParams &req_params,
+                                           const Time expiry,
+                                           double addl_cost = 0.0) {
+                return guarded_add_request(std::move(request),
+                            client_id,
+                            req_params,
+                            get_time(),
+                            addl_cost,
+                            expiry);
+            }
+
+
+            AdmissionResult add_request(typename super::RequestRef &&request,
                              const C &client_id,
                              const ReqParams &req_params,
                              const Time time,
-                             double addl_cost = 0.0) {
-                typename super::DataGuard g(this->data_mtx);
-#ifdef PROFILE
-                add_request_timer.start();
-#endif
-                super::do_add_request(std::move(request),
-                                      client_id,
-                                      req_params,
-                                      time,
-                                      addl_cost);
-                schedule_request();
-#ifdef PROFILE
-                add_request_timer.stop();
-#endif
+                             double addl_cost = 0.0,
+                             const Time expiry = TimeZero,
+                             const OpClass op_class = OpClass::read) {
+                return guarded_add_request(std::move(request), client_id,
+                                           req_params, time, addl_cost,
+                                           expiry, op_class);
             }
 
 
             void request_completed() {
-                typename super::DataGuard g(this->data_mtx);
-#ifdef PROFILE
-                request_complete_timer.start();
-#endif
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::request_completed));
+                auto timing = request_complete_timer.measure();
+                schedule_request();
+            }
+
+
+            // as above, for a request of the client; the oldest of its
+            // outstanding ones is taken to be the one that finished
+            void request_completed(const C &client_id) {
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::request_completed));
+                auto timing = request_complete_timer.measure();
+                super::do_request_completed(client_id, get_time());
                 schedule_request();
-#ifdef PROFILE
-                request_complete_timer.stop();
-#endif
             }
 
         protected:
 
+            // request is an R or a RequestRef; either way it is moved from
+            // only once admitted
+            template<typename Req>
+            AdmissionResult guarded_add_request(Req &&request,
+                                                const C &client_id,
+                                                const ReqParams &req_params,
+                                                const Time time,
+                                                double addl_cost = 0.0,
+                                                const Time expiry = TimeZero,
+                                                const OpClass op_class = OpClass::read) {
+                typename super::ProfiledGuard g(this->data_mtx,
+                                                this->lock_profile(LockSite::add));
+                auto timing = add_request_timer.measure();
+                AdmissionResult result = super::do_add_request(std::forward<Req>(request),
+                                                               client_id,
+                                                               req_params,
+                                                               time,
+                                                               addl_cost,
+                                                               expiry,
+                                                               op_class);
+                if (result.accepted) {
+                    schedule_request();
+                }
+                return result;
+            }
+
+
             // data_mtx should be held when called; furthermore, the heap
             // should not be empty and the top element of the heap should
             // not be already handled
@@ -2608,7 +5067,8 @@ namespace crimson {
 
                         l.unlock();
                         if (!this->finishing) {
-                            typename super::DataGuard g(this->data_mtx);
+                            typename super::ProfiledGuard g(this->data_mtx,
+                                                            this->lock_profile(LockSite::pull));
                             schedule_request();
                         }
                         l.lock();
@@ -0,0 +1,343 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* Window statistics in a POSIX shared-memory segment, for monitors in
+ * other processes (see tools/src/dmc_top.cc). The queue writes every
+ * field with relaxed stores between two bumps of a sequence number; a
+ * reader copies the segment and retries when the sequence number was
+ * odd or changed meanwhile. All fields are 64-bit atomics, doubles
+ * stored by their bit pattern, so the layout is the same for every
+ * compiler on a platform. A reader must check magic and version.
+ *
+ * Link with -lrt on glibc older than 2.34.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+
+namespace crimson {
+  namespace dmclock {
+
+    // dispatches counted per client and window, in the order of the
+    // counters in ClientRec
+    enum class ShmPhase : uint8_t {
+      reservation, reservation_break, deltar, deltar_break,
+      burst, burst_break, best_effort, best_effort_break
+    };
+
+    constexpr size_t shm_phase_count = 8;
+
+    namespace shm {
+
+      constexpr uint32_t magic = 0x53434d44;  // "DMCS"
+      constexpr uint32_t version = 1;
+
+      using word = std::atomic<uint64_t>;
+
+      struct ClassSlot {
+	word clients;
+	word depth;
+	word dispatched;
+	word service_rate;  // double
+      };
+
+      struct ClientSlot {
+	word id;        // client number, as in scheduling.txt
+	word type;      // ClientType
+	word depth;
+	word resource;  // double
+	word compensation;  // double
+	word dispatched[shm_phase_count];
+      };
+
+      struct Header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t max_clients;
+	uint32_t header_size;
+	word seq;
+	word windows;      // windows published
+	word win_start;    // double
+	word win_size;     // double
+	word queued;
+	word client_count; // slots in use, at most max_clients
+	ClassSlot classes[4];
+      };
+
+      inline size_t segment_size(uint32_t max_clients) {
+	return sizeof(Header) + max_clients * sizeof(ClientSlot);
+      }
+
+      inline ClientSlot* client_slots(Header* h) {
+	return reinterpret_cast<ClientSlot*>(h + 1);
+      }
+
+      inline const ClientSlot* client_slots(const Header* h) {
+	return reinterpret_cast<const ClientSlot*>(h + 1);
+      }
+
+      inline uint64_t bits(double d) {
+	uint64_t result;
+	memcpy(&result, &d, sizeof(result));
+	return result;
+      }
+
+      inline double from_bits(uint64_t b) {
+	double result;
+	memcpy(&result, &b, sizeof(result));
+	return result;
+      }
+
+    } // namespace shm
+
+
+    // a consistent copy of the segment
+    struct ShmStats {
+      struct Class {
+	uint64_t clients;
+	uint64_t depth;
+	uint64_t dispatched;
+	double service_rate;
+      };
+
+      struct Client {
+	uint64_t id;
+	uint64_t type;
+	uint64_t depth;
+	double resource;
+	double compensation;
+	uint64_t dispatched[shm_phase_count];
+      };
+
+      uint64_t windows = 0;
+      double win_start = 0.0;
+      double win_size = 0.0;
+      uint64_t queued = 0;
+      Class classes[4] = {};
+      std::vector<Client> clients;
+    };
+
+
+    // Owns the segment; created by the queue, unlinked when destroyed.
+    // Publication is begin_window(), one set_client() per client, then
+    // end_window(), all by one thread.
+    class ShmStatsWriter {
+      std::string name;
+      shm::Header* header;
+      size_t size;
+
+    public:
+
+      ShmStatsWriter() :
+	header(nullptr),
+	size(0)
+      {}
+
+      ~ShmStatsWriter() {
+	if (header) {
+	  munmap(header, size);
+	  shm_unlink(name.c_str());
+	}
+      }
+
+      ShmStatsWriter(const ShmStatsWriter&) = delete;
+      ShmStatsWriter& operator=(const ShmStatsWriter&) = delete;
+
+      // name follows shm_open, e.g. "/dmclock.osd.0"; returns false,
+      // with errno set, when the segment cannot be created
+      bool open(const std::string& _name, uint32_t max_clients) {
+	const size_t _size = shm::segment_size(max_clients);
+	int fd = shm_open(_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+	  return false;
+	}
+	if (ftruncate(fd, _size) < 0) {
+	  close(fd);
+	  shm_unlink(_name.c_str());
+	  return false;
+	}
+	void* addr = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == addr) {
+	  shm_unlink(_name.c_str());
+	  return false;
+	}
+	// a fresh segment reads as zeroes, so seq starts even
+	name = _name;
+	header = static_cast<shm::Header*>(addr);
+	size = _size;
+	header->max_clients = max_clients;
+	header->header_size = sizeof(shm::Header);
+	header->version = shm::version;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = shm::magic;
+	return true;
+      }
+
+      uint32_t max_clients() const {
+	return header ? header->max_clients : 0;
+      }
+
+      void begin_window(double win_start, double win_size, uint64_t queued) {
+	const uint64_t seq = header->seq.load(std::memory_order_relaxed);
+	header->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	header->win_start.store(shm::bits(win_start), std::memory_order_relaxed);
+	header->win_size.store(shm::bits(win_size), std::memory_order_relaxed);
+	header->queued.store(queued, std::memory_order_relaxed);
+      }
+
+      void set_class(int type, uint64_t clients, uint64_t depth,
+		     uint64_t dispatched, double service_rate) {
+	shm::ClassSlot& c = header->classes[type];
+	c.clients.store(clients, std::memory_order_relaxed);
+	c.depth.store(depth, std::memory_order_relaxed);
+	c.dispatched.store(dispatched, std::memory_order_relaxed);
+	c.service_rate.store(shm::bits(service_rate), std::memory_order_relaxed);
+      }
+
+      // index must be below max_clients()
+      void set_client(uint32_t index, uint64_t id, int type, uint64_t depth,
+		      double resource, double compensation,
+		      const uint64_t (&dispatched)[shm_phase_count]) {
+	shm::ClientSlot& c = shm::client_slots(header)[index];
+	c.id.store(id, std::memory_order_relaxed);
+	c.type.store(type, std::memory_order_relaxed);
+	c.depth.store(depth, std::memory_order_relaxed);
+	c.resource.store(shm::bits(resource), std::memory_order_relaxed);
+	c.compensation.store(shm::bits(compensation), std::memory_order_relaxed);
+	for (size_t p = 0; p < shm_phase_count; ++p) {
+	  c.dispatched[p].store(dispatched[p], std::memory_order_relaxed);
+	}
+      }
+
+      void end_window(uint32_t client_count) {
+	header->client_count.store(client_count, std::memory_order_relaxed);
+	header->windows.store(header->windows.load(std::memory_order_relaxed) + 1,
+			      std::memory_order_relaxed);
+	header->seq.store(header->seq.load(std::memory_order_relaxed) + 1,
+			  std::memory_order_release);
+      }
+    }; // class ShmStatsWriter
+
+
+    // Maps a segment read-only.
+    class ShmStatsReader {
+      const shm::Header* header;
+      size_t size;
+
+    public:
+
+      ShmStatsReader() :
+	header(nullptr),
+	size(0)
+      {}
+
+      ~ShmStatsReader() {
+	if (header) {
+	  munmap(const_cast<shm::Header*>(header), size);
+	}
+      }
+
+      ShmStatsReader(const ShmStatsReader&) = delete;
+      ShmStatsReader& operator=(const ShmStatsReader&) = delete;
+
+      // returns false when the segment does not exist or is not one this
+      // reader understands
+      bool open(const std::string& name) {
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0) {
+	  return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(shm::Header)) {
+	  close(fd);
+	  return false;
+	}
+	void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == addr) {
+	  return false;
+	}
+	const shm::Header* h = static_cast<const shm::Header*>(addr);
+	if (shm::magic != h->magic || shm::version != h->version ||
+	    sizeof(shm::Header) != h->header_size ||
+	    size_t(st.st_size) < shm::segment_size(h->max_clients)) {
+	  munmap(addr, st.st_size);
+	  return false;
+	}
+	header = h;
+	size = st.st_size;
+	return true;
+      }
+
+      // copies the segment; false if a writer kept it busy for all of
+      // the attempts
+      bool read(ShmStats& out, int attempts = 100) const {
+	for (int i = 0; i < attempts; ++i) {
+	  const uint64_t seq = header->seq.load(std::memory_order_acquire);
+	  if (seq & 1) {
+	    continue;
+	  }
+	  out.windows = header->windows.load(std::memory_order_relaxed);
+	  out.win_start = shm::from_bits(header->win_start.load(std::memory_order_relaxed));
+	  out.win_size = shm::from_bits(header->win_size.load(std::memory_order_relaxed));
+	  out.queued = header->queued.load(std::memory_order_relaxed);
+	  for (int t = 0; t < 4; ++t) {
+	    const shm::ClassSlot& c = header->classes[t];
+	    out.classes[t].clients = c.clients.load(std::memory_order_relaxed);
+	    out.classes[t].depth = c.depth.load(std::memory_order_relaxed);
+	    out.classes[t].dispatched = c.dispatched.load(std::memory_order_relaxed);
+	    out.classes[t].service_rate =
+	      shm::from_bits(c.service_rate.load(std::memory_order_relaxed));
+	  }
+	  uint64_t count = header->client_count.load(std::memory_order_relaxed);
+	  if (count > header->max_clients) {
+	    continue;
+	  }
+	  out.clients.resize(count);
+	  for (uint64_t k = 0; k < count; ++k) {
+	    const shm::ClientSlot& c = shm::client_slots(header)[k];
+	    ShmStats::Client& o = out.clients[k];
+	    o.id = c.id.load(std::memory_order_relaxed);
+	    o.type = c.type.load(std::memory_order_relaxed);
+	    o.depth = c.depth.load(std::memory_order_relaxed);
+	    o.resource = shm::from_bits(c.resource.load(std::memory_order_relaxed));
+	    o.compensation =
+	      shm::from_bits(c.compensation.load(std::memory_order_relaxed));
+	    for (size_t p = 0; p < shm_phase_count; ++p) {
+	      o.dispatched[p] = c.dispatched[p].load(std::memory_order_relaxed);
+	    }
+	  }
+	  std::atomic_thread_fence(std::memory_order_acquire);
+	  if (header->seq.load(std::memory_order_relaxed) == seq) {
+	    return true;
+	  }
+	}
+	return false;
+      }
+    }; // class ShmStatsReader
+
+  } // namespace dmclock
+} // namespace crimson
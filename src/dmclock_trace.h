@@ -0,0 +1,98 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* USDT probes for the scheduler, under the provider name "dmclock".
+ * They are compiled in when HAVE_SYS_SDT_H is defined (the build does
+ * so when <sys/sdt.h> is found) and compile to nothing otherwise. An
+ * inactive probe is a single nop; its arguments are left where the
+ * compiler already has them, so only values computed solely for the
+ * probe cost anything. List them with
+ *
+ *   bpftrace -l 'usdt:./dmclock-sims:dmclock:*'
+ *
+ * Probes and arguments:
+ *
+ *   add_request       client, client type, reservation tag ns,
+ *                     proportion tag ns, limit tag ns, client depth
+ *   decision          DecisionOutcome, when ready ns (future only)
+ *   dispatch          client, client type, reservation tag ns,
+ *                     proportion tag ns, limit tag ns, client depth
+ *   rollover_start    window start ns, clients
+ *   rollover_end      window start ns, queued requests
+ *   clean_start       clients
+ *   clean_end         clients, queued requests
+ *   type_change       client, old client type, new client type
+ *
+ * Tags and times are nanoseconds, saturated at INT64_MAX; the tags
+ * of a request queued behind others are 0 unless DO_NOT_DELAY_TAG_CALC
+ * is defined. A client id is its value when integral and the address
+ * of its record's copy otherwise.
+ */
+
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+
+namespace crimson {
+  namespace dmclock {
+    namespace trace {
+
+      inline int64_t ns(double seconds) {
+	constexpr double max = double(std::numeric_limits<int64_t>::max()) / 1e9;
+	return seconds >= max ?
+	  std::numeric_limits<int64_t>::max() : int64_t(seconds * 1e9);
+      }
+
+      template<typename C>
+      inline typename std::enable_if<std::is_integral<C>::value, uint64_t>::type
+      client_id(const C& client) {
+	return uint64_t(client);
+      }
+
+      template<typename C>
+      inline typename std::enable_if<!std::is_integral<C>::value, uint64_t>::type
+      client_id(const C& client) {
+	return uint64_t(reinterpret_cast<uintptr_t>(&client));
+      }
+
+    } // namespace trace
+  } // namespace dmclock
+} // namespace crimson
+
+
+#ifdef HAVE_SYS_SDT_H
+
+#define DMC_TRACE1(name, a1) \
+  DTRACE_PROBE1(dmclock, name, a1)
+#define DMC_TRACE2(name, a1, a2) \
+  DTRACE_PROBE2(dmclock, name, a1, a2)
+#define DMC_TRACE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(dmclock, name, a1, a2, a3)
+#define DMC_TRACE6(name, a1, a2, a3, a4, a5, a6) \
+  DTRACE_PROBE6(dmclock, name, a1, a2, a3, a4, a5, a6)
+
+#else
+
+#define DMC_TRACE1(name, a1) do {} while (0)
+#define DMC_TRACE2(name, a1, a2) do {} while (0)
+#define DMC_TRACE3(name, a1, a2, a3) do {} while (0)
+#define DMC_TRACE6(name, a1, a2, a3, a4, a5, a6) do {} while (0)
+
+#endif
@@ -0,0 +1,261 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#pragma once
+
+/* Hardware performance counters -- cycles, instructions, cache misses
+ * and branch misses -- counted per thread with perf_event_open and
+ * attributed to operations by PerfProfile scopes. User-space only, so
+ * that perf_event_paranoid up to 2 allows it. Where the counters cannot
+ * be opened (not Linux, no PMU in a VM, a stricter paranoid setting,
+ * seccomp) nothing is counted and PerfProfile reports no calls; a
+ * counter missing on its own is left out and reported as such.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+
+namespace crimson {
+
+  enum class PerfEvent : unsigned {
+    cycles, instructions, cache_misses, branch_misses
+  };
+
+  constexpr unsigned perf_event_count = 4;
+
+  inline const char* perf_event_name(PerfEvent event) {
+    static const char* names[] = {
+      "cycles", "instructions", "cache_misses", "branch_misses"
+    };
+    return names[unsigned(event)];
+  }
+
+
+  struct PerfSample {
+    uint64_t values[perf_event_count] = {};
+
+    uint64_t operator[](PerfEvent event) const {
+      return values[unsigned(event)];
+    }
+  }; // struct PerfSample
+
+
+  // The counters of the calling thread, opened as one group so they
+  // are scheduled onto the PMU together and read with one read(2).
+  class PerfCounterGroup {
+    int fds[perf_event_count];
+    // position of each opened event in the group's read format
+    int slots[perf_event_count];
+    unsigned opened;
+
+#ifdef __linux__
+    static int open_event(PerfEvent event, int group_fd) {
+      static const uint64_t configs[] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+      };
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[unsigned(event)];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return int(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+#endif
+
+  public:
+
+    PerfCounterGroup() :
+      opened(0)
+    {
+      for (unsigned e = 0; e < perf_event_count; ++e) {
+	fds[e] = -1;
+	slots[e] = -1;
+      }
+#ifdef __linux__
+      // cycles leads; without it there is no group
+      for (unsigned e = 0; e < perf_event_count; ++e) {
+	const int fd = open_event(PerfEvent(e), e ? fds[0] : -1);
+	if (fd < 0) {
+	  if (0 == e) {
+	    return;
+	  }
+	  continue;
+	}
+	fds[e] = fd;
+	slots[e] = int(opened++);
+      }
+#endif
+    }
+
+    ~PerfCounterGroup() {
+#ifdef __linux__
+      for (unsigned e = 0; e < perf_event_count; ++e) {
+	if (fds[e] >= 0) {
+	  close(fds[e]);
+	}
+      }
+#endif
+    }
+
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+    bool available() const {
+      return opened > 0;
+    }
+
+    bool has(PerfEvent event) const {
+      return fds[unsigned(event)] >= 0;
+    }
+
+    // the counts since the group was opened; false, leaving out alone,
+    // when they cannot be read
+    bool read(PerfSample& out) const {
+#ifdef __linux__
+      if (!available()) {
+	return false;
+      }
+      uint64_t buf[1 + perf_event_count];
+      const ssize_t want = ssize_t((1 + opened) * sizeof(uint64_t));
+      if (::read(fds[0], buf, sizeof(buf)) < want || buf[0] != opened) {
+	return false;
+      }
+      for (unsigned e = 0; e < perf_event_count; ++e) {
+	out.values[e] = slots[e] >= 0 ? buf[1 + slots[e]] : 0;
+      }
+      return true;
+#else
+      (void) out;
+      return false;
+#endif
+    }
+
+    // opened on first use by each thread and closed when it exits
+    static PerfCounterGroup& for_thread() {
+      static thread_local PerfCounterGroup group;
+      return group;
+    }
+  }; // class PerfCounterGroup
+
+
+  // Counter deltas summed over the measured calls of one operation,
+  // from every thread. Off until set_enabled; when off, measure() costs
+  // one relaxed atomic load. When on, each call costs two reads of the
+  // thread's counters, a few microseconds, so enable it for profiling
+  // runs only.
+  class PerfProfile {
+
+  public:
+
+    class Scope {
+      PerfProfile* profile;
+      PerfSample start;
+
+    public:
+
+      Scope(PerfProfile* _profile) :
+	profile(_profile)
+      {
+	if (profile && !PerfCounterGroup::for_thread().read(start)) {
+	  profile = nullptr;
+	}
+      }
+
+      Scope(Scope&& other) :
+	profile(other.profile),
+	start(other.start)
+      {
+	other.profile = nullptr;
+      }
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+
+      ~Scope() {
+	PerfSample end;
+	if (profile && PerfCounterGroup::for_thread().read(end)) {
+	  profile->record(start, end);
+	}
+      }
+    }; // class Scope
+
+  private:
+
+    std::atomic<bool> enabled;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> sums[perf_event_count];
+
+    void record(const PerfSample& start, const PerfSample& end) {
+      for (unsigned e = 0; e < perf_event_count; ++e) {
+	sums[e].fetch_add(end.values[e] - start.values[e],
+			  std::memory_order_relaxed);
+      }
+      calls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+  public:
+
+    PerfProfile() :
+      enabled(false),
+      calls(0)
+    {
+      for (auto& sum : sums) {
+	sum.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // turning on opens the calling thread's counters; false when they
+    // are unavailable here, in which case nothing will be counted on
+    // this thread
+    bool set_enabled(bool on) {
+      enabled.store(on, std::memory_order_relaxed);
+      return !on || PerfCounterGroup::for_thread().available();
+    }
+
+    inline Scope measure() {
+      return Scope(enabled.load(std::memory_order_relaxed) ? this : nullptr);
+    }
+
+    uint64_t get_calls() const {
+      return calls.load(std::memory_order_relaxed);
+    }
+
+    // mean count per measured call; 0 without calls or when the counter
+    // is missing
+    double get_mean(PerfEvent event) const {
+      const uint64_t n = get_calls();
+      return n ? double(sums[unsigned(event)].load(std::memory_order_relaxed)) / n : 0.0;
+    }
+
+    void reset() {
+      calls.store(0, std::memory_order_relaxed);
+      for (auto& sum : sums) {
+	sum.store(0, std::memory_order_relaxed);
+      }
+    }
+  }; // class PerfProfile
+
+} // namespace crimson
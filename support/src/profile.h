@@ -18,6 +18,16 @@
 
 #include <cmath>
 #include <chrono>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 namespace crimson {
@@ -57,12 +67,118 @@ namespace crimson {
   class ProfileCombiner;
 
 
-  template<typename T>
-  class ProfileTimer : public ProfileBase<T> {
+  // Log-linear (HDR-style) histogram of durations. Values below
+  // 2^sub_bits are counted exactly; above that every power of two is
+  // split into 2^(sub_bits - 1) equal buckets, so with the default
+  // SubBits of 6 a percentile is within about 3% of the true value (9KB
+  // of buckets); 3 gives about 25% in 1.2KB. Values of 2^max_bits and
+  // above land in the last bucket. Not thread-safe: give each thread
+  // its own instance and merge them.
+  template<typename T, unsigned SubBits = 6>
+  class ProfileHistogram : public ProfileBase<T> {
     friend ProfileCombiner<T>;
 
     using super = ProfileBase<T>;
 
+  public:
+
+    using rep_type = typename T::rep;
+
+    static constexpr unsigned sub_bits = SubBits;
+    static constexpr unsigned max_bits = 40;
+    static constexpr unsigned half_count = 1u << (sub_bits - 1);
+    static constexpr unsigned bucket_count =
+      (max_bits - sub_bits + 2) * half_count;
+
+  protected:
+
+    std::array<uint64_t, bucket_count> buckets{};
+
+    static unsigned bucket_index(uint64_t value) {
+      if (value < (uint64_t(1) << sub_bits)) {
+	return unsigned(value);
+      }
+      if (value >= (uint64_t(1) << max_bits)) {
+	return bucket_count - 1;
+      }
+      unsigned msb = 63 - __builtin_clzll(value);
+      unsigned shift = msb - (sub_bits - 1);
+      return shift * half_count + unsigned(value >> shift);
+    }
+
+    // highest value that falls in the bucket
+    static uint64_t bucket_high(unsigned index) {
+      if (index < (1u << sub_bits)) {
+	return index;
+      }
+      unsigned shift = index / half_count - 1;
+      uint64_t top = index - shift * half_count;
+      return ((top + 1) << shift) - 1;
+    }
+
+  public:
+
+    void record(typename T::rep value) {
+      if (value < 0) value = 0;
+      this->sum += value;
+      this->sum_squares += value * value;
+      if (0 == this->count) {
+	this->low = value;
+	this->high = value;
+      } else {
+	if (value < this->low) this->low = value;
+	if (value > this->high) this->high = value;
+      }
+      ++this->count;
+      ++buckets[bucket_index(uint64_t(value))];
+    }
+
+    void merge(const ProfileHistogram& other) {
+      if (0 == other.count) return;
+      if (0 == this->count) {
+	this->low = other.low;
+	this->high = other.high;
+      } else {
+	if (other.low < this->low) this->low = other.low;
+	if (other.high > this->high) this->high = other.high;
+      }
+      this->count += other.count;
+      this->sum += other.sum;
+      this->sum_squares += other.sum_squares;
+      for (unsigned i = 0; i < bucket_count; ++i) {
+	buckets[i] += other.buckets[i];
+      }
+    }
+
+    // value at or below which the fraction q (0 to 1) of the recorded
+    // values fall; never more than the highest value recorded
+    double get_percentile(double q) const {
+      if (0 == this->count) return nan("");
+      uint64_t rank = uint64_t(std::ceil(q * this->count));
+      if (rank < 1) rank = 1;
+      uint64_t seen = 0;
+      for (unsigned i = 0; i < bucket_count; ++i) {
+	seen += buckets[i];
+	if (seen >= rank) {
+	  double value = double(bucket_high(i));
+	  return value < this->high ? value : double(this->high);
+	}
+      }
+      return double(this->high);
+    }
+
+    double get_p50() const { return get_percentile(0.5); }
+    double get_p99() const { return get_percentile(0.99); }
+    double get_p999() const { return get_percentile(0.999); }
+  }; // class ProfileHistogram
+
+
+  template<typename T>
+  class ProfileTimer : public ProfileHistogram<T> {
+    friend ProfileCombiner<T>;
+
+    using super = ProfileHistogram<T>;
+
     bool is_timing = false;
     typename super::clock::time_point start_time;
 
@@ -80,42 +196,274 @@ namespace crimson {
     void stop() {
       assert(is_timing);
       T duration = std::chrono::duration_cast<T>(super::clock::now() - start_time);
-      typename T::rep duration_count = duration.count();
-      this->sum += duration_count;
-      this->sum_squares += duration_count * duration_count;
-      if (0 == this->count) {
-	this->low = duration_count;
-	this->high = duration_count;
-      } else {
-	if (duration_count < this->low) this->low = duration_count;
-	else if (duration_count > this->high) this->high = duration_count;
-      }
-      ++this->count;
+      this->record(duration.count());
       is_timing = false;
     }
   };  // class ProfileTimer
 
 
   template<typename T>
-  class ProfileCombiner : public ProfileBase<T> {
+  class ProfileCombiner : public ProfileHistogram<T> {
 
-    using super = ProfileBase<T>;
+    using super = ProfileHistogram<T>;
 
   public:
 
     ProfileCombiner() {}
 
-    void combine(const ProfileTimer<T>& timer) {
-      if (0 == this->count) {
-	this->low = timer.low;
-	this->high = timer.high;
+    void combine(const ProfileHistogram<T>& histogram) {
+      this->merge(histogram);
+    }
+  }; // class ProfileCombiner
+
+
+  // Timestamps for RuntimeProfile. On x86 this is the time stamp
+  // counter, converted to nanoseconds with a factor measured against
+  // steady_clock by calibrate(); elsewhere it is steady_clock itself.
+  struct ProfileClock {
+
+    static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static std::atomic<double>& ns_per_tick_ref() {
+      static std::atomic<double> ns_per_tick(1.0);
+      return ns_per_tick;
+    }
+
+    static inline double ns_per_tick() {
+      return ns_per_tick_ref().load(std::memory_order_relaxed);
+    }
+
+    // calibrates on the first call only, as the factor is process wide;
+    // called when profiling is enabled
+    static void calibrate_once() {
+      static std::once_flag calibrated;
+      std::call_once(calibrated, &ProfileClock::calibrate);
+    }
+
+    // spins for about a millisecond
+    static void calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+      using clock = std::chrono::steady_clock;
+      const clock::time_point t0 = clock::now();
+      const uint64_t c0 = ticks();
+      clock::time_point t1;
+      do {
+	t1 = clock::now();
+      } while (t1 - t0 < std::chrono::milliseconds(1));
+      const uint64_t c1 = ticks();
+      const double ns =
+	std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+      if (c1 > c0) {
+	ns_per_tick_ref().store(ns / (c1 - c0), std::memory_order_relaxed);
+      }
+#endif
+    }
+  }; // struct ProfileClock
+
+
+  // Timing that is always compiled in and switched on at runtime. When
+  // off, measure() costs one relaxed atomic load. When on, one in every
+  // 2^sample_shift calls is timed and recorded into one of a few striped
+  // histograms, chosen per thread, so threads rarely share a lock or a
+  // cache line. snapshot() merges the stripes. Each profile counts its
+  // own calls, in the stripe of the calling thread, so profiles used
+  // together on one path are sampled independently.
+  class RuntimeProfile {
+
+  public:
+
+    using Histogram = ProfileHistogram<std::chrono::nanoseconds>;
+
+    static constexpr unsigned stripe_count = 8;
+
+    // times the enclosing scope when it was sampled
+    class Scope {
+      RuntimeProfile* profile;
+      uint64_t start;
+
+    public:
+
+      Scope(RuntimeProfile* _profile) :
+	profile(_profile),
+	start(_profile ? ProfileClock::ticks() : 0)
+      {}
+
+      Scope(Scope&& other) :
+	profile(other.profile),
+	start(other.start)
+      {
+	other.profile = nullptr;
+      }
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+
+      ~Scope() {
+	if (profile) {
+	  profile->record_ticks(ProfileClock::ticks() - start);
+	}
+      }
+    }; // class Scope
+
+  private:
+
+    // padded rather than aligned, since queues holding profiles are
+    // allocated with plain new, which C++11 does not over-align
+    struct Stripe {
+      std::atomic<unsigned> calls{0};
+      mutable std::mutex mtx;
+      std::unique_ptr<Histogram> histogram;
+      char pad[64];
+    };
+
+    std::atomic<bool> enabled;
+    std::atomic<unsigned> sample_mask;
+    std::array<Stripe, stripe_count> stripes;
+
+    static unsigned thread_stripe() {
+      static std::atomic<unsigned> next_stripe(0);
+      static thread_local unsigned stripe =
+	next_stripe.fetch_add(1, std::memory_order_relaxed) % stripe_count;
+      return stripe;
+    }
+
+  public:
+
+    RuntimeProfile() :
+      enabled(false),
+      sample_mask(0)
+    {}
+
+    void set_enabled(bool on, unsigned sample_shift = 6) {
+      if (on) {
+	ProfileClock::calibrate_once();
+      }
+      sample_mask.store((1u << sample_shift) - 1, std::memory_order_relaxed);
+      enabled.store(on, std::memory_order_relaxed);
+    }
+
+    bool is_enabled() const {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    // whether this call is one to time; the caller records it itself
+    inline bool sample() {
+      if (!enabled.load(std::memory_order_relaxed)) {
+	return false;
+      }
+      const unsigned call =
+	stripes[thread_stripe()].calls.fetch_add(1, std::memory_order_relaxed) + 1;
+      return 0 == (call & sample_mask.load(std::memory_order_relaxed));
+    }
+
+    inline Scope measure() {
+      return Scope(sample() ? this : nullptr);
+    }
+
+    void record_ticks(uint64_t ticks) {
+      record_ns(typename Histogram::rep_type(ticks * ProfileClock::ns_per_tick()));
+    }
+
+    void record_ns(typename Histogram::rep_type ns) {
+      Stripe& stripe = stripes[thread_stripe()];
+      std::lock_guard<std::mutex> g(stripe.mtx);
+      if (!stripe.histogram) {
+	stripe.histogram.reset(new Histogram);
+      }
+      stripe.histogram->record(ns);
+    }
+
+    // the sampled durations recorded so far, in nanoseconds
+    Histogram snapshot() const {
+      Histogram result;
+      for (auto& stripe : stripes) {
+	std::lock_guard<std::mutex> g(stripe.mtx);
+	if (stripe.histogram) {
+	  result.merge(*stripe.histogram);
+	}
+      }
+      return result;
+    }
+
+    void reset() {
+      for (auto& stripe : stripes) {
+	std::lock_guard<std::mutex> g(stripe.mtx);
+	stripe.histogram.reset();
+      }
+    }
+  }; // class RuntimeProfile
+
+
+  // How long callers waited for a lock and then held it, as a pair of
+  // RuntimeProfiles sampled together.
+  struct LockProfile {
+    RuntimeProfile wait;
+    RuntimeProfile hold;
+
+    void set_enabled(bool on, unsigned sample_shift = 6) {
+      wait.set_enabled(on, sample_shift);
+      hold.set_enabled(on, sample_shift);
+    }
+
+    bool is_enabled() const {
+      return wait.is_enabled();
+    }
+
+    void reset() {
+      wait.reset();
+      hold.reset();
+    }
+  }; // struct LockProfile
+
+
+  // A lock_guard that, for sampled calls, records the time spent
+  // acquiring the mutex and the time it was held into a LockProfile.
+  // Both are recorded after the mutex is released, so profiling does
+  // not lengthen the hold.
+  template<typename M>
+  class ProfiledLockGuard {
+    M& mtx;
+    LockProfile* profile;
+    uint64_t waited;
+    uint64_t acquired;
+
+  public:
+
+    ProfiledLockGuard(M& _mtx, LockProfile& _profile) :
+      mtx(_mtx),
+      profile(_profile.wait.sample() ? &_profile : nullptr),
+      waited(0),
+      acquired(0)
+    {
+      if (profile) {
+	const uint64_t start = ProfileClock::ticks();
+	mtx.lock();
+	acquired = ProfileClock::ticks();
+	waited = acquired - start;
       } else {
-	if (timer.low < this->low) this->low = timer.low;
-	else if (timer.high > this->high) this->high = timer.high;
+	mtx.lock();
       }
-      this->count += timer.count;
-      this->sum += timer.sum;
-      this->sum_squares += timer.sum_squares;
     }
-  }; // class ProfileCombiner
+
+    ProfiledLockGuard(const ProfiledLockGuard&) = delete;
+    ProfiledLockGuard& operator=(const ProfiledLockGuard&) = delete;
+
+    ~ProfiledLockGuard() {
+      if (profile) {
+	const uint64_t released = ProfileClock::ticks();
+	mtx.unlock();
+	profile->wait.record_ticks(waited);
+	profile->hold.record_ticks(released - acquired);
+      } else {
+	mtx.unlock();
+      }
+    }
+  }; // class ProfiledLockGuard
 } // namespace crimson
@@ -0,0 +1,208 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "profile.h"
+#include "perf_counters.h"
+
+
+using Histogram = crimson::ProfileHistogram<std::chrono::nanoseconds>;
+
+
+TEST(profile_histogram, exact_below_sub_buckets) {
+  Histogram h;
+  for (int i = 1; i <= 50; ++i) {
+    h.record(i);
+  }
+  EXPECT_EQ(50u, h.get_count());
+  EXPECT_EQ(25.0, h.get_p50());
+  EXPECT_EQ(50.0, h.get_p99());
+  EXPECT_EQ(1, h.get_low());
+  EXPECT_EQ(50, h.get_high());
+}
+
+
+TEST(profile_histogram, relative_error) {
+  Histogram h;
+  for (int i = 1; i <= 100000; ++i) {
+    h.record(i * 100);
+  }
+  EXPECT_NEAR(5000000.0, h.get_p50(), 5000000.0 * 0.04);
+  EXPECT_NEAR(9900000.0, h.get_p99(), 9900000.0 * 0.04);
+  EXPECT_NEAR(9990000.0, h.get_p999(), 9990000.0 * 0.04);
+  EXPECT_GE(h.get_p999(), h.get_p99());
+  EXPECT_LE(h.get_p999(), 10000000.0) << "never above the highest value";
+}
+
+
+TEST(profile_histogram, coarse_sub_buckets) {
+  crimson::ProfileHistogram<std::chrono::microseconds, 3> h;
+  EXPECT_EQ(156u, unsigned(h.bucket_count));
+  for (int i = 1; i <= 100000; ++i) {
+    h.record(i * 100);
+  }
+  EXPECT_NEAR(5000000.0, h.get_p50(), 5000000.0 * 0.25);
+  EXPECT_NEAR(9900000.0, h.get_p99(), 9900000.0 * 0.25);
+  EXPECT_EQ(10000000, h.get_high());
+}
+
+
+TEST(profile_histogram, merge) {
+  Histogram fast;
+  Histogram slow;
+  for (int i = 0; i < 990; ++i) {
+    fast.record(1000);
+  }
+  for (int i = 0; i < 10; ++i) {
+    slow.record(1000000);
+  }
+
+  crimson::ProfileCombiner<std::chrono::nanoseconds> combined;
+  combined.combine(fast);
+  combined.combine(slow);
+  EXPECT_EQ(1000u, combined.get_count());
+  EXPECT_EQ(1000, combined.get_low());
+  EXPECT_EQ(1000000, combined.get_high());
+  EXPECT_NEAR(1000.0, combined.get_p50(), 1000.0 * 0.04);
+  EXPECT_NEAR(1000.0, combined.get_p99(), 1000.0 * 0.04);
+  EXPECT_NEAR(1000000.0, combined.get_p999(), 1000000.0 * 0.04);
+}
+
+
+TEST(profile_histogram, empty) {
+  Histogram h;
+  EXPECT_TRUE(std::isnan(h.get_p50()));
+  EXPECT_TRUE(std::isnan(h.get_mean()));
+}
+
+
+TEST(runtime_profile, toggle_and_sample) {
+  crimson::RuntimeProfile profile;
+  for (int i = 0; i < 100; ++i) {
+    auto timing = profile.measure();
+  }
+  EXPECT_EQ(0u, profile.snapshot().get_count()) << "off records nothing";
+
+  profile.set_enabled(true, 0);
+  for (int i = 0; i < 100; ++i) {
+    auto timing = profile.measure();
+  }
+  EXPECT_EQ(100u, profile.snapshot().get_count());
+
+  profile.reset();
+  profile.set_enabled(true, 2);
+  for (int i = 0; i < 100; ++i) {
+    auto timing = profile.measure();
+  }
+  EXPECT_EQ(25u, profile.snapshot().get_count()) << "one in four is timed";
+}
+
+
+TEST(runtime_profile, independent_counts) {
+  // two profiles measured on every call of one path must not share
+  // their sampling points
+  crimson::RuntimeProfile first;
+  crimson::RuntimeProfile second;
+  first.set_enabled(true, 2);
+  second.set_enabled(true, 2);
+  for (int i = 0; i < 100; ++i) {
+    auto timing1 = first.measure();
+    auto timing2 = second.measure();
+  }
+  EXPECT_EQ(25u, first.snapshot().get_count());
+  EXPECT_EQ(25u, second.snapshot().get_count());
+}
+
+
+TEST(runtime_profile, calibrates_once) {
+  // the clock factor is process wide; enabling twenty profiles must not
+  // spin a millisecond for each
+  crimson::RuntimeProfile first;
+  first.set_enabled(true);
+  crimson::RuntimeProfile profiles[20];
+  auto start = std::chrono::steady_clock::now();
+  for (auto &profile : profiles) {
+    profile.set_enabled(true);
+  }
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+	    std::chrono::milliseconds(10));
+}
+
+
+TEST(lock_profile, wait_and_hold) {
+  std::mutex mtx;
+  crimson::LockProfile profile;
+  {
+    crimson::ProfiledLockGuard<std::mutex> g(mtx, profile);
+  }
+  EXPECT_EQ(0u, profile.hold.snapshot().get_count()) << "off records nothing";
+
+  profile.set_enabled(true, 0);
+  std::atomic<bool> held(false);
+  std::thread holder([&] {
+      crimson::ProfiledLockGuard<std::mutex> g(mtx, profile);
+      held = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    });
+  while (!held) {
+    std::this_thread::yield();
+  }
+  {
+    crimson::ProfiledLockGuard<std::mutex> g(mtx, profile);
+  }
+  holder.join();
+
+  auto wait = profile.wait.snapshot();
+  auto hold = profile.hold.snapshot();
+  EXPECT_EQ(2u, wait.get_count());
+  EXPECT_EQ(2u, hold.get_count());
+  EXPECT_LE(10000000u, hold.get_high()) << "the holder kept it for 20ms";
+  EXPECT_LE(10000000u, wait.get_high()) << "so the other waited";
+  EXPECT_TRUE(mtx.try_lock()) << "released";
+  mtx.unlock();
+}
+
+
+TEST(perf_profile, counts_or_falls_back) {
+  crimson::PerfProfile profile;
+  {
+    auto scope = profile.measure();
+  }
+  EXPECT_EQ(0u, profile.get_calls()) << "off by default";
+
+  const bool available = profile.set_enabled(true);
+  volatile uint64_t sum = 0;
+  for (int i = 0; i < 10; ++i) {
+    auto scope = profile.measure();
+    for (int j = 0; j < 1000; ++j) {
+      sum += j;
+    }
+  }
+  if (available) {
+    EXPECT_EQ(10u, profile.get_calls());
+    EXPECT_LT(1000.0, profile.get_mean(crimson::PerfEvent::instructions)) <<
+      "a thousand additions at least";
+  } else {
+    EXPECT_EQ(0u, profile.get_calls()) << "nothing counted without counters";
+    EXPECT_EQ(0.0, profile.get_mean(crimson::PerfEvent::cycles));
+  }
+
+  profile.reset();
+  EXPECT_EQ(0u, profile.get_calls());
+}
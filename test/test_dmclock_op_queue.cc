@@ -0,0 +1,92 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+
+#include "dmclock_op_queue.h"
+#include "gtest/gtest.h"
+
+
+namespace dmc = crimson::dmclock;
+
+// a request that remembers the order it was made in
+struct OpRequest {
+    int id;
+};
+
+
+namespace crimson {
+    namespace dmclock {
+
+        TEST(dmclock_op_queue, lane_order) {
+            using ClientId = int;
+            using Queue = dmc::OpQueue<ClientId, OpRequest>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId internal = 0;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::A);
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            QueueRef pq(new Queue(client_info_f, 900, 30, false));
+            ReqParams req_params(1, 1);
+
+            pq->enqueue(client1, req_params, OpRequest{1});
+            pq->enqueue(client1, req_params, OpRequest{2}, dmc::OpClass::write);
+            pq->enqueue_front(client1, OpRequest{3});
+            pq->enqueue_front(client1, OpRequest{4});
+            pq->enqueue_strict(internal, 10, OpRequest{5});
+            pq->enqueue_strict(internal, 20, OpRequest{6});
+            pq->enqueue_strict(internal, 10, OpRequest{7});
+            EXPECT_EQ(7u, pq->length());
+
+            std::vector<int> order;
+            std::vector<dmc::OpLane> lanes;
+            while (!pq->empty()) {
+                Queue::OpReq req = pq->dequeue();
+                ASSERT_TRUE(req.is_retn());
+                order.push_back(req.pull.get_retn().request->id);
+                lanes.push_back(req.lane);
+            }
+
+            EXPECT_EQ(std::vector<int>({6, 5, 7, 4, 3, 1, 2}), order);
+            EXPECT_EQ(dmc::OpLane::strict, lanes[2]);
+            EXPECT_EQ(dmc::OpLane::front, lanes[3]);
+            EXPECT_EQ(dmc::OpLane::dmclock, lanes[6]);
+
+            Queue::OpQueueStats stats = pq->get_stats();
+            EXPECT_EQ(3u, stats.dequeued[size_t(dmc::OpLane::strict)]);
+            EXPECT_EQ(2u, stats.dequeued[size_t(dmc::OpLane::front)]);
+            EXPECT_EQ(2u, stats.dequeued[size_t(dmc::OpLane::dmclock)]);
+            EXPECT_EQ(6u, stats.op_class_enqueued[size_t(dmc::OpClass::read)]);
+            EXPECT_EQ(1u, stats.op_class_enqueued[size_t(dmc::OpClass::write)]);
+
+            EXPECT_TRUE(pq->dequeue().pull.is_none());
+            EXPECT_EQ(0u, pq->queued_count());
+            EXPECT_EQ(2u, pq->get_decision_stats().outcome(dmc::DecisionOutcome::best_effort));
+
+            // ops cannot reach the dmclock lane past enqueue
+            static_assert(!std::is_convertible<Queue *,
+                                  dmc::PullPriorityQueue<ClientId, OpRequest> *>::value,
+                          "the pull queue is a private base");
+        } // TEST
+
+    } // namespace dmclock
+} // namespace crimson
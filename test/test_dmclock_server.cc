@@ -613,6 +613,67 @@ namespace crimson {
         }
 
 
+        struct MixedBranching : dmc::HeapBranching<2> {
+            static constexpr uint resv = 3;
+            static constexpr uint r_limit = 8;
+            static constexpr uint limit = 4;
+            static constexpr uint best = 5;
+            static constexpr uint best_limit = 16;
+        };
+
+
+        // the branching factors change how the heaps are laid out, not the
+        // order requests are dispatched in
+        TEST(dmclock_server_pull, heap_branching) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request>;
+            using BranchedQueue = dmc::PullPriorityQueue<ClientId, Request, false, 2, MixedBranching>;
+
+            // distinct rates, so no two tags tie and the order is unique;
+            // A and O clients are left out because the best heap caps tags
+            // at age limits, which may tie
+            const int clients = 40;
+            const dmc::ClientType types[] = {
+                    dmc::ClientType::R, dmc::ClientType::B
+            };
+            std::vector<dmc::ClientInfo> infos;
+            for (int c = 0; c < clients; ++c) {
+                const double rate = 1.0 + 0.0137 * c;
+                const dmc::ClientType type = types[c % 2];
+                infos.emplace_back(dmc::ClientType::R == type ? rate : 0.0,
+                                   rate,
+                                   dmc::ClientType::B == type ? 10.0 * rate : 0.0,
+                                   type);
+            }
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &infos[c];
+            };
+
+            Queue pq(client_info_f, 8000.0, 30.0, true);
+            BranchedQueue bpq(client_info_f, 8000.0, 30.0, true);
+
+            ReqParams req_params(1, 1);
+            auto now = dmc::get_time();
+            for (int i = 0; i < 5; ++i) {
+                for (int c = 0; c < clients; ++c) {
+                    pq.add_request_time(Request{}, c, req_params, now);
+                    bpq.add_request_time(Request{}, c, req_params, now);
+                    now += 0.0001;
+                }
+            }
+
+            for (int i = 0; i < 5 * clients; ++i) {
+                now += 0.001;
+                Queue::PullReq pr = pq.pull_request(now);
+                BranchedQueue::PullReq bpr = bpq.pull_request(now);
+                ASSERT_EQ(Queue::NextReqType::returning, pr.type);
+                ASSERT_EQ(BranchedQueue::NextReqType::returning, bpr.type);
+                EXPECT_EQ(pr.get_retn().client, bpr.get_retn().client);
+                EXPECT_EQ(pr.get_retn().phase, bpr.get_retn().phase);
+            }
+        }
+
+
         TEST(dmclock_server_pull, pull_reservation) {
             using ClientId = int;
             using Queue = dmc::PullPriorityQueue<ClientId, Request>;
@@ -1558,5 +1619,1304 @@ namespace crimson {
             pq->pull_request();
             EXPECT_TRUE(pq->empty());
         } // TEST
+
+        TEST(dmclock_server_pull, pull_expired_request) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+
+            dmc::ClientInfo info1(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info1;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            ReqParams req_params(1, 1);
+
+            int expired = 0;
+            pq->set_expired_request_f([&](const ClientId &c, Queue::RequestRef &&req) {
+                EXPECT_EQ(client1, c);
+                ++expired;
+            });
+
+            dmc::Time now = dmc::get_time();
+            pq->add_request_expiry(Request{}, client1, req_params, now - 1.0);
+            pq->add_request_expiry(Request{}, client1, req_params, now - 0.5);
+            pq->add_request_expiry(Request{}, client1, req_params, now + 60.0);
+
+            Queue::PullReq pr = pq->pull_request();
+            EXPECT_TRUE(pr.is_retn()) << "live request behind expired ones is pulled";
+            EXPECT_EQ(2, expired);
+            EXPECT_EQ(2u, pq->get_expired_count(dmc::ClientType::A));
+
+            pr = pq->pull_request();
+            EXPECT_TRUE(pr.is_none());
+            EXPECT_EQ(0u, pq->get_expired_count(dmc::ClientType::R));
+        } // TEST
+
+        TEST(dmclock_server, expire_requests_sweep) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(100, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                if (client1 == c) return &info1;
+                else return &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            ReqParams req_params(1, 1);
+
+            dmc::Time now = dmc::get_time();
+            for (int i = 0; i < 5; ++i) {
+                pq->add_request(Request{}, client1, req_params);
+                pq->add_request_expiry(Request{}, client1, req_params, now + 10.0);
+                pq->add_request_expiry(Request{}, client2, req_params, now + 20.0);
+            }
+            EXPECT_EQ(15u, pq->request_count());
+
+            EXPECT_EQ(0u, pq->expire_requests(now));
+            EXPECT_EQ(5u, pq->expire_requests(now + 15.0));
+            EXPECT_EQ(10u, pq->request_count());
+            EXPECT_EQ(5u, pq->get_expired_count(dmc::ClientType::R));
+
+            EXPECT_EQ(5u, pq->expire_requests(now + 25.0));
+            EXPECT_EQ(5u, pq->request_count());
+            EXPECT_EQ(5u, pq->get_expired_count(dmc::ClientType::A));
+            EXPECT_EQ(0u, pq->expire_requests(now + 25.0)) << "nothing left to sweep";
+        } // TEST
+
+        TEST(dmclock_server_pull, other_client_aging) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(0, 1.0, 0.0, dmc::ClientType::B);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::O);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                if (client1 == c) return &info1;
+                else return &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            pq->set_other_max_wait(0.5);
+            ReqParams req_params(1, 1);
+
+            dmc::Time now = dmc::get_time();
+            for (int i = 0; i < 10; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, now);
+            }
+            pq->add_request_time(Request{}, client2, req_params, now);
+
+            Queue::PullReq pr = pq->pull_request(now + 0.1);
+            ASSERT_TRUE(pr.is_retn());
+            EXPECT_EQ(client1, pr.get_retn().client) << "burst is served first while O is young";
+
+            pr = pq->pull_request(now + 1.0);
+            ASSERT_TRUE(pr.is_retn());
+            EXPECT_EQ(client2, pr.get_retn().client) << "O is served once it has waited max_wait";
+            EXPECT_EQ(1u, pq->get_aged_sched_count());
+
+            pr = pq->pull_request(now + 1.1);
+            ASSERT_TRUE(pr.is_retn());
+            EXPECT_EQ(client1, pr.get_retn().client);
+        } // TEST
+
+
+        // A light O client next to a saturating A client with a thousand
+        // times its weight, pulled at 100 requests per second for 30
+        // seconds. Returns the longest wait of an O request served; burst
+        // O requests come in pairs.
+        static dmc::Time max_other_wait(dmc::Time max_wait, double other_limit,
+                                        int burst) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+
+            const ClientId a_client = 17;
+            const ClientId o_client = 98;
+            dmc::ClientInfo a_info(0, 100.0, 0.0, dmc::ClientType::A);
+            dmc::ClientInfo o_info(0, 0.1, other_limit, dmc::ClientType::O);
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return a_client == c ? &a_info : &o_info;
+            };
+
+            Queue pq(client_info_f, 100, 30, false);
+            pq.set_other_max_wait(max_wait);
+            ReqParams req_params(1, 1);
+
+            const dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 1000; ++i) {
+                pq.add_request_time(Request{}, a_client, req_params, start);
+            }
+            std::deque<dmc::Time> o_added;
+            dmc::Time longest = 0.0;
+            for (int step = 0; step < 3000; ++step) {
+                const dmc::Time now = start + step * 0.01;
+                if (0 == step % 100) {
+                    for (int i = 0; i < burst; ++i) {
+                        pq.add_request_time(Request{}, o_client, req_params, now);
+                        o_added.push_back(now);
+                    }
+                }
+                pq.add_request_time(Request{}, a_client, req_params, now);
+                Queue::PullReq pr = pq.pull_request(now);
+                if (pr.is_retn() && o_client == pr.get_retn().client) {
+                    longest = std::max(longest, now - o_added.front());
+                    o_added.pop_front();
+                }
+            }
+            return longest;
+        }
+
+
+        TEST(dmclock_server_pull, other_client_wait_bound) {
+            const dmc::Time step = 0.01;
+
+            EXPECT_GT(max_other_wait(0.0, 0.0, 1), 2.0) <<
+                                                       "without aging the O client starves";
+            EXPECT_LE(max_other_wait(0.25, 0.0, 1), 0.25 + step);
+
+            // the bound does not override a limit: of a pair, the second
+            // request waits for its limit tag, half a second on, and is
+            // served as aged once that comes
+            const dmc::Time limited = max_other_wait(0.1, 2.0, 2);
+            EXPECT_GE(limited, 0.5 - step);
+            EXPECT_LE(limited, 0.5 + 2 * step);
+        } // TEST
+
+        TEST(dmclock_server_pull, other_client_aged_limit) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+
+            const ClientId o_client = 98;
+            dmc::ClientInfo o_info(0, 1.0, 2.0, dmc::ClientType::O);
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &o_info;
+            };
+
+            // a lone O client under a hard limit of 2 per second; with
+            // nothing ready above it, aging must not lift the limit
+            auto served = [&](dmc::Time max_wait) -> int {
+                Queue pq(client_info_f, 100, 30, false);
+                pq.set_other_max_wait(max_wait);
+                ReqParams req_params(1, 1);
+
+                const dmc::Time start = dmc::get_time();
+                for (int i = 0; i < 20; ++i) {
+                    pq.add_request_time(Request{}, o_client, req_params, start);
+                }
+                int count = 0;
+                for (int step = 0; step < 100; ++step) {
+                    Queue::PullReq pr = pq.pull_request(start + step * 0.01);
+                    if (pr.is_retn()) ++count;
+                }
+                return count;
+            };
+
+            EXPECT_EQ(2, served(0.0));
+            EXPECT_EQ(2, served(0.1)) << "aged requests keep to the limit";
+        } // TEST
+
+        TEST(dmclock_server_pull, admission_control) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info1;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            pq->set_queue_caps(4, 6);
+            std::vector<std::pair<ClientId, bool>> signals;
+            pq->set_backpressure_f(3, 1, [&](const ClientId &c, bool throttle) {
+                signals.emplace_back(c, throttle);
+            });
+            ReqParams req_params(1, 1);
+
+            for (int i = 0; i < 4; ++i) {
+                EXPECT_TRUE(pq->add_request(Request{}, client1, req_params).accepted);
+            }
+            ASSERT_EQ(1u, signals.size()) << "high watermark crossed once";
+            EXPECT_EQ(client1, signals[0].first);
+            EXPECT_TRUE(signals[0].second);
+
+            dmc::Time now = dmc::get_time();
+            dmc::AdmissionResult rejected =
+                    pq->add_request_time(Request{}, client1, req_params, now);
+            EXPECT_FALSE(rejected.accepted) << "per-client cap reached";
+            EXPECT_LT(now, rejected.retry_after);
+
+            EXPECT_TRUE(pq->add_request(Request{}, client2, req_params).accepted);
+            EXPECT_TRUE(pq->add_request(Request{}, client2, req_params).accepted);
+            EXPECT_FALSE(pq->add_request(Request{}, client2, req_params).accepted) <<
+                                                                                   "global cap reached";
+            EXPECT_EQ(6u, pq->queued_count());
+
+            // drain client1 down to the low watermark
+            while (pq->queued_count() > 3) {
+                ASSERT_TRUE(pq->pull_request().is_retn());
+            }
+            pq->remove_by_client(client1);
+            ASSERT_EQ(2u, signals.size());
+            EXPECT_EQ(client1, signals[1].first);
+            EXPECT_FALSE(signals[1].second) << "low watermark releases throttle";
+            EXPECT_EQ(pq->request_count(), pq->queued_count());
+        } // TEST
+
+
+        // a rejected request, passed by value or not, is not moved from;
+        // a queue without capacity still gives a finite retry_after
+        TEST(dmclock_server_pull, admission_keeps_rejected) {
+            using ClientId = int;
+            using Payload = std::unique_ptr<int>;
+            using Queue = dmc::PullPriorityQueue<ClientId, Payload, false>;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::A);
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            Queue pq(client_info_f, 0, 30, false);
+            pq.set_queue_caps(1, 0);
+            ReqParams req_params(1, 1);
+
+            EXPECT_TRUE(pq.add_request(Payload(new int(1)), 17, req_params).accepted);
+
+            const dmc::Time now = dmc::get_time();
+            Payload request(new int(2));
+            dmc::AdmissionResult rejected =
+                    pq.add_request_time(std::move(request), 17, req_params, now);
+            EXPECT_FALSE(rejected.accepted);
+            ASSERT_TRUE(request) << "still the caller's";
+            EXPECT_EQ(2, *request);
+            EXPECT_DOUBLE_EQ(now + 30, rejected.retry_after) <<
+                                                             "a window, with no capacity to go by";
+
+            EXPECT_FALSE(pq.add_request(std::move(request), 17, req_params,
+                                        dmc::OpClass::write).accepted);
+            EXPECT_TRUE(request);
+            EXPECT_FALSE(pq.add_request_expiry(std::move(request), 17, req_params,
+                                               now + 1).accepted);
+            EXPECT_TRUE(request);
+
+            Queue::RequestRef ref(new Payload(new int(3)));
+            EXPECT_FALSE(pq.add_request(std::move(ref), 17, req_params).accepted);
+            EXPECT_TRUE(ref);
+            EXPECT_EQ(1u, pq.request_count());
+        } // TEST
+
+        TEST(dmclock_server_pull, op_class_capacity) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::B);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            // a write costs 30 units and writes may use 2 units per second,
+            // i.e. 60 units -- two writes -- per 30 second window
+            pq->set_op_class_cost(dmc::OpClass::write, 30.0);
+            pq->set_op_class_capacity(dmc::OpClass::write, 2.0);
+            ReqParams req_params(1, 1);
+
+            dmc::Time now = dmc::get_time();
+            for (int i = 0; i < 4; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, now);
+            }
+            for (int i = 0; i < 4; ++i) {
+                pq->add_request(Request{}, client2, req_params, dmc::OpClass::write);
+            }
+
+            int writes = 0;
+            for (int i = 0; i < 6; ++i) {
+                Queue::PullReq pr = pq->pull_request(now + 0.1 * (i + 1));
+                ASSERT_TRUE(pr.is_retn());
+                if (client2 == pr.get_retn().client) ++writes;
+            }
+            EXPECT_EQ(2, writes) << "writes stop at their capacity, reads go on";
+            EXPECT_EQ(60.0, pq->get_op_class_used(dmc::OpClass::write));
+            EXPECT_EQ(4.0, pq->get_op_class_used(dmc::OpClass::read));
+
+            Queue::PullReq pr = pq->pull_request(now + 1.0);
+            EXPECT_TRUE(pr.is_future()) << "remaining writes wait for the next window";
+        } // TEST
+
+        TEST(dmclock_server_pull, op_class_capacity_limit_break) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+
+            // a limit of 1 per second leaves all but the first request
+            // not ready, so they can only go by breaking the limit
+            dmc::ClientInfo info(0, 1.0, 1.0, dmc::ClientType::B);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, true));
+            pq->set_op_class_cost(dmc::OpClass::write, 30.0);
+            pq->set_op_class_capacity(dmc::OpClass::write, 2.0);
+            ReqParams req_params(1, 1);
+
+            for (int i = 0; i < 6; ++i) {
+                pq->add_request(Request{}, client1, req_params, dmc::OpClass::write);
+            }
+            dmc::Time now = dmc::get_time();
+
+            int writes = 0;
+            for (int i = 0; i < 6; ++i) {
+                Queue::PullReq pr = pq->pull_request(now + 0.01 * (i + 1));
+                if (pr.is_retn()) ++writes;
+            }
+            EXPECT_EQ(2, writes) << "breaking the limit keeps to the write capacity";
+            EXPECT_EQ(60.0, pq->get_op_class_used(dmc::OpClass::write));
+
+            Queue::PullReq pr = pq->pull_request(now + 0.1);
+            ASSERT_TRUE(pr.is_future());
+            EXPECT_LE(pr.getTime(), now + 30.0) << "blocked writes wait for the window to roll over";
+        } // TEST
+
+        TEST(dmclock_server_pull, background_throttle) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(0, 1.0, 0.0, dmc::ClientType::A);
+            dmc::ClientInfo info2(0, 1.0, 100.0, dmc::ClientType::O);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                if (client1 == c) return &info1;
+                else return &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 900, 30, false));
+            // adjust on every completion, from a single sample
+            pq->set_background_target(0.01, 0.0, 0.05, 1);
+            ReqParams req_params(1, 1);
+
+            const dmc::Time now = dmc::get_time();
+            // a request of client1 dispatched at dispatched, completed
+            // latency later
+            auto complete = [&](dmc::Time dispatched, dmc::Time latency) {
+                pq->add_request_time(Request{}, client1, req_params, dispatched);
+                ASSERT_TRUE(pq->pull_request(dispatched).is_retn());
+                pq->request_completed_time(client1, dispatched + latency);
+            };
+
+            pq->add_request_time(Request{}, client2, req_params, now);
+            ASSERT_TRUE(pq->pull_request(now).is_retn());
+            EXPECT_EQ(1.0, pq->get_background_scale());
+
+            pq->request_completed_time(client2, now + 0.05);
+            EXPECT_EQ(1.0, pq->get_background_scale()) <<
+                                                       "background latency is not a signal; no samples means headroom";
+
+            complete(now + 1.0, 0.05);
+            EXPECT_EQ(0.5, pq->get_background_scale()) << "foreground p99 over target";
+            complete(now + 2.0, 0.05);
+            EXPECT_EQ(0.25, pq->get_background_scale());
+
+            complete(now + 3.0, 0.001);
+            EXPECT_DOUBLE_EQ(0.35, pq->get_background_scale()) << "headroom grows the scale";
+
+            complete(now + 4.0, 0.009);
+            EXPECT_DOUBLE_EQ(0.35, pq->get_background_scale()) << "near target holds the scale";
+
+            // by default a step needs 20 samples and an interval since the
+            // controller was set
+            pq->set_background_target(0.01);
+            const dmc::Time later = now + 5.0;
+            for (int i = 0; i < 20; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, later);
+                ASSERT_TRUE(pq->pull_request(later).is_retn());
+            }
+            pq->request_completed_time(client1, later + 2.0);
+            EXPECT_EQ(1.0, pq->get_background_scale()) << "one sample is not enough";
+            for (int i = 0; i < 18; ++i) {
+                pq->request_completed_time(client1, later + 2.0);
+            }
+            EXPECT_EQ(1.0, pq->get_background_scale());
+            pq->request_completed_time(client1, later + 2.0);
+            EXPECT_EQ(0.5, pq->get_background_scale()) << "20 samples over target";
+        } // TEST
+
+        TEST(dmclock_server_pull, classify_clients) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(0, 1.0, 0.0, dmc::ClientType::A);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                if (client1 == c) return &info1;
+                else return &info2;
+            };
+
+            // one second windows
+            pq = QueueRef(new Queue(client_info_f, 900, 1, false));
+            ReqParams req_params(1, 1);
+
+            // register the clients and start a window at start
+            dmc::Time start = dmc::get_time();
+            pq->add_request_time(Request{}, client1, req_params, start);
+            pq->add_request_time(Request{}, client2, req_params, start);
+            pq->pull_request(start);
+            pq->pull_request(start);
+
+            dmc::ClassifierConfig config;
+            config.mode = dmc::ClassifierMode::apply;
+            config.hysteresis_windows = 2;
+            std::map<ClientId, dmc::ClientType> classified;
+            pq->set_classifier(config, [&](const ClientId &c,
+                                           dmc::ClientType from,
+                                           dmc::ClientType to,
+                                           bool applied) {
+                EXPECT_EQ(dmc::ClientType::A, from);
+                EXPECT_TRUE(applied);
+                classified[c] = to;
+            });
+
+            for (int w = 0; w < 2; ++w) {
+                // client1 arrives evenly, client2 all at once
+                for (int i = 0; i < 10; ++i) {
+                    pq->add_request_time(Request{}, client1, req_params, start + w + 0.1 * i + 0.05);
+                    pq->add_request_time(Request{}, client2, req_params, start + w + 0.01);
+                }
+                EXPECT_TRUE(classified.empty()) << "hysteresis holds the change back";
+                pq->pull_request(start + w + 1);
+            }
+
+            EXPECT_EQ(dmc::ClientType::R, classified[client1]);
+            EXPECT_EQ(dmc::ClientType::B, classified[client2]);
+            EXPECT_GT(pq->get_arrival_stats(client2).burstiness,
+                      pq->get_arrival_stats(client1).burstiness);
+            EXPECT_DOUBLE_EQ(7.5, pq->get_arrival_stats(client1).rate);
+        } // TEST
+
+        TEST(dmclock_server_pull, reservation_overcommit) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(80.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(40.0, 1.0, 0.0, dmc::ClientType::R);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                if (client1 == c) return &info1;
+                else return &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 100, 1, false));
+            ReqParams req_params(1, 1);
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 10; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+                pq->add_request_time(Request{}, client2, req_params, start);
+            }
+            EXPECT_EQ(1.0, pq->get_reservation_scale());
+
+            // the first pull rolls the window over
+            pq->pull_request(start);
+            EXPECT_EQ(120.0, pq->get_reservation_demand());
+            EXPECT_DOUBLE_EQ(100.0 / 120.0, pq->get_reservation_scale());
+
+            auto scaled_reservation = [&](ClientId c) {
+                double reservation = 0.0;
+                test_locked(pq->data_mtx, [&]() {
+                    reservation = pq->compensated_client_map.at(c)->reservation;
+                });
+                return reservation;
+            };
+            EXPECT_DOUBLE_EQ(80.0 * 100.0 / 120.0, scaled_reservation(client1));
+
+            // client1 got 60 of the 66.7 it was scaled to: over 80% of it,
+            // so compensated with the 8 it fell short, in unscaled units
+            test_locked(pq->data_mtx, [&]() {
+                pq->client_map.at(client1)->r0_counter = 60;
+                pq->client_map.at(client2)->r0_counter = 33;
+            });
+            pq->pull_request(start + 1);
+            EXPECT_EQ(128.0, pq->get_reservation_demand());
+            EXPECT_DOUBLE_EQ(88.0 * 100.0 / 128.0, scaled_reservation(client1));
+
+            // a client added mid-window starts at the current scale
+            ClientId client3 = 42;
+            dmc::ClientInfo info3(60.0, 1.0, 0.0, dmc::ClientType::R);
+            auto with_client3 = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client3 == c ? &info3 : client_info_f(c);
+            };
+            test_locked(pq->data_mtx, [&]() {
+                pq->client_info_f = with_client3;
+            });
+            pq->add_request_time(Request{}, client3, req_params, start + 1);
+            EXPECT_DOUBLE_EQ(60.0 * 100.0 / 128.0, scaled_reservation(client3));
+        } // TEST
+
+        TEST(dmclock_server_pull, estimate_wait) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            EXPECT_DOUBLE_EQ(0.1, pq->estimate_wait(client2)) <<
+                                                              "an unknown client gets its weight's share of capacity";
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 8; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+            }
+            // the first pull rolls the window over, then four are served
+            for (int i = 0; i < 4; ++i) {
+                ASSERT_TRUE(pq->pull_request(start).is_retn());
+            }
+            // the next rollover turns that into 4 requests per second
+            ASSERT_TRUE(pq->pull_request(start + 1).is_retn());
+            EXPECT_EQ(4.0, pq->get_service_rate(dmc::ClientType::A));
+
+            // three queued plus the new one, at four per second
+            EXPECT_NEAR(1.0, pq->estimate_wait(client1), 1e-9);
+            EXPECT_NEAR(0.5, pq->estimate_wait(client2), 1e-9) <<
+                                                               "half of the A class's rate";
+        } // TEST
+
+
+        TEST(dmclock_server_pull, decision_stats) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+
+            dmc::ClientInfo info(0, 1.0, 2.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            pq->set_decision_timing(true, 0);
+            ReqParams req_params(1, 1);
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+            }
+            // the limit of 2 per second holds the later requests back
+            // until they are promoted from the best_limit heap
+            for (int i = 0; i < 3; ++i) {
+                ASSERT_TRUE(pq->pull_request(start + 10 + i).is_retn());
+            }
+            EXPECT_TRUE(pq->pull_request(start + 20).is_none());
+
+            dmc::DecisionStats stats = pq->get_decision_stats();
+            EXPECT_EQ(4u, stats.calls);
+            EXPECT_EQ(4u, stats.timed_calls) << "every call is timed at shift 0";
+            EXPECT_EQ(3u, stats.outcome(dmc::DecisionOutcome::best_effort));
+            EXPECT_EQ(1u, stats.outcome(dmc::DecisionOutcome::none));
+            EXPECT_EQ(3u, stats.promotions[2]);
+            EXPECT_EQ(0u, stats.promotions[0] + stats.promotions[1]);
+            EXPECT_EQ(1u, stats.max_promotions);
+            EXPECT_EQ(4u, stats.rollovers) << "every pull starts a new window";
+            EXPECT_EQ(4u, stats.stage_entered[size_t(dmc::DecisionStage::best_effort)]);
+            EXPECT_EQ(1u, stats.stage_entered[size_t(dmc::DecisionStage::next_call)]) <<
+                                                                                       "only the pull that found nothing";
+
+            pq->reset_decision_stats();
+            pq->set_decision_timing(false);
+            pq->add_request_time(Request{}, client1, req_params, start + 30);
+            ASSERT_TRUE(pq->pull_request(start + 30).is_retn());
+            stats = pq->get_decision_stats();
+            EXPECT_EQ(1u, stats.calls);
+            EXPECT_EQ(0u, stats.timed_calls);
+            EXPECT_EQ(0u, stats.stage_ns[size_t(dmc::DecisionStage::rollover)]);
+        } // TEST
+
+
+        // every profile enable_profiling turns on samples its own calls,
+        // however many others the same add or pull passes through
+        TEST(dmclock_server_pull, profiles_all_sample) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::A);
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            Queue pq(client_info_f, 1e9, 30, false);
+            pq.enable_profiling(true);
+            ReqParams req_params(1, 1);
+
+            const int iterations = 10000;
+            for (int i = 0; i < iterations; ++i) {
+                pq.add_request(Request{}, i % 8, req_params);
+                ASSERT_TRUE(pq.pull_request().is_retn());
+            }
+
+            // one in 64 of each
+            const uint64_t expected = iterations / 64;
+            EXPECT_EQ(expected, pq.add_request_timer.snapshot().get_count());
+            EXPECT_EQ(expected, pq.pull_request_timer.snapshot().get_count());
+            EXPECT_EQ(expected, pq.get_lock_wait(dmc::LockSite::add).get_count());
+            EXPECT_EQ(expected, pq.get_lock_hold(dmc::LockSite::add).get_count());
+            EXPECT_EQ(expected, pq.get_lock_wait(dmc::LockSite::pull).get_count());
+            EXPECT_EQ(expected, pq.get_lock_hold(dmc::LockSite::pull).get_count());
+        } // TEST
+
+
+        TEST(dmclock_server_pull, trace_recorder) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+
+            dmc::ClientInfo info(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return &info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            dmc::Time start = dmc::get_time();
+            pq->add_request_time(Request{}, client1, req_params, start);
+            EXPECT_FALSE(pq->get_trace_recorder()) << "off by default";
+
+            pq->enable_trace(4);
+            for (int i = 0; i < 2; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+            }
+            for (int i = 0; i < 2; ++i) {
+                ASSERT_TRUE(pq->pull_request(start + 0.5).is_retn());
+            }
+
+            // two adds, a rollover, then a promotion from the best_limit
+            // heap before each of two dispatches, in a ring of four
+            auto recorder = pq->get_trace_recorder();
+            ASSERT_TRUE(recorder);
+            EXPECT_EQ(7u, recorder->recorded());
+            auto events = recorder->events();
+            ASSERT_EQ(4u, events.size());
+            EXPECT_EQ(dmc::TraceRecorder::Kind::promote, events[0].kind);
+            EXPECT_EQ(2u, events[0].detail);
+            EXPECT_EQ(dmc::TraceRecorder::Kind::dispatch, events[1].kind);
+            EXPECT_EQ(dmc::TraceRecorder::Kind::promote, events[2].kind);
+            EXPECT_EQ(dmc::TraceRecorder::Kind::dispatch, events[3].kind);
+            EXPECT_EQ(uint64_t(client1), events[3].client);
+            EXPECT_EQ(uint8_t(dmc::DecisionOutcome::best_effort), events[3].detail);
+            EXPECT_EQ(2u, events[3].depth) << "counted before the pop";
+            EXPECT_NEAR(500000000, events[3].end_ns - events[3].start_ns, 1000) <<
+                                                                                 "waited from its add to the pull";
+
+            std::ostringstream out;
+            pq->dump_trace(out);
+            EXPECT_NE(std::string::npos, out.str().find("\"traceEvents\":["));
+            EXPECT_NE(std::string::npos, out.str().find("\"name\":\"best_effort\""));
+            EXPECT_NE(std::string::npos, out.str().find("\"ph\":\"X\""));
+
+            pq->enable_trace(0);
+            EXPECT_FALSE(pq->get_trace_recorder());
+        } // TEST
+
+
+        // scrapes the exporter fd is connected to; closes fd
+        static std::string scrape(int fd) {
+            const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+            EXPECT_EQ(ssize_t(request.size()),
+                      send(fd, request.data(), request.size(), 0));
+            std::string response;
+            char buf[4096];
+            ssize_t got;
+            while ((got = recv(fd, buf, sizeof(buf), 0)) > 0) {
+                response.append(buf, got);
+            }
+            close(fd);
+            return response;
+        }
+
+
+        TEST(dmclock_server_pull, metrics_exporter) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client1 == c ? &info1 : &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            EXPECT_FALSE(pq->get_metrics_snapshot());
+            ASSERT_TRUE(pq->serve_metrics_loopback(0));
+            ASSERT_NE(0, pq->get_metrics_port());
+            EXPECT_TRUE(pq->get_metrics_snapshot()) << "published when serving starts";
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+                pq->add_request_time(Request{}, client2, req_params, start);
+            }
+            ASSERT_TRUE(pq->pull_request(start).is_retn());
+            pq->refresh_metrics();
+
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            ASSERT_LE(0, fd);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(pq->get_metrics_port());
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            ASSERT_EQ(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+            const std::string response = scrape(fd);
+
+            EXPECT_EQ(0u, response.find("HTTP/1.0 200 OK\r\n"));
+            EXPECT_NE(std::string::npos, response.find("\ndmclock_queued_requests 5\n"));
+            EXPECT_NE(std::string::npos,
+                      response.find("dmclock_class_queued_requests{class=\"A\"} 3\n"));
+            EXPECT_NE(std::string::npos,
+                      response.find("dmclock_client_window_dispatched{client=\"R_0\",class=\"R\","
+                                    "phase=\"reservation\"} 1\n"));
+            EXPECT_NE(std::string::npos,
+                      response.find("dmclock_decisions_total{outcome=\"reservation\"} 1\n"));
+
+            // and again on a Unix socket, replacing the TCP listener
+            const std::string path = "dmclock-metrics-test.sock";
+            ASSERT_TRUE(pq->serve_metrics_unix(path));
+            EXPECT_EQ(0, pq->get_metrics_port());
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            ASSERT_LE(0, fd);
+            struct sockaddr_un uaddr;
+            memset(&uaddr, 0, sizeof(uaddr));
+            uaddr.sun_family = AF_UNIX;
+            strncpy(uaddr.sun_path, path.c_str(), sizeof(uaddr.sun_path) - 1);
+            ASSERT_EQ(0, connect(fd, (struct sockaddr *) &uaddr, sizeof(uaddr)));
+            EXPECT_NE(std::string::npos,
+                      scrape(fd).find("\ndmclock_queued_requests 5\n"));
+
+            pq->stop_metrics();
+            EXPECT_NE(0, access(path.c_str(), F_OK)) << "socket file removed";
+        } // TEST
+
+
+        TEST(dmclock_server_pull, shm_stats) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client1 == c ? &info1 : &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            const std::string name = "/dmclock-test-" + std::to_string(getpid());
+            ASSERT_TRUE(pq->publish_shm_stats(name, 1));
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+                pq->add_request_time(Request{}, client2, req_params, start);
+            }
+            // the first pull opens a window, the last closes it
+            for (int i = 0; i < 3; ++i) {
+                ASSERT_TRUE(pq->pull_request(start).is_retn());
+            }
+            ASSERT_TRUE(pq->pull_request(start + 1).is_retn());
+
+            dmc::ShmStatsReader reader;
+            ASSERT_TRUE(reader.open(name));
+            dmc::ShmStats stats;
+            ASSERT_TRUE(reader.read(stats));
+            EXPECT_EQ(3u, stats.windows) << "on publishing and at two rollovers";
+            EXPECT_EQ(1.0, stats.win_size);
+            EXPECT_EQ(3u, stats.queued) << "as the window closed";
+            EXPECT_EQ(1u, stats.classes[dmc::ClientType::R].clients);
+            EXPECT_EQ(3u, stats.classes[dmc::ClientType::R].dispatched +
+                          stats.classes[dmc::ClientType::A].dispatched);
+            ASSERT_EQ(1u, stats.clients.size()) << "room for one client only";
+            uint64_t dispatched = 0;
+            for (auto d : stats.clients[0].dispatched) {
+                dispatched += d;
+            }
+            EXPECT_LT(0u, dispatched);
+
+            pq->stop_shm_stats();
+            dmc::ShmStatsReader gone;
+            EXPECT_FALSE(gone.open(name)) << "unlinked";
+        } // TEST
+
+
+        TEST(dmclock_server_pull, window_history) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client1 == c ? &info1 : &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            EXPECT_FALSE(pq->get_window_history()) << "off by default";
+            pq->set_window_history(2);
+            EXPECT_FALSE(pq->get_window_history()) << "no window ended yet";
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+                pq->add_request_time(Request{}, client2, req_params, start);
+            }
+            // every pull after the first at start ends a window, before it
+            // dispatches
+            for (int i = 0; i < 3; ++i) {
+                ASSERT_TRUE(pq->pull_request(start).is_retn());
+            }
+            ASSERT_TRUE(pq->pull_request(start + 1).is_retn());
+            ASSERT_TRUE(pq->pull_request(start + 2.5).is_retn());
+
+            auto latest = pq->get_window_history();
+            auto before = pq->get_window_history(1);
+            ASSERT_TRUE(latest);
+            ASSERT_TRUE(before);
+            EXPECT_FALSE(pq->get_window_history(2)) << "two windows kept";
+            EXPECT_EQ(2u, latest->index);
+            EXPECT_EQ(1u, before->index);
+            EXPECT_EQ(start, before->start);
+            EXPECT_EQ(start + 1, latest->start);
+            EXPECT_EQ(1.0, latest->size);
+            ASSERT_EQ(2u, before->clients.size());
+
+            uint32_t dispatched = 0;
+            uint32_t counted = 0;
+            for (const auto &r : before->clients) {
+                dispatched += r.dispatched;
+                counted += r.reservation_count + r.reservation_break_count +
+                           r.deltar_count + r.deltar_break_count +
+                           r.burst_count + r.burst_break_count +
+                           r.best_effort_count + r.best_effort_break_count;
+                EXPECT_EQ(0.0, r.latency_max) << "pulled as they arrived";
+            }
+            EXPECT_EQ(3u, dispatched);
+            EXPECT_EQ(3u, counted);
+
+            // the request pulled at start + 1 waited a second
+            dispatched = 0;
+            for (const auto &r : latest->clients) {
+                dispatched += r.dispatched;
+                if (r.dispatched > 0) {
+                    EXPECT_NEAR(1.0, r.latency_p50, 0.25);
+                    EXPECT_NEAR(1.0, r.latency_p99, 0.25);
+                    EXPECT_DOUBLE_EQ(1.0, r.latency_max);
+                }
+            }
+            EXPECT_EQ(1u, dispatched);
+
+            auto history = pq->get_client_history(client1);
+            ASSERT_EQ(2u, history.size());
+            EXPECT_EQ(2u, history[0].window) << "latest first";
+            EXPECT_EQ(1u, history[1].window);
+            EXPECT_EQ(client1, history[0].record.client);
+            EXPECT_EQ(dmc::ClientType::R, history[0].record.client_type);
+            EXPECT_EQ(2.0, history[0].record.reservation);
+            EXPECT_EQ(1u, pq->get_client_history(client1, 1).size());
+            EXPECT_TRUE(pq->get_client_history(55).empty());
+
+            pq->set_window_history(0);
+            EXPECT_FALSE(pq->get_window_history());
+            EXPECT_TRUE(pq->get_client_history(client1).empty());
+        } // TEST
+
+
+        TEST(dmclock_server_pull, qos_stats) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+
+            dmc::ClientInfo r1_info(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo r2_info(4.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo b_info(0.0, 1.0, 0.0, dmc::ClientType::B);
+            dmc::ClientInfo a1_info(0.0, 1.0, 0.0, dmc::ClientType::A);
+            dmc::ClientInfo a2_info(0.0, 2.0, 0.0, dmc::ClientType::A);
+            std::map<ClientId, dmc::ClientInfo *> infos = {
+                    {1, &r1_info}, {2, &r2_info}, {3, &b_info},
+                    {4, &a1_info}, {5, &a2_info}
+            };
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return infos.at(c);
+            };
+
+            Queue pq(client_info_f, 10, 1, false);
+            ReqParams req_params(1, 1);
+
+            auto lock_pq = [&](std::function<void()> code) {
+                test_locked(pq.data_mtx, code);
+            };
+
+            EXPECT_EQ(0u, pq.get_qos_stats().windows);
+
+            dmc::Time start = dmc::get_time();
+            for (ClientId c = 1; c <= 5; ++c) {
+                pq.add_request_time(Request{}, c, req_params, start);
+                pq.add_request_time(Request{}, c, req_params, start);
+            }
+            // opens the window; what it dispatched is overwritten below
+            ASSERT_TRUE(pq.pull_request(start).is_retn());
+            EXPECT_EQ(1u, pq.get_qos_stats().windows);
+
+            lock_pq([&]() {
+                for (auto &c : pq.client_map) {
+                    auto &client = *c.second;
+                    client.r0_counter = 0;
+                    client.r0_break_limit_counter = 0;
+                    client.deltar_counter = 0;
+                    client.deltar_break_limit_counter = 0;
+                    client.b_counter = 0;
+                    client.b_break_limit_counter = 0;
+                    client.be_counter = 0;
+                    client.be_break_limit_counter = 0;
+                    client.win_dispatched = 0;
+                    client.b_units = 0.0;
+                }
+                // met
+                pq.client_map.at(1)->r0_counter = 2;
+                pq.client_map.at(1)->win_dispatched = 2;
+                // half met, and broke its limit once
+                pq.client_map.at(2)->r0_counter = 2;
+                pq.client_map.at(2)->r0_break_limit_counter = 1;
+                pq.client_map.at(2)->win_dispatched = 3;
+                pq.client_map.at(3)->resource = 4.0;
+                pq.client_map.at(3)->b_units = 1.0;
+                // equal weighted shares
+                pq.client_map.at(4)->win_dispatched = 1;
+                pq.client_map.at(5)->win_dispatched = 2;
+            });
+
+            ASSERT_TRUE(pq.pull_request(start + 1).is_retn());
+            dmc::QosStats<ClientId> stats = pq.get_qos_stats();
+            EXPECT_EQ(2u, stats.windows);
+            EXPECT_EQ(2u, stats.last.r_clients);
+            EXPECT_EQ(1u, stats.last.r_met);
+            EXPECT_DOUBLE_EQ(0.75, stats.last.reservation_attainment);
+            EXPECT_DOUBLE_EQ(0.5, stats.last.min_reservation_attainment);
+            ASSERT_EQ(2u, stats.last_reservation_attainment.size()) << "R clients only";
+            EXPECT_DOUBLE_EQ(1.0, stats.last_reservation_attainment.at(1));
+            EXPECT_DOUBLE_EQ(0.5, stats.last_reservation_attainment.at(2));
+            EXPECT_EQ(8u, stats.last.dispatched);
+            EXPECT_EQ(1u, stats.last.limit_breaks);
+            EXPECT_DOUBLE_EQ(0.125, stats.last.limit_overshoot);
+            EXPECT_EQ(1u, stats.last.b_clients);
+            EXPECT_DOUBLE_EQ(0.25, stats.last.burst_utilisation);
+            EXPECT_EQ(2u, stats.last.a_clients);
+            EXPECT_DOUBLE_EQ(1.0, stats.last.fairness);
+
+            // one A client gets everything; a quarter of client 2's
+            // reservation
+            lock_pq([&]() {
+                pq.client_map.at(2)->r0_counter = 1;
+                pq.client_map.at(4)->win_dispatched = 0;
+                pq.client_map.at(5)->win_dispatched = 4;
+            });
+            ASSERT_TRUE(pq.pull_request(start + 2).is_retn());
+            stats = pq.get_qos_stats();
+            EXPECT_DOUBLE_EQ(0.5, stats.last.fairness);
+            EXPECT_DOUBLE_EQ(0.75, stats.mean_fairness());
+
+            EXPECT_DOUBLE_EQ(0.25, stats.last_reservation_attainment.at(2));
+
+            pq.reset_qos_stats();
+            EXPECT_EQ(0u, pq.get_qos_stats().windows);
+            EXPECT_TRUE(pq.get_qos_stats().last_reservation_attainment.empty());
+        } // TEST
+
+
+        TEST(dmclock_server_pull, memory_usage) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client1 == c ? &info1 : &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            EXPECT_EQ(0u, pq->memory_usage().total());
+
+            dmc::Time start = dmc::get_time();
+            pq->add_request_time(Request{}, client1, req_params, start);
+            pq->add_request_time(Request{}, client2, req_params, start);
+            const dmc::MemoryUsage two = pq->memory_usage();
+            EXPECT_LT(0u, two.client_records);
+            EXPECT_LT(0u, two.request_storage);
+            EXPECT_LT(0u, two.heap_arrays);
+            EXPECT_EQ(2 * sizeof(dmc::ClientInfo), two.client_infos);
+            EXPECT_LT(0u, two.side_maps);
+            EXPECT_LT(two.by_class[dmc::ClientType::A], two.by_class[dmc::ClientType::R])
+                                << "an R client is in three heaps, an A client in two";
+            EXPECT_EQ(0u, two.by_class[dmc::ClientType::B]);
+            EXPECT_EQ(two.total(),
+                      two.by_class[dmc::ClientType::R] + two.by_class[dmc::ClientType::A] +
+                      two.side_maps) << "all per-client state is in a class";
+
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+            }
+            const dmc::MemoryUsage five = pq->memory_usage();
+            EXPECT_LE(two.request_storage + 3 * sizeof(Request), five.request_storage);
+            EXPECT_EQ(two.client_records, five.client_records);
+            EXPECT_EQ(two.by_class[dmc::ClientType::A], five.by_class[dmc::ClientType::A]);
+
+            while (pq->pull_request(start).is_retn()) {
+            }
+            EXPECT_EQ(two.request_storage - 2 * sizeof(Request),
+                      pq->memory_usage().request_storage) << "each client's deque remains";
+
+            // expiry marks outlive the dispatch of their request, and
+            // dispatch times are kept for the background target
+            const dmc::MemoryUsage drained = pq->memory_usage();
+            pq->add_request_expiry(Request{}, client2, req_params, start + 60.0);
+            ASSERT_TRUE(pq->pull_request().is_retn());
+            const dmc::MemoryUsage marked = pq->memory_usage();
+            EXPECT_LT(drained.side_maps, marked.side_maps);
+            EXPECT_LT(drained.by_class[dmc::ClientType::A], marked.by_class[dmc::ClientType::A]);
+            EXPECT_EQ(drained.by_class[dmc::ClientType::R], marked.by_class[dmc::ClientType::R]);
+
+            pq->set_background_target(0.1, 1.0, 0.5);
+            pq->add_request(Request{}, client2, req_params);
+            ASSERT_TRUE(pq->pull_request().is_retn());
+            const dmc::MemoryUsage dispatched = pq->memory_usage();
+            EXPECT_LT(marked.by_class[dmc::ClientType::A], dispatched.by_class[dmc::ClientType::A])
+                                << "an outstanding dispatch time is charged to the A class";
+            EXPECT_EQ(marked.by_class[dmc::ClientType::R], dispatched.by_class[dmc::ClientType::R]);
+            pq->request_completed(client2);
+            EXPECT_LE(pq->memory_usage().side_maps, dispatched.side_maps);
+        } // TEST
+
+
+        TEST(dmclock_server_pull, delay_tracking) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            ClientId client1 = 17;
+            ClientId client2 = 98;
+
+            dmc::ClientInfo info1(2.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo info2(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return client1 == c ? &info1 : &info2;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            dmc::Time start = dmc::get_time();
+            for (int i = 0; i < 3; ++i) {
+                pq->add_request_time(Request{}, client1, req_params, start);
+                pq->add_request_time(Request{}, client2, req_params, start);
+            }
+            ASSERT_TRUE(pq->pull_request(start).is_retn());
+            EXPECT_EQ(0u, pq->get_class_delay(dmc::ClientType::R).get_count() +
+                          pq->get_class_delay(dmc::ClientType::A).get_count())
+                                << "off by default";
+
+            pq->enable_delay_tracking(true);
+            pq->track_client_delay(client2, true);
+            for (int i = 0; i < 4; ++i) {
+                ASSERT_TRUE(pq->pull_request(start + 0.5).is_retn());
+            }
+
+            const auto r = pq->get_class_delay(dmc::ClientType::R);
+            const auto a = pq->get_class_delay(dmc::ClientType::A);
+            EXPECT_EQ(4u, r.get_count() + a.get_count());
+            EXPECT_EQ(500000, r.get_count() ? r.get_high() : a.get_high());
+            EXPECT_EQ(500000, r.get_count() ? r.get_low() : a.get_low());
+            uint phases = 0;
+            for (size_t p = 0; p < dmc::delay_phase_count; ++p) {
+                phases += pq->get_phase_delay(dmc::DelayPhase(p)).get_count();
+            }
+            EXPECT_EQ(4u, phases);
+            EXPECT_EQ(a.get_count(), pq->get_client_delay(client2).get_count());
+            EXPECT_EQ(0u, pq->get_client_delay(client1).get_count()) << "not tracked";
+
+            pq->track_client_delay(client2, false);
+            EXPECT_EQ(0u, pq->get_client_delay(client2).get_count());
+            pq->enable_delay_tracking(false);
+            EXPECT_EQ(0u, pq->get_class_delay(dmc::ClientType::R).get_count());
+        } // TEST
+
+
+        TEST(dmclock_server_pull, chunked_snapshot) {
+            using ClientId = int;
+            using Queue = dmc::PullPriorityQueue<ClientId, Request, false>;
+            using QueueRef = std::unique_ptr<Queue>;
+
+            dmc::ClientInfo r_info(1.0, 1.0, 0.0, dmc::ClientType::R);
+            dmc::ClientInfo a_info(0, 1.0, 0.0, dmc::ClientType::A);
+
+            QueueRef pq;
+
+            auto client_info_f = [&](ClientId c) -> const dmc::ClientInfo * {
+                return c < 10 ? &r_info : &a_info;
+            };
+
+            pq = QueueRef(new Queue(client_info_f, 10, 1, false));
+            ReqParams req_params(1, 1);
+
+            std::ostringstream empty;
+            empty << *pq;
+            EXPECT_EQ("{ PriorityQueue:: HEAPS-EMPTY }", empty.str());
+
+            // R clients 1 to 5, one request more each; A clients 11 to 13
+            dmc::Time start = dmc::get_time();
+            for (ClientId c = 5; c >= 1; --c) {
+                for (int i = 0; i < c; ++i) {
+                    pq->add_request_time(Request{}, c, req_params, start + c);
+                }
+            }
+            for (ClientId c = 11; c <= 13; ++c) {
+                pq->add_request_time(Request{}, c, req_params, start);
+            }
+
+            auto snap = pq->snapshot(3);
+            ASSERT_EQ(8u, snap.records.size()) << "every client, across chunks";
+            for (size_t i = 1; i < snap.records.size(); ++i) {
+                EXPECT_LT(snap.records[i - 1].client, snap.records[i].client);
+            }
+            EXPECT_EQ(4u, snap.records[3].request_count);
+            EXPECT_EQ(dmc::ClientType::A, snap.records[5].client_type);
+            ASSERT_TRUE(snap.resv_top);
+            EXPECT_EQ(1, snap.resv_top->client) << "earliest reservation tag";
+            EXPECT_FALSE(snap.limit_top) << "no B clients";
+
+            std::ostringstream queues;
+            pq->display_queues(queues, true, false, false, false);
+            const std::string shown = queues.str();
+            EXPECT_EQ(0u, shown.find("RESER:{ ClientRec:: client:1 "));
+            EXPECT_NE(std::string::npos, shown.find("DELTA:"));
+            EXPECT_EQ(std::string::npos, shown.find("client:11")) << "A clients are in neither heap";
+            EXPECT_LT(shown.find("client:2 "), shown.find("client:5 ")) << "in reservation order";
+
+            std::ostringstream all;
+            all << *pq;
+            EXPECT_NE(std::string::npos, all.str().find("{ client:13, record:{ ClientRec:: client:13"));
+            EXPECT_NE(std::string::npos, all.str().find("reservation_top:{ ClientRec:: client:1 "));
+        } // TEST
     } // namespace dmclock
 } // namespace crimson
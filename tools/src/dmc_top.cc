@@ -0,0 +1,129 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Copyright (C) 2021 Renmin Univeristy of China
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License version
+ * 2.1, as published by the Free Software Foundation.  See file
+ * COPYING.
+ */
+
+/*
+ * Shows the per-client IOPS, by phase, of the last window a queue
+ * published with publish_shm_stats. Read only; the queue is not
+ * disturbed.
+ *
+ *   dmc_top [-n iterations] [-d delay_seconds] /segment-name
+ */
+
+
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "dmclock_shm.h"
+
+
+namespace dmc = crimson::dmclock;
+
+
+namespace {
+
+  const char* type_names[] = { "R", "B", "A", "O" };
+
+  void usage(const char* prog) {
+    std::cerr << "usage: " << prog <<
+      " [-n iterations] [-d delay_seconds] /segment-name" << std::endl;
+  }
+
+  void show(const dmc::ShmStats& stats, bool clear) {
+    const double per_sec = stats.win_size > 0.0 ? 1.0 / stats.win_size : 0.0;
+    if (clear) {
+      printf("\033[H\033[2J");
+    }
+    printf("window %llu  start %.3f  size %.1fs  queued %llu\n\n",
+	   (unsigned long long) stats.windows, stats.win_start, stats.win_size,
+	   (unsigned long long) stats.queued);
+
+    printf("%-5s %7s %7s %10s %10s\n",
+	   "class", "clients", "queued", "iops", "rate");
+    for (int t = 0; t < 4; ++t) {
+      const auto& c = stats.classes[t];
+      printf("%-5s %7llu %7llu %10.1f %10.1f\n",
+	     type_names[t], (unsigned long long) c.clients,
+	     (unsigned long long) c.depth, c.dispatched * per_sec,
+	     c.service_rate);
+    }
+
+    // a limit break is shown with the phase it broke the limit in
+    printf("\n%-8s %7s %9s %9s %9s %9s %9s %9s\n",
+	   "client", "queued", "resource", "comp",
+	   "resv", "deltar", "burst", "best");
+    for (const auto& c : stats.clients) {
+      char name[32];
+      snprintf(name, sizeof(name), "%s_%llu",
+	       c.type < 4 ? type_names[c.type] : "?",
+	       (unsigned long long) c.id);
+      const auto& d = c.dispatched;
+      printf("%-8s %7llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	     name, (unsigned long long) c.depth, c.resource, c.compensation,
+	     (d[size_t(dmc::ShmPhase::reservation)] +
+	      d[size_t(dmc::ShmPhase::reservation_break)]) * per_sec,
+	     (d[size_t(dmc::ShmPhase::deltar)] +
+	      d[size_t(dmc::ShmPhase::deltar_break)]) * per_sec,
+	     (d[size_t(dmc::ShmPhase::burst)] +
+	      d[size_t(dmc::ShmPhase::burst_break)]) * per_sec,
+	     (d[size_t(dmc::ShmPhase::best_effort)] +
+	      d[size_t(dmc::ShmPhase::best_effort_break)]) * per_sec);
+    }
+    fflush(stdout);
+  }
+
+} // namespace
+
+
+int main(int argc, char* argv[]) {
+  int iterations = 0; // forever
+  double delay = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+    if ('n' == opt) {
+      iterations = atoi(optarg);
+    } else if ('d' == opt) {
+      delay = atof(optarg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  dmc::ShmStatsReader reader;
+  if (!reader.open(argv[optind])) {
+    std::cerr << argv[0] << ": cannot open segment " << argv[optind] <<
+      std::endl;
+    return 1;
+  }
+
+  const bool clear = 1 != iterations && isatty(STDOUT_FILENO);
+  for (int i = 0; 0 == iterations || i < iterations; ++i) {
+    if (i > 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+    }
+    dmc::ShmStats stats;
+    if (!reader.read(stats)) {
+      continue;
+    }
+    show(stats, clear);
+  }
+  return 0;
+}